@@ -0,0 +1,205 @@
+/* mtd64-ng - a lightweight multithreaded C++11 DNS64 server
+ * Based on MTD64 (https://github.com/Yoso89/MTD64)
+ * Copyright (C) 2015  Daniel Bakai <bakaid@kszk.bme.hu>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+#include "batchio.h"
+#include "bufferpool.h"
+#include <cerrno>
+#include <cstring>
+#include <syslog.h>
+#include <utility>
+
+namespace {
+/*
+ * Source of the unique BatchIO identifiers. Identifiers are never reused, so
+ * a stale entry in a per-thread cache can not match a new BatchIO.
+ */
+std::atomic<unsigned long> next_id{1};
+
+/*
+ * Per-thread cache of the send queues belonging to this thread.
+ */
+thread_local std::vector<std::pair<unsigned long, SendQueue *>> local_queues;
+} // namespace
+
+SendQueue::SendQueue(size_t batch_size, size_t maxlen)
+    : count_{0}, data_(batch_size * maxlen), iov_(batch_size),
+      msg_(batch_size), addr_(batch_size) {
+  memset(msg_.data(), 0x00, sizeof(struct mmsghdr) * batch_size);
+  for (size_t i = 0; i < batch_size; i++) {
+    iov_[i].iov_base = data_.data() + i * maxlen;
+    msg_[i].msg_hdr.msg_iov = &iov_[i];
+    msg_[i].msg_hdr.msg_iovlen = 1;
+    msg_[i].msg_hdr.msg_name = &addr_[i];
+    msg_[i].msg_hdr.msg_namelen = sizeof(addr_[i]);
+  }
+}
+
+BatchIO::BatchIO(int sockfd, size_t batch_size,
+                 std::chrono::microseconds flush_time, size_t maxlen,
+                 BufferPool &buffers)
+    : sockfd_{sockfd}, batch_size_{batch_size > 0 ? batch_size : 1},
+      maxlen_{maxlen}, buffers_(buffers), flush_time_{flush_time},
+      id_{next_id++}, recv_buffers_(batch_size_, nullptr),
+      recv_iov_(batch_size_), recv_msg_(batch_size_), recv_addr_(batch_size_),
+      stop_{false} {
+  memset(recv_msg_.data(), 0x00, sizeof(struct mmsghdr) * batch_size_);
+  /* Without batching every response is sent right away */
+  if (batch_size_ > 1) {
+    flusher_ = std::thread{&BatchIO::flusherLoop, this};
+  }
+}
+
+BatchIO::~BatchIO() {
+  if (flusher_.joinable()) {
+    std::unique_lock<std::mutex> lock{flusher_m_};
+    stop_ = true;
+    lock.unlock();
+    flusher_cv_.notify_all();
+    flusher_.join();
+  }
+  for (auto &q : queues_) {
+    std::unique_lock<std::mutex> lock{q->m_};
+    flushQueue(*q);
+  }
+  for (auto buffer : recv_buffers_) {
+    buffers_.release(buffer);
+  }
+}
+
+int BatchIO::receive() {
+  for (size_t i = 0; i < batch_size_; i++) {
+    if (recv_buffers_[i] == nullptr) {
+      recv_buffers_[i] = buffers_.acquire();
+    }
+    recv_iov_[i].iov_base = recv_buffers_[i];
+    recv_iov_[i].iov_len = maxlen_;
+    recv_msg_[i].msg_hdr.msg_iov = &recv_iov_[i];
+    recv_msg_[i].msg_hdr.msg_iovlen = 1;
+    recv_msg_[i].msg_hdr.msg_name = &recv_addr_[i];
+    recv_msg_[i].msg_hdr.msg_namelen = sizeof(recv_addr_[i]);
+    recv_msg_[i].msg_hdr.msg_flags = 0;
+    recv_msg_[i].msg_len = 0;
+  }
+  /* Block until the first packet, then take whatever is already queued */
+  return recvmmsg(sockfd_, recv_msg_.data(), batch_size_, MSG_WAITFORONE,
+                  nullptr);
+}
+
+uint8_t *BatchIO::take(int i) {
+  uint8_t *buffer = recv_buffers_[i];
+  recv_buffers_[i] = nullptr;
+  return buffer;
+}
+
+void BatchIO::release(uint8_t *buffer) { buffers_.release(buffer); }
+
+size_t BatchIO::length(int i) const { return recv_msg_[i].msg_len; }
+
+bool BatchIO::truncated(int i) const {
+  return recv_msg_[i].msg_hdr.msg_flags & MSG_TRUNC;
+}
+
+const struct sockaddr_in6 &BatchIO::sender(int i) const {
+  return recv_addr_[i];
+}
+
+socklen_t BatchIO::senderLength(int i) const {
+  return recv_msg_[i].msg_hdr.msg_namelen;
+}
+
+SendQueue &BatchIO::queue() {
+  for (auto &entry : local_queues) {
+    if (entry.first == id_) {
+      return *entry.second;
+    }
+  }
+  std::unique_lock<std::mutex> lock{queues_m_};
+  queues_.emplace_back(new SendQueue{batch_size_, maxlen_});
+  SendQueue *q = queues_.back().get();
+  lock.unlock();
+  local_queues.emplace_back(id_, q);
+  return *q;
+}
+
+void BatchIO::flushQueue(SendQueue &q) {
+  size_t sent = 0;
+  while (sent < q.count_) {
+    int res = sendmmsg(sockfd_, q.msg_.data() + sent, q.count_ - sent, 0);
+    if (res == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      syslog(LOG_DAEMON | LOG_ERR,
+             "Can't send response: sendmmsg failure: %d (%s)", errno,
+             strerror(errno));
+      /* Skip the failing packet and try the rest */
+      sent++;
+      continue;
+    }
+    sent += res;
+  }
+  q.count_ = 0;
+}
+
+bool BatchIO::send(const uint8_t *data, size_t len,
+                   const struct sockaddr_in6 &to) {
+  if (len > maxlen_) {
+    return false;
+  }
+  SendQueue &q = queue();
+  std::unique_lock<std::mutex> lock{q.m_};
+  size_t slot = q.count_++;
+  memcpy(q.iov_[slot].iov_base, data, len);
+  q.iov_[slot].iov_len = len;
+  q.addr_[slot] = to;
+  q.msg_[slot].msg_hdr.msg_namelen = sizeof(to);
+  if (slot == 0) {
+    q.oldest_ = std::chrono::steady_clock::now();
+  }
+  if (q.count_ == batch_size_ ||
+      std::chrono::steady_clock::now() - q.oldest_ >= flush_time_) {
+    flushQueue(q);
+  }
+  return true;
+}
+
+void BatchIO::flush() {
+  SendQueue &q = queue();
+  std::unique_lock<std::mutex> lock{q.m_};
+  flushQueue(q);
+}
+
+void BatchIO::flusherLoop() {
+  std::unique_lock<std::mutex> lock{flusher_m_};
+  while (!stop_) {
+    flusher_cv_.wait_for(lock, flush_time_);
+    std::chrono::steady_clock::time_point now =
+        std::chrono::steady_clock::now();
+    std::unique_lock<std::mutex> queues_lock{queues_m_};
+    for (auto &q : queues_) {
+      std::unique_lock<std::mutex> q_lock{q->m_, std::try_to_lock};
+      /* A busy queue is being flushed or filled by its owner */
+      if (q_lock.owns_lock() && q->count_ > 0 &&
+          now - q->oldest_ >= flush_time_) {
+        flushQueue(*q);
+      }
+    }
+  }
+}
@@ -0,0 +1,243 @@
+/* mtd64-ng - a lightweight multithreaded C++11 DNS64 server
+ * Based on MTD64 (https://github.com/Yoso89/MTD64)
+ * Copyright (C) 2015  Daniel Bakai <bakaid@kszk.bme.hu>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+/** @file
+ *  @brief Header for the BatchIO and related classes.
+ */
+
+#ifndef BATCHIO_H_INCLUDED
+#define BATCHIO_H_INCLUDED
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <thread>
+#include <vector>
+
+class BufferPool;
+
+/**
+ * Interface of the packet receiving engines.
+ * receive() fills the engine's buffers with a batch of packets. A buffer
+ * taken out of the batch with take() belongs to the caller until it is given
+ * back with release().
+ */
+class Receiver {
+public:
+  /**
+   * Receives a batch of packets, blocking until at least one arrives.
+   * The received packets can be accessed until the next call.
+   * @return the number of received packets (-1 on failure, errno is set)
+   */
+  virtual int receive() = 0;
+
+  /**
+   * Takes over a received packet.
+   * @param i the index of the packet
+   * @return the packet
+   */
+  virtual uint8_t *take(int i) = 0;
+
+  /**
+   * Gives back a packet buffer returned by take().
+   * @param buffer the packet
+   */
+  virtual void release(uint8_t *buffer) = 0;
+
+  /**
+   * Returns the length of a received packet.
+   * @param i the index of the packet
+   * @return the length
+   */
+  virtual size_t length(int i) const = 0;
+
+  /**
+   * Returns whether a received packet was truncated.
+   * @param i the index of the packet
+   * @return true if the packet was longer than the buffer
+   */
+  virtual bool truncated(int i) const = 0;
+
+  /**
+   * Returns the sender of a received packet.
+   * @param i the index of the packet
+   * @return the address of the sender
+   */
+  virtual const struct sockaddr_in6 &sender(int i) const = 0;
+
+  /**
+   * Returns the length of the address of a sender.
+   * @param i the index of the packet
+   * @return the length of the address
+   */
+  virtual socklen_t senderLength(int i) const = 0;
+
+  /**
+   * Virtual destructor.
+   */
+  virtual ~Receiver() {}
+};
+
+/**
+ * A queue of outgoing packets owned by a single sending thread.
+ * The queue is flushed with one sendmmsg call when it is full, or by the
+ * flusher thread of the BatchIO when its oldest packet reaches the deadline.
+ */
+struct SendQueue {
+  std::mutex m_;                    /**< Mutex against the flusher thread. */
+  size_t count_;                    /**< Number of queued packets. */
+  std::vector<uint8_t> data_;       /**< Storage of the queued packets. */
+  std::vector<struct iovec> iov_;   /**< One iovec for each slot. */
+  std::vector<struct mmsghdr> msg_; /**< One message header for each slot. */
+  std::vector<struct sockaddr_in6> addr_; /**< Destination of each slot. */
+  std::chrono::steady_clock::time_point
+      oldest_; /**< Time when the first queued packet was added. */
+
+  /**
+   * Constructor.
+   * @param batch_size the number of slots
+   * @param maxlen the maximum length of a packet
+   */
+  SendQueue(size_t batch_size, size_t maxlen);
+};
+
+/**
+ * Batched UDP I/O engine.
+ * Receives up to batch_size datagrams with a single recvmmsg call and sends
+ * the responses through per-thread queues, which are flushed with sendmmsg.
+ * With a batch size of 1 it behaves like the plain recvfrom/sendto loop.
+ */
+class BatchIO : public Receiver {
+private:
+  int sockfd_;        /**< The socket to use. */
+  size_t batch_size_; /**< Maximum number of packets per syscall. */
+  size_t maxlen_;     /**< Maximum length of a packet. */
+  BufferPool &buffers_; /**< The pool of the receive buffers. */
+  std::chrono::microseconds
+      flush_time_; /**< Maximum time a response can wait in a queue. */
+  unsigned long id_; /**< Unique identifier used by the per-thread lookup. */
+
+  std::vector<uint8_t *> recv_buffers_;    /**< Receive buffers. */
+  std::vector<struct iovec> recv_iov_;     /**< Receive iovecs. */
+  std::vector<struct mmsghdr> recv_msg_;   /**< Receive message headers. */
+  std::vector<struct sockaddr_in6> recv_addr_; /**< Sender addresses. */
+
+  std::mutex queues_m_; /**< Mutex for the queues_ vector. */
+  std::vector<std::unique_ptr<SendQueue>>
+      queues_; /**< Send queues of the sending threads. */
+
+  std::mutex flusher_m_;            /**< Mutex for the flusher thread. */
+  std::condition_variable flusher_cv_; /**< Used to wake up the flusher. */
+  std::atomic<bool> stop_;          /**< Used to stop the flusher. */
+  std::thread flusher_;             /**< The flusher thread. */
+
+  /**
+   * Returns the send queue of the calling thread, creating it if needed.
+   * @return the send queue
+   */
+  SendQueue &queue();
+
+  /**
+   * Sends all packets in a queue. The caller must hold the queue's mutex.
+   * @param q the queue to flush
+   */
+  void flushQueue(SendQueue &q);
+
+  /**
+   * Main loop of the flusher thread.
+   */
+  void flusherLoop();
+
+public:
+  /**
+   * Constructor.
+   * @param sockfd the socket to use
+   * @param batch_size the maximum number of packets per syscall
+   * @param flush_time the maximum time a response can wait in a queue
+   * @param maxlen the maximum length of a packet
+   * @param buffers the pool of the receive buffers (of at least maxlen bytes)
+   */
+  BatchIO(int sockfd, size_t batch_size, std::chrono::microseconds flush_time,
+          size_t maxlen, BufferPool &buffers);
+
+  /**
+   * Destructor.
+   * Flushes the remaining responses and stops the flusher thread.
+   */
+  ~BatchIO();
+
+  /**
+   * Copy constructor, explicitly deleted.
+   */
+  BatchIO(const BatchIO &) = delete;
+
+  /**
+   * Copy assignment operator, explicitly deleted.
+   */
+  BatchIO &operator=(const BatchIO &) = delete;
+
+  /**
+   * Receives at most batch_size packets with one recvmmsg call.
+   * @return the number of received packets (-1 on failure, errno is set)
+   */
+  int receive() override;
+
+  /**
+   * Takes over a received packet.
+   * The buffer is taken from the BufferPool, and its size is at least maxlen.
+   * @param i the index of the packet
+   * @return the packet
+   */
+  uint8_t *take(int i) override;
+
+  /**
+   * Gives back a packet buffer returned by take() to the BufferPool.
+   * @param buffer the packet
+   */
+  void release(uint8_t *buffer) override;
+
+  size_t length(int i) const override;
+  bool truncated(int i) const override;
+  const struct sockaddr_in6 &sender(int i) const override;
+  socklen_t senderLength(int i) const override;
+
+  /**
+   * Queues a packet for sending from the calling thread's queue.
+   * The packet is copied, so the buffer can be reused right after the call.
+   * @param data the packet
+   * @param len the length of the packet
+   * @param to the destination address
+   * @return false if the packet can not be sent
+   */
+  bool send(const uint8_t *data, size_t len, const struct sockaddr_in6 &to);
+
+  /**
+   * Flushes the calling thread's queue immediately.
+   */
+  void flush();
+};
+
+#endif
@@ -0,0 +1,162 @@
+/* mtd64-ng - a lightweight multithreaded C++11 DNS64 server
+ * Based on MTD64 (https://github.com/Yoso89/MTD64)
+ * Copyright (C) 2015  Daniel Bakai <bakaid@kszk.bme.hu>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+/** @file
+ *  @brief Benchmark of the RFC 6052 address synthesis.
+ *  Compares the former synthesis of mtd64-ng, a memset, a memcpy of the
+ *  prefix and a switch on the prefix length for every address, with the
+ *  kernels of PrefixSynthesizer specialized on the prefix length, one by one
+ *  and in batches with and without SSSE3.
+ *  Usage: synthbench [addresses] [rounds]
+ */
+
+#include "../synth.h"
+#include <arpa/inet.h>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+namespace {
+/*
+ * The prefix lengths of RFC 6052.
+ */
+const unsigned lengths[] = {32, 40, 48, 56, 64, 96};
+
+/*
+ * The former Server::synth, kept out of line like the member function.
+ */
+__attribute__((noinline)) void switchSynth(const struct in6_addr &prefix,
+                                           unsigned char length,
+                                           const uint8_t *v4, uint8_t *v6) {
+  memset(v6, 0x00, 16);
+  memcpy(v6, prefix.s6_addr, length / 8);
+  switch (length) {
+  case 32:
+    memcpy(v6 + 4, v4, 4);
+    break;
+  case 40:
+    memcpy(v6 + 5, v4, 3);
+    memcpy(v6 + 9, v4 + 3, 1);
+    break;
+  case 48:
+    memcpy(v6 + 6, v4, 2);
+    memcpy(v6 + 9, v4 + 2, 2);
+    break;
+  case 56:
+    memcpy(v6 + 7, v4, 1);
+    memcpy(v6 + 9, v4 + 1, 3);
+    break;
+  case 64:
+    memcpy(v6 + 9, v4, 4);
+    break;
+  case 96:
+    memcpy(v6 + 12, v4, 4);
+    break;
+  }
+}
+
+/*
+ * Returns the nanoseconds per address of a run.
+ */
+double perAddress(std::chrono::steady_clock::time_point start,
+                  size_t addresses) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now() - start)
+             .count() /
+         static_cast<double>(addresses);
+}
+
+/*
+ * Prints the time of a run and checks its result against the former
+ * synthesis.
+ */
+void report(const char *name, double ns, const std::vector<uint8_t> &result,
+            const std::vector<uint8_t> &expected) {
+  printf("  %-24s %8.2f ns/address%s\n", name, ns,
+         result == expected ? "" : "  MISMATCH");
+}
+} // namespace
+
+int main(int argc, char **argv) {
+  size_t addresses = argc > 1 ? strtoul(argv[1], nullptr, 10) : 4096;
+  size_t rounds = argc > 2 ? strtoul(argv[2], nullptr, 10) : 2000;
+  if (addresses == 0 || rounds == 0) {
+    fprintf(stderr, "Usage: synthbench [addresses] [rounds]\n");
+    return 1;
+  }
+  std::vector<uint8_t> v4(4 * addresses);
+  for (size_t i = 0; i < v4.size(); i++) {
+    v4[i] = rand() & 0xff;
+  }
+  std::vector<uint8_t> expected(16 * addresses);
+  std::vector<uint8_t> result(16 * addresses);
+  struct in6_addr prefix;
+  inet_pton(AF_INET6, "2001:db8:1122:3344:5566:7788::", &prefix);
+  PrefixSynthesizer scalar{false};
+  PrefixSynthesizer simd{true};
+  printf("%zu addresses, %zu rounds, SSSE3 %s\n", addresses, rounds,
+         simd.simd() ? "used" : "not available");
+
+  for (unsigned length : lengths) {
+    printf("\n/%u:\n", length);
+    scalar.prefix(prefix, length);
+    simd.prefix(prefix, length);
+
+    std::chrono::steady_clock::time_point start =
+        std::chrono::steady_clock::now();
+    for (size_t r = 0; r < rounds; r++) {
+      for (size_t i = 0; i < addresses; i++) {
+        switchSynth(prefix, length, &v4[4 * i], &expected[16 * i]);
+      }
+    }
+    report("switch", perAddress(start, addresses * rounds), expected,
+           expected);
+
+    start = std::chrono::steady_clock::now();
+    for (size_t r = 0; r < rounds; r++) {
+      for (size_t i = 0; i < addresses; i++) {
+        scalar(&v4[4 * i], &result[16 * i]);
+      }
+    }
+    report("specialized", perAddress(start, addresses * rounds), result,
+           expected);
+
+    std::fill(result.begin(), result.end(), 0);
+    start = std::chrono::steady_clock::now();
+    for (size_t r = 0; r < rounds; r++) {
+      scalar(v4.data(), result.data(), addresses);
+    }
+    report("specialized batch", perAddress(start, addresses * rounds),
+           result, expected);
+
+    if (simd.simd()) {
+      std::fill(result.begin(), result.end(), 0);
+      start = std::chrono::steady_clock::now();
+      for (size_t r = 0; r < rounds; r++) {
+        simd(v4.data(), result.data(), addresses);
+      }
+      report("SSSE3 batch", perAddress(start, addresses * rounds), result,
+             expected);
+    }
+  }
+  return 0;
+}
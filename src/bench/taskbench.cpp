@@ -0,0 +1,210 @@
+/* mtd64-ng - a lightweight multithreaded C++11 DNS64 server
+ * Based on MTD64 (https://github.com/Yoso89/MTD64)
+ * Copyright (C) 2015  Daniel Bakai <bakaid@kszk.bme.hu>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+/** @file
+ *  @brief Benchmark of the task queues of ThreadPool.
+ *  Compares the enqueue/dequeue cost and the allocations of a deque of
+ *  std::function (the former task queue) with the Task based queues, then
+ *  the throughput of ThreadPool with each queue engine.
+ *  Usage: taskbench [tasks] [threads]
+ */
+
+#include "../pool.h"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <new>
+
+namespace {
+/*
+ * Number of allocations since the start.
+ */
+std::atomic<unsigned long> allocations{0};
+
+/*
+ * Sink of the tasks, so they are not optimized out.
+ */
+std::atomic<unsigned long> executed{0};
+
+/*
+ * A task of the size of the Query of mtd64-ng.
+ */
+struct Payload {
+  char data_[Task::capacity - sizeof(void *)];
+  std::atomic<unsigned long> *counter_;
+
+  Payload(std::atomic<unsigned long> &counter) : counter_{&counter} {
+    data_[0] = 1;
+  }
+  void operator()() {
+    counter_->fetch_add(data_[0], std::memory_order_relaxed);
+  }
+};
+
+/*
+ * Returns the nanoseconds per task of a run.
+ */
+double perTask(std::chrono::steady_clock::time_point start, size_t tasks) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now() - start)
+             .count() /
+         static_cast<double>(tasks);
+}
+
+/*
+ * Pushes and pops the tasks through the former task queue of ThreadPool, a
+ * deque of std::function protected by a mutex, in bursts of a batch of
+ * packets.
+ */
+void benchFunction(size_t tasks) {
+  std::deque<std::function<void(void)>> queue;
+  std::mutex m;
+  unsigned long before = allocations;
+  std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+  for (size_t i = 0; i < tasks; i += 64) {
+    for (size_t j = 0; j < 64; j++) {
+      std::unique_lock<std::mutex> lock{m};
+      queue.push_back(Payload{executed});
+    }
+    for (size_t j = 0; j < 64; j++) {
+      std::unique_lock<std::mutex> lock{m};
+      std::function<void(void)> task = std::move(queue.front());
+      queue.pop_front();
+      lock.unlock();
+      task();
+    }
+  }
+  double ns = perTask(start, tasks);
+  printf("%-28s %8.1f ns/task %8.2f allocations/task\n",
+         "std::function deque", ns,
+         (allocations - before) / static_cast<double>(tasks));
+}
+
+/*
+ * Pushes and pops the tasks through a TaskQueue protected by a mutex, in
+ * bursts of a batch of packets.
+ */
+void benchQueue(size_t tasks) {
+  TaskQueue queue;
+  std::mutex m;
+  unsigned long before = allocations;
+  std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+  for (size_t i = 0; i < tasks; i += 64) {
+    for (size_t j = 0; j < 64; j++) {
+      std::unique_lock<std::mutex> lock{m};
+      queue.push(Payload{executed});
+    }
+    for (size_t j = 0; j < 64; j++) {
+      std::unique_lock<std::mutex> lock{m};
+      Task task = queue.popFront();
+      lock.unlock();
+      task();
+    }
+  }
+  double ns = perTask(start, tasks);
+  printf("%-28s %8.1f ns/task %8.2f allocations/task\n", "TaskQueue", ns,
+         (allocations - before) / static_cast<double>(tasks));
+}
+
+/*
+ * Pushes and pops the tasks through a TaskRing, in bursts of a batch of
+ * packets.
+ */
+void benchRing(size_t tasks) {
+  TaskRing ring{1024};
+  unsigned long before = allocations;
+  std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+  for (size_t i = 0; i < tasks; i += 64) {
+    for (size_t j = 0; j < 64; j++) {
+      Task task{Payload{executed}};
+      ring.push(task);
+    }
+    for (size_t j = 0; j < 64; j++) {
+      Task task;
+      ring.pop(task);
+      task();
+    }
+  }
+  double ns = perTask(start, tasks);
+  printf("%-28s %8.1f ns/task %8.2f allocations/task\n", "TaskRing", ns,
+         (allocations - before) / static_cast<double>(tasks));
+}
+
+/*
+ * Runs the tasks on a ThreadPool, added by a single producer like the
+ * receive thread of a Listener.
+ */
+void benchPool(const char *name, ThreadPool::queueKind queue, size_t tasks,
+               size_t threads) {
+  std::atomic<unsigned long> done{0};
+  ThreadPool pool{threads, queue};
+  unsigned long before = allocations;
+  std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+  for (size_t i = 0; i < tasks; i++) {
+    pool.addTask(Payload{done});
+  }
+  while (done.load(std::memory_order_relaxed) < tasks) {
+    std::this_thread::yield();
+  }
+  double ns = perTask(start, tasks);
+  printf("%-28s %8.1f ns/task %8.2f allocations/task\n", name, ns,
+         (allocations - before) / static_cast<double>(tasks));
+  pool.stop();
+}
+} // namespace
+
+void *operator new(size_t size) {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  void *p = malloc(size);
+  if (p == nullptr) {
+    throw std::bad_alloc{};
+  }
+  return p;
+}
+
+void operator delete(void *p) noexcept { free(p); }
+
+int main(int argc, char **argv) {
+  size_t tasks = argc > 1 ? strtoul(argv[1], nullptr, 10) : 1000000;
+  size_t threads = argc > 2 ? strtoul(argv[2], nullptr, 10) : 4;
+  tasks = (tasks + 63) / 64 * 64;
+  printf("%zu tasks of %zu bytes, %zu worker threads\n\n", tasks,
+         sizeof(Payload), threads);
+
+  printf("Single thread enqueue + dequeue:\n");
+  benchFunction(tasks);
+  benchQueue(tasks);
+  benchRing(tasks);
+
+  printf("\nThreadPool, one producer:\n");
+  benchPool("mutex", ThreadPool::queueKind::MUTEX, tasks, threads);
+  benchPool("lockfree", ThreadPool::queueKind::LOCKFREE, tasks, threads);
+  benchPool("stealing", ThreadPool::queueKind::STEALING, tasks, threads);
+  return executed == 0;
+}
@@ -0,0 +1,185 @@
+/* mtd64-ng - a lightweight multithreaded C++11 DNS64 server
+ * Based on MTD64 (https://github.com/Yoso89/MTD64)
+ * Copyright (C) 2015  Daniel Bakai <bakaid@kszk.bme.hu>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+#include "bufferpool.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <new>
+#include <sys/mman.h>
+#include <syslog.h>
+#include <utility>
+
+namespace {
+/*
+ * Size of a cache line, the alignment of the buffers.
+ */
+const size_t cache_line = 64;
+
+/*
+ * Size of a hugepage, the granularity of a hugepage-backed mapping.
+ */
+const size_t hugepage_size = 2 * 1024 * 1024;
+
+/*
+ * Number of buffers moved between a thread's free list and the shared one
+ * at a time. A thread caches at most twice as many.
+ */
+const size_t batch = 32;
+
+/*
+ * Source of the unique BufferPool identifiers. Identifiers are never reused,
+ * so a stale entry in a per-thread cache can not match a new BufferPool.
+ */
+std::atomic<unsigned long> next_id{1};
+
+/*
+ * Per-thread cache of the free lists belonging to this thread.
+ */
+thread_local std::vector<std::pair<unsigned long, BufferCache *>> local_caches;
+} // namespace
+
+BufferCache::BufferCache(size_t capacity)
+    : acquired_{0}, released_{0}, overflows_{0} {
+  buffers_.reserve(capacity);
+}
+
+BufferPool::BufferPool(size_t buffer_size, size_t count, bool hugepages)
+    : buffer_size_{(buffer_size + cache_line - 1) & ~(cache_line - 1)},
+      count_{count}, region_{nullptr}, region_size_{0}, hugepages_{false},
+      id_{next_id++} {
+  if (buffer_size_ == 0) {
+    buffer_size_ = cache_line;
+  }
+  if (count_ == 0) {
+    return;
+  }
+  void *region = MAP_FAILED;
+  if (hugepages) {
+    region_size_ = (buffer_size_ * count_ + hugepage_size - 1) &
+                   ~(hugepage_size - 1);
+    region = mmap(nullptr, region_size_, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE,
+                  -1, 0);
+    if (region == MAP_FAILED) {
+      syslog(LOG_DAEMON | LOG_WARNING,
+             "Can't map the packet buffers on hugepages: %d (%s), falling "
+             "back to normal pages",
+             errno, strerror(errno));
+    } else {
+      hugepages_ = true;
+    }
+  }
+  if (region == MAP_FAILED) {
+    region_size_ = buffer_size_ * count_;
+    /* Faulting the pages in now keeps the page faults off the hot path */
+    region = mmap(nullptr, region_size_, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (region == MAP_FAILED) {
+      throw std::bad_alloc{};
+    }
+  }
+  region_ = static_cast<uint8_t *>(region);
+  free_.reserve(count_);
+  for (size_t i = count_; i > 0; i--) {
+    free_.push_back(region_ + (i - 1) * buffer_size_);
+  }
+}
+
+BufferPool::~BufferPool() {
+  if (region_ != nullptr) {
+    munmap(region_, region_size_);
+  }
+}
+
+BufferCache &BufferPool::cache() {
+  for (auto &entry : local_caches) {
+    if (entry.first == id_) {
+      return *entry.second;
+    }
+  }
+  std::unique_lock<std::mutex> lock{m_};
+  caches_.emplace_back(new BufferCache{2 * batch});
+  BufferCache *c = caches_.back().get();
+  lock.unlock();
+  local_caches.emplace_back(id_, c);
+  return *c;
+}
+
+uint8_t *BufferPool::acquire() {
+  BufferCache &c = cache();
+  c.acquired_.store(c.acquired_.load(std::memory_order_relaxed) + 1,
+                    std::memory_order_relaxed);
+  if (c.buffers_.empty()) {
+    std::unique_lock<std::mutex> lock{m_};
+    size_t n = std::min(batch, free_.size());
+    c.buffers_.insert(c.buffers_.end(), free_.end() - n, free_.end());
+    free_.resize(free_.size() - n);
+  }
+  if (c.buffers_.empty()) {
+    c.overflows_.store(c.overflows_.load(std::memory_order_relaxed) + 1,
+                       std::memory_order_relaxed);
+    return new uint8_t[buffer_size_];
+  }
+  uint8_t *buffer = c.buffers_.back();
+  c.buffers_.pop_back();
+  return buffer;
+}
+
+void BufferPool::release(uint8_t *buffer) {
+  if (buffer == nullptr) {
+    return;
+  }
+  BufferCache &c = cache();
+  c.released_.store(c.released_.load(std::memory_order_relaxed) + 1,
+                    std::memory_order_relaxed);
+  if (region_ == nullptr || buffer < region_ ||
+      buffer >= region_ + region_size_) {
+    delete[] buffer;
+    return;
+  }
+  c.buffers_.push_back(buffer);
+  if (c.buffers_.size() >= 2 * batch) {
+    std::unique_lock<std::mutex> lock{m_};
+    free_.insert(free_.end(), c.buffers_.end() - batch, c.buffers_.end());
+    c.buffers_.resize(c.buffers_.size() - batch);
+  }
+}
+
+size_t BufferPool::bufferSize() const { return buffer_size_; }
+
+BufferStats BufferPool::stats() {
+  BufferStats stats;
+  stats.buffer_size_ = buffer_size_;
+  stats.capacity_ = count_;
+  stats.hugepages_ = hugepages_;
+  unsigned long acquired = 0, released = 0, overflows = 0;
+  std::unique_lock<std::mutex> lock{m_};
+  for (auto &c : caches_) {
+    acquired += c->acquired_.load(std::memory_order_relaxed);
+    released += c->released_.load(std::memory_order_relaxed);
+    overflows += c->overflows_.load(std::memory_order_relaxed);
+  }
+  /* The counters are read one by one, so concurrent updates may skew the
+   * result a little */
+  stats.in_use_ = acquired >= released ? acquired - released : 0;
+  stats.overflows_ = overflows;
+  return stats;
+}
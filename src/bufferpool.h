@@ -0,0 +1,151 @@
+/* mtd64-ng - a lightweight multithreaded C++11 DNS64 server
+ * Based on MTD64 (https://github.com/Yoso89/MTD64)
+ * Copyright (C) 2015  Daniel Bakai <bakaid@kszk.bme.hu>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+/** @file
+ *  @brief Header for the BufferPool and related classes.
+ */
+
+#ifndef BUFFERPOOL_H_INCLUDED
+#define BUFFERPOOL_H_INCLUDED
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+/**
+ * Free list of a single thread.
+ * Only its owner thread touches the buffers, the counters are also read by
+ * BufferPool::stats().
+ */
+struct BufferCache {
+  std::vector<uint8_t *> buffers_;        /**< The cached free buffers. */
+  std::atomic<unsigned long> acquired_;  /**< Buffers taken by the thread. */
+  std::atomic<unsigned long> released_;  /**< Buffers given back by the
+                                            thread. */
+  std::atomic<unsigned long> overflows_; /**< Buffers allocated on the heap
+                                            because the pool was empty. */
+  char pad_[64]; /**< Keeps the counters of two threads off the same cache
+                    line. */
+
+  /**
+   * Constructor.
+   * @param capacity the maximum number of cached buffers
+   */
+  BufferCache(size_t capacity);
+};
+
+/**
+ * Occupancy of a BufferPool.
+ */
+struct BufferStats {
+  size_t buffer_size_;       /**< Size of a buffer in bytes. */
+  size_t capacity_;          /**< Number of buffers in the pool. */
+  size_t in_use_;            /**< Number of buffers taken and not released,
+                                including the overflows. */
+  unsigned long overflows_;  /**< Number of buffers allocated on the heap. */
+  bool hugepages_;           /**< Whether the pool is backed by hugepages. */
+};
+
+/**
+ * Pool of fixed-size packet buffers.
+ * The buffers are carved out of one mapping, each starting on its own cache
+ * line. Every thread has its own free list, which trades batches of buffers
+ * with the shared one, so taking and giving back a buffer needs no lock and
+ * no allocation. A buffer may be released on another thread than the one
+ * that acquired it.
+ * When the pool runs out, the buffers are allocated with new[], which is
+ * counted as an overflow.
+ */
+class BufferPool {
+private:
+  size_t buffer_size_; /**< Size of a buffer, rounded up to a cache line. */
+  size_t count_;       /**< Number of buffers in the mapping. */
+  uint8_t *region_;    /**< The mapping holding the buffers. */
+  size_t region_size_; /**< Size of the mapping. */
+  bool hugepages_;     /**< Whether the mapping is backed by hugepages. */
+  unsigned long id_;   /**< Unique identifier used by the per-thread lookup. */
+
+  std::mutex m_; /**< Mutex for free_ and caches_. */
+  std::vector<uint8_t *> free_; /**< The shared free list. */
+  std::vector<std::unique_ptr<BufferCache>>
+      caches_; /**< Free lists of the threads. */
+
+  /**
+   * Returns the free list of the calling thread, creating it if needed.
+   * @return the free list
+   */
+  BufferCache &cache();
+
+public:
+  /**
+   * Constructor.
+   * Maps the backing region of the buffers. If hugepages are requested but
+   * not available, it falls back to normal pages.
+   * @param buffer_size the minimum size of a buffer
+   * @param count the number of buffers
+   * @param hugepages whether to back the buffers with hugepages
+   */
+  BufferPool(size_t buffer_size, size_t count, bool hugepages);
+
+  /**
+   * Destructor.
+   * Every buffer must have been released.
+   */
+  ~BufferPool();
+
+  /**
+   * Copy constructor, explicitly deleted.
+   */
+  BufferPool(const BufferPool &) = delete;
+
+  /**
+   * Copy assignment operator, explicitly deleted.
+   */
+  BufferPool &operator=(const BufferPool &) = delete;
+
+  /**
+   * Takes a buffer from the pool.
+   * @return the buffer, of at least bufferSize() bytes
+   */
+  uint8_t *acquire();
+
+  /**
+   * Gives back a buffer returned by acquire().
+   * @param buffer the buffer (nullptr is ignored)
+   */
+  void release(uint8_t *buffer);
+
+  /**
+   * Getter for the size of the buffers.
+   * @return the size in bytes
+   */
+  size_t bufferSize() const;
+
+  /**
+   * Returns the occupancy of the pool.
+   * @return the statistics
+   */
+  BufferStats stats();
+};
+
+#endif
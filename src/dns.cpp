@@ -28,6 +28,60 @@
 
 #include <syslog.h>
 
+namespace {
+/*
+ * Maximum number of labels in a name, which is at most 255 bytes long.
+ */
+const size_t max_labels = 128;
+
+/*
+ * Maximum number of addresses synthesized at once.
+ */
+const size_t synthesis_batch = 32;
+
+/*
+ * Writes a 16 bit value in network byte order.
+ */
+void put16(uint8_t *dst, uint16_t value) {
+  dst[0] = value >> 8;
+  dst[1] = value & 0xff;
+}
+
+/*
+ * Returns the address right after a name, or nullptr if it does not end
+ * before end.
+ */
+const uint8_t *skipName(const uint8_t *name, const uint8_t *end) {
+  while (name < end) {
+    if ((name[0] & 0xc0) == 0xc0) {
+      return name + 2 <= end ? name + 2 : nullptr;
+    }
+    if (name[0] == 0) {
+      return name + 1;
+    }
+    name += name[0] + 1;
+  }
+  return nullptr;
+}
+
+/*
+ * Compares two labels, ignoring the case of the ASCII letters.
+ */
+bool equalLabels(const uint8_t *lhs, const uint8_t *rhs) {
+  if (lhs[0] != rhs[0]) {
+    return false;
+  }
+  for (size_t i = 1; i <= lhs[0]; i++) {
+    uint8_t l = lhs[i] >= 'A' && lhs[i] <= 'Z' ? lhs[i] + ('a' - 'A') : lhs[i];
+    uint8_t r = rhs[i] >= 'A' && rhs[i] <= 'Z' ? rhs[i] + ('a' - 'A') : rhs[i];
+    if (l != r) {
+      return false;
+    }
+  }
+  return true;
+}
+} // namespace
+
 DNSLabel::DNSLabel(uint8_t *begin) : begin_{begin} {}
 
 bool DNSLabel::isPointer() const { return (begin_[0] & 0xc0) == 0xc0; }
@@ -61,77 +115,68 @@ bool operator==(const DNSLabel &lhs, const DNSLabel &rhs) {
 }
 
 DNSQName::DNSQName(uint8_t *begin, size_t maxlen, DNSPacket &packet)
-    : begin_{begin}, packet_{packet} {
+    : begin_{begin}, packet_{packet}, size_{0} {
   uint8_t *iter = begin;
-  while (iter < (begin_ + maxlen)) {
+  while (true) {
+    if (iter >= begin_ + maxlen) {
+      throw std::out_of_range{"Packet too small"};
+    }
     packet_.labels_.push_back(DNSLabel{iter});
     if (iter[0] == 0) {
+      iter += 1;
       break;
     } else if (iter[0] < 64) {
       iter += iter[0] + 1;
     } else if ((iter[0] & 0xc0) == 0xc0) {
+      iter += 2;
       break;
     } else {
       throw std::out_of_range{"Invalid label size"};
     }
   }
-  if (size() > maxlen) {
+  size_ = iter - begin_;
+  if (size_ > maxlen) {
     throw std::out_of_range{"Packet too small"};
   }
 }
 
-size_t DNSQName::labelsToString(std::vector<DNSLabel>::iterator first,
-                                char *buffer, size_t maxlen) const {
+size_t DNSQName::toString(char *buffer, size_t maxlen) const {
   size_t len = maxlen;
-  for (std::vector<DNSLabel>::iterator label = first;
-       label != packet_.labels_.end(); ++label) {
-    if (!label->isPointer()) {
-      if (label->length() == 0) {
+  const uint8_t *end = packet_.begin_ + packet_.len_;
+  const uint8_t *iter = begin_;
+  const uint8_t *limit = begin_;
+  if (maxlen > 0) {
+    buffer[0] = '\0';
+  }
+  while (iter < end) {
+    if ((iter[0] & 0xc0) == 0xc0) {
+      if (iter + 1 >= end) {
         break;
       }
-      if (len >= (label->length() + 2)) {
-        snprintf(buffer, label->length() + 1, "%s", label->begin_ + 1);
-        strcat(buffer, ".");
-        buffer += label->length() + 1;
-        len -= label->length() + 1;
+      const uint8_t *target =
+          packet_.begin_ + (((iter[0] & 0x3f) << 8) | iter[1]);
+      if (target >= limit) {
+        break;
       }
-    } else {
-      size_t s = labelsToString(
-          std::find_if(packet_.labels_.begin(), packet_.labels_.end(),
-                       [this, label](const DNSLabel &rhs) {
-                         return (packet_.begin_ + label->offset()) ==
-                                rhs.begin_;
-                       }),
-          buffer, len);
-      buffer += s;
-      len -= s;
+      iter = limit = target;
+      continue;
+    }
+    size_t length = iter[0];
+    if (length == 0 || length >= 64 || iter + length + 1 > end ||
+        len < length + 2) {
       break;
     }
+    memcpy(buffer, iter + 1, length);
+    buffer[length] = '.';
+    buffer[length + 1] = '\0';
+    buffer += length + 1;
+    len -= length + 1;
+    iter += length + 1;
   }
   return maxlen - len;
 }
 
-size_t DNSQName::toString(char *buffer, size_t maxlen) const {
-  return labelsToString(std::find_if(packet_.labels_.begin(),
-                                     packet_.labels_.end(),
-                                     [this](const DNSLabel &rhs) {
-                                       return rhs.begin_ == begin_;
-                                     }),
-                        buffer, maxlen);
-}
-
-size_t DNSQName::size() const {
-  size_t len = 0;
-  for (std::vector<DNSLabel>::iterator label = std::find_if(
-           packet_.labels_.begin(), packet_.labels_.end(),
-           [this](const DNSLabel &rhs) { return rhs.begin_ == begin_; });
-       label != packet_.labels_.end(); ++label) {
-    len += label->size();
-    if (label->isPointer() || label->length() == 0)
-      break;
-  }
-  return len;
-}
+size_t DNSQName::size() const { return size_; }
 
 DNSQuestion::DNSQuestion(uint8_t *begin, size_t maxlen, DNSPacket &packet)
     : begin_{begin}, name_{DNSQName{begin, maxlen, packet}} {
@@ -315,49 +360,75 @@ size_t DNSResource::size() const {
          sizeof(uint16_t) + rdlength();
 }
 
-DNSPacket::DNSPacket(uint8_t *begin, size_t len, size_t buflen)
-    : begin_{begin}, len_{len}, buflen_{buflen} {
+DNSPacket::DNSPacket(uint8_t *begin, size_t len, size_t buflen, bool lazy)
+    : begin_{begin}, len_{len}, buflen_{buflen}, parsed_{HEADER},
+      next_{begin + sizeof(DNSHeader)} {
 
   header_ = reinterpret_cast<DNSHeader *>(begin);
-  begin += sizeof(DNSHeader);
-  len -= sizeof(DNSHeader);
-  if (begin > (begin_ + len_))
+  if (len < sizeof(DNSHeader))
     throw std::out_of_range{"Packet too small"};
-  //
-  for (int i = 0; i < header_->qdcount(); i++) {
-    question_.push_back(DNSQuestion{begin, len, *this});
-    begin += question_[i].size();
-    len -= question_[i].size();
-    if (begin > (begin_ + len_))
-      throw std::out_of_range{"Packet too small"};
+  if (!lazy) {
+    parse(ADDITIONAL);
   }
-  //
-  for (int i = 0; i < header_->ancount(); i++) {
-    answer_.push_back(DNSResource{begin, len, *this});
-    begin += answer_[i].size();
-    len -= answer_[i].size();
-    if (begin > (begin_ + len_))
-      throw std::out_of_range{"Packet too small"};
+}
+
+void DNSPacket::parse(section last) {
+  if (parsed_ < QUESTION && last >= QUESTION) {
+    for (int i = 0; i < header_->qdcount(); i++) {
+      question_.push_back(
+          DNSQuestion{next_, static_cast<size_t>(begin_ + len_ - next_), *this});
+      next_ += question_.back().size();
+      if (next_ > (begin_ + len_))
+        throw std::out_of_range{"Packet too small"};
+    }
+    parsed_ = QUESTION;
   }
-  //
-  for (int i = 0; i < header_->nscount(); i++) {
-    authority_.push_back(DNSResource{begin, len, *this});
-    begin += authority_[i].size();
-    len -= authority_[i].size();
-    if (begin > (begin_ + len_))
-      throw std::out_of_range{"Packet too small"};
+  if (parsed_ < ANSWER && last >= ANSWER) {
+    parseResources(answer_, header_->ancount());
+    parsed_ = ANSWER;
   }
-  //
-  for (int i = 0; i < header_->arcount(); i++) {
-    additional_.push_back(DNSResource{begin, len, *this});
-    begin += additional_[i].size();
-    len -= additional_[i].size();
-    if (begin > (begin_ + len_))
+  if (parsed_ < AUTHORITY && last >= AUTHORITY) {
+    parseResources(authority_, header_->nscount());
+    parsed_ = AUTHORITY;
+  }
+  if (parsed_ < ADDITIONAL && last >= ADDITIONAL) {
+    parseResources(additional_, header_->arcount());
+    parsed_ = ADDITIONAL;
+  }
+}
+
+void DNSPacket::parseResources(DNSResourceList &resources, uint16_t count) {
+  for (int i = 0; i < count; i++) {
+    resources.push_back(
+        DNSResource{next_, static_cast<size_t>(begin_ + len_ - next_), *this});
+    next_ += resources.back().size();
+    if (next_ > (begin_ + len_))
       throw std::out_of_range{"Packet too small"};
   }
 }
 
+DNSQuestionList &DNSPacket::question() {
+  parse(QUESTION);
+  return question_;
+}
+
+DNSResourceList &DNSPacket::answer() {
+  parse(ANSWER);
+  return answer_;
+}
+
+DNSResourceList &DNSPacket::authority() {
+  parse(AUTHORITY);
+  return authority_;
+}
+
+DNSResourceList &DNSPacket::additional() {
+  parse(ADDITIONAL);
+  return additional_;
+}
+
 void DNSPacket::resize(uint8_t *begin, size_t oldsize, size_t newsize) {
+  parse(ADDITIONAL);
   if ((newsize - oldsize) > (buflen_ - len_)) {
     throw std::out_of_range{"Buffer too small"};
   }
@@ -367,6 +438,7 @@ void DNSPacket::resize(uint8_t *begin, size_t oldsize, size_t newsize) {
   for (auto &question : question_) {
     if (question.begin_ > begin) {
       question.begin_ += (newsize - oldsize);
+      question.name_.begin_ += (newsize - oldsize);
       question.qtype_ = reinterpret_cast<uint16_t *>(
           reinterpret_cast<uint8_t *>(question.qtype_) + (newsize - oldsize));
       question.qclass_ = reinterpret_cast<uint16_t *>(
@@ -376,6 +448,7 @@ void DNSPacket::resize(uint8_t *begin, size_t oldsize, size_t newsize) {
   for (auto &resource : answer_) {
     if (resource.begin_ > begin) {
       resource.begin_ += (newsize - oldsize);
+      resource.name_.begin_ += (newsize - oldsize);
       resource.qtype_ = reinterpret_cast<uint16_t *>(
           reinterpret_cast<uint8_t *>(resource.qtype_) + (newsize - oldsize));
       resource.qclass_ = reinterpret_cast<uint16_t *>(
@@ -391,6 +464,7 @@ void DNSPacket::resize(uint8_t *begin, size_t oldsize, size_t newsize) {
   for (auto &resource : authority_) {
     if (resource.begin_ > begin) {
       resource.begin_ += (newsize - oldsize);
+      resource.name_.begin_ += (newsize - oldsize);
       resource.qtype_ = reinterpret_cast<uint16_t *>(
           reinterpret_cast<uint8_t *>(resource.qtype_) + (newsize - oldsize));
       resource.qclass_ = reinterpret_cast<uint16_t *>(
@@ -406,6 +480,7 @@ void DNSPacket::resize(uint8_t *begin, size_t oldsize, size_t newsize) {
   for (auto &resource : additional_) {
     if (resource.begin_ > begin) {
       resource.begin_ += (newsize - oldsize);
+      resource.name_.begin_ += (newsize - oldsize);
       resource.qtype_ = reinterpret_cast<uint16_t *>(
           reinterpret_cast<uint8_t *>(resource.qtype_) + (newsize - oldsize));
       resource.qclass_ = reinterpret_cast<uint16_t *>(
@@ -430,3 +505,326 @@ void DNSPacket::resize(uint8_t *begin, size_t oldsize, size_t newsize) {
   }
   len_ += (newsize - oldsize);
 }
+
+size_t DNSPacket::rewriteAToAAAA(uint8_t *out, size_t outlen,
+                                 const AddressSynthesizer &synth) {
+  parse(ADDITIONAL);
+  DNSPacketWriter writer{out, outlen};
+  writer.header(*header_);
+
+  for (size_t i = 0; i < question_.size(); i++) {
+    const DNSQuestion &question = question_[i];
+    writer.question(question.name_, i == 0 ? QType::AAAA : question.qtype(),
+                    question.qclass());
+  }
+
+  uint8_t v4[4 * synthesis_batch];
+  uint8_t v6[16 * synthesis_batch];
+  size_t i = 0;
+  while (i < answer_.size()) {
+    /* Gather the addresses of the next batch of A records */
+    size_t end = i;
+    size_t count = 0;
+    for (; end < answer_.size() && count < synthesis_batch; end++) {
+      if (answer_[end].qtype() == QType::A && answer_[end].rdlength() == 4) {
+        memcpy(v4 + 4 * count++, answer_[end].rdata_, 4);
+      }
+    }
+    if (count > 0) {
+      synth(v4, v6, count);
+    }
+    count = 0;
+    for (; i < end; i++) {
+      const DNSResource &resource = answer_[i];
+      if (resource.qtype() == QType::A && resource.rdlength() == 4) {
+        writer.resource(ANSWER, resource.name_, QType::AAAA, resource.qclass(),
+                        resource.ttl(), v6 + 16 * count++, 16);
+      } else {
+        writer.resource(ANSWER, resource);
+      }
+    }
+  }
+  for (const DNSResource &resource : authority_) {
+    writer.resource(AUTHORITY, resource);
+  }
+  for (const DNSResource &resource : additional_) {
+    writer.resource(ADDITIONAL, resource);
+  }
+  return writer.size();
+}
+
+DNSPacketWriter::DNSPacketWriter(uint8_t *begin, size_t buflen)
+    : begin_{begin}, buflen_{buflen}, len_{sizeof(DNSHeader)},
+      section_{DNSPacket::HEADER}, truncated_{false}, names_count_{0} {
+  if (buflen < sizeof(DNSHeader)) {
+    throw std::out_of_range{"Buffer too small"};
+  }
+  memset(begin_, 0x00, sizeof(DNSHeader));
+}
+
+DNSHeader &DNSPacketWriter::header() {
+  return *reinterpret_cast<DNSHeader *>(begin_);
+}
+
+void DNSPacketWriter::header(const DNSHeader &header) {
+  /* The ID and the flags are the first four bytes */
+  memcpy(begin_, &header, 2 * sizeof(uint16_t));
+}
+
+bool DNSPacketWriter::matches(const uint8_t *const *labels, size_t count,
+                              size_t offset) const {
+  size_t limit = offset;
+  for (size_t i = 0;; i++) {
+    /* The names written only contain pointers to earlier labels */
+    while ((begin_[offset] & 0xc0) == 0xc0) {
+      size_t target = ((begin_[offset] & 0x3f) << 8) | begin_[offset + 1];
+      if (target >= limit) {
+        return false;
+      }
+      offset = limit = target;
+    }
+    if (i == count) {
+      return begin_[offset] == 0;
+    }
+    if (!equalLabels(begin_ + offset, labels[i])) {
+      return false;
+    }
+    offset += begin_[offset] + 1;
+  }
+}
+
+bool DNSPacketWriter::name(const DNSPacket &packet, const uint8_t *name) {
+  const uint8_t *labels[max_labels];
+  size_t count = 0;
+  const uint8_t *end = packet.begin_ + packet.len_;
+  const uint8_t *iter = name;
+  const uint8_t *limit = name;
+  while (true) {
+    if (iter >= end) {
+      throw std::out_of_range{"Packet too small"};
+    }
+    if ((iter[0] & 0xc0) == 0xc0) {
+      if (iter + 1 >= end) {
+        throw std::out_of_range{"Packet too small"};
+      }
+      const uint8_t *target =
+          packet.begin_ + (((iter[0] & 0x3f) << 8) | iter[1]);
+      if (target >= limit) {
+        throw std::out_of_range{"Invalid compression pointer"};
+      }
+      iter = limit = target;
+      continue;
+    }
+    if (iter[0] == 0) {
+      break;
+    }
+    if (iter[0] >= 64 || iter + iter[0] + 1 > end) {
+      throw std::out_of_range{"Invalid label size"};
+    }
+    if (count == max_labels) {
+      throw std::out_of_range{"Name too long"};
+    }
+    labels[count++] = iter;
+    iter += iter[0] + 1;
+  }
+
+  /* Find the longest suffix already written */
+  size_t literal = count;
+  size_t target = 0;
+  for (size_t i = 0; i < count && literal == count; i++) {
+    for (size_t j = 0; j < names_count_; j++) {
+      if (matches(labels + i, count - i, names_[j])) {
+        literal = i;
+        target = names_[j];
+        break;
+      }
+    }
+  }
+
+  size_t size = literal < count ? 2 : 1;
+  for (size_t i = 0; i < literal; i++) {
+    size += labels[i][0] + 1;
+  }
+  if (buflen_ - len_ < size) {
+    return false;
+  }
+  for (size_t i = 0; i < literal; i++) {
+    if (len_ <= 0x3fff && names_count_ < max_names) {
+      names_[names_count_++] = len_;
+    }
+    memcpy(begin_ + len_, labels[i], labels[i][0] + 1);
+    len_ += labels[i][0] + 1;
+  }
+  if (literal < count) {
+    put16(begin_ + len_, 0xc000 | target);
+    len_ += 2;
+  } else {
+    begin_[len_++] = 0;
+  }
+  return true;
+}
+
+bool DNSPacketWriter::rdata(const DNSResource &resource) {
+  const uint8_t *iter = resource.rdata_;
+  const uint8_t *end = iter + resource.rdlength();
+  size_t prefix = 0;
+  int names = 0;
+  switch (resource.qtype()) {
+  case QType::MX:
+    prefix = 2;
+    names = 1;
+    break;
+  case QType::NS:
+  case QType::MD:
+  case QType::MF:
+  case QType::CNAME:
+  case QType::MB:
+  case QType::MG:
+  case QType::MR:
+  case QType::PTR:
+    names = 1;
+    break;
+  case QType::SOA:
+  case QType::MINFO:
+    names = 2;
+    break;
+  default:
+    break;
+  }
+  if (prefix > resource.rdlength()) {
+    throw std::out_of_range{"Invalid rdata"};
+  }
+  if (buflen_ - len_ < prefix) {
+    return false;
+  }
+  memcpy(begin_ + len_, iter, prefix);
+  len_ += prefix;
+  iter += prefix;
+  for (int i = 0; i < names; i++) {
+    const uint8_t *next = skipName(iter, end);
+    if (next == nullptr) {
+      throw std::out_of_range{"Invalid rdata"};
+    }
+    if (!name(resource.packet_, iter)) {
+      return false;
+    }
+    iter = next;
+  }
+  if (buflen_ - len_ < static_cast<size_t>(end - iter)) {
+    return false;
+  }
+  memcpy(begin_ + len_, iter, end - iter);
+  len_ += end - iter;
+  return true;
+}
+
+bool DNSPacketWriter::begin(DNSPacket::section section) {
+  if (section < section_) {
+    throw std::logic_error{"Sections out of order"};
+  }
+  section_ = section;
+  return !truncated_;
+}
+
+bool DNSPacketWriter::truncate(DNSPacket::section section, size_t len) {
+  len_ = len;
+  while (names_count_ > 0 && names_[names_count_ - 1] >= len_) {
+    names_count_--;
+  }
+  truncated_ = true;
+  if (section != DNSPacket::ADDITIONAL) {
+    header().tc(true);
+  }
+  return false;
+}
+
+void DNSPacketWriter::count(DNSPacket::section section) {
+  DNSHeader &h = header();
+  switch (section) {
+  case DNSPacket::QUESTION:
+    h.qdcount(h.qdcount() + 1);
+    break;
+  case DNSPacket::ANSWER:
+    h.ancount(h.ancount() + 1);
+    break;
+  case DNSPacket::AUTHORITY:
+    h.nscount(h.nscount() + 1);
+    break;
+  case DNSPacket::ADDITIONAL:
+    h.arcount(h.arcount() + 1);
+    break;
+  default:
+    break;
+  }
+}
+
+bool DNSPacketWriter::question(const DNSQName &name, uint16_t qtype,
+                               uint16_t qclass) {
+  if (!begin(DNSPacket::QUESTION)) {
+    return false;
+  }
+  size_t len = len_;
+  if (!this->name(name.packet_, name.begin_) ||
+      buflen_ - len_ < 2 * sizeof(uint16_t)) {
+    return truncate(DNSPacket::QUESTION, len);
+  }
+  put16(begin_ + len_, qtype);
+  put16(begin_ + len_ + 2, qclass);
+  len_ += 2 * sizeof(uint16_t);
+  count(DNSPacket::QUESTION);
+  return true;
+}
+
+bool DNSPacketWriter::resource(DNSPacket::section section,
+                               const DNSQName &name, uint16_t qtype,
+                               uint16_t qclass, uint32_t ttl,
+                               const uint8_t *rdata, uint16_t rdlength) {
+  if (!begin(section)) {
+    return false;
+  }
+  size_t len = len_;
+  /* TYPE, CLASS, TTL and RDLENGTH */
+  const size_t fixed = 3 * sizeof(uint16_t) + sizeof(uint32_t);
+  if (!this->name(name.packet_, name.begin_) ||
+      buflen_ - len_ < fixed + rdlength) {
+    return truncate(section, len);
+  }
+  uint8_t *iter = begin_ + len_;
+  put16(iter, qtype);
+  put16(iter + 2, qclass);
+  put16(iter + 4, ttl >> 16);
+  put16(iter + 6, ttl & 0xffff);
+  put16(iter + 8, rdlength);
+  memcpy(iter + fixed, rdata, rdlength);
+  len_ += fixed + rdlength;
+  count(section);
+  return true;
+}
+
+bool DNSPacketWriter::resource(DNSPacket::section section,
+                               const DNSResource &resource) {
+  if (!begin(section)) {
+    return false;
+  }
+  size_t len = len_;
+  const size_t fixed = 3 * sizeof(uint16_t) + sizeof(uint32_t);
+  if (!name(resource.packet_, resource.name_.begin_) ||
+      buflen_ - len_ < fixed) {
+    return truncate(section, len);
+  }
+  /* TYPE, CLASS and TTL are copied as they are */
+  uint8_t *fields = begin_ + len_;
+  memcpy(fields, resource.qtype_, fixed - sizeof(uint16_t));
+  len_ += fixed;
+  size_t rdata = len_;
+  if (!this->rdata(resource)) {
+    return truncate(section, len);
+  }
+  put16(fields + fixed - sizeof(uint16_t), len_ - rdata);
+  count(section);
+  return true;
+}
+
+size_t DNSPacketWriter::size() const { return len_; }
+
+bool DNSPacketWriter::truncated() const { return truncated_; }
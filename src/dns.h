@@ -28,11 +28,120 @@
 #include <cstdio>
 #include <cstring>
 #include <exception>
+#include <functional>
 #include <map>
 #include <netinet/in.h>
+#include <new>
+#include <stdexcept>
 #include <stdint.h>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
+/**
+ * Vector with inline storage for its first N elements.
+ * It only allocates when it grows beyond N elements, so the parsing state of
+ * a typical packet lives entirely inside the DNSPacket. The elements are only
+ * ever constructed, never assigned, so they may have reference members.
+ */
+template <typename T, size_t N> class SmallVector {
+private:
+  typename std::aligned_storage<sizeof(T), alignof(T)>::type
+      inline_[N];   /**< Storage of the first N elements. */
+  T *data_;         /**< The elements, inline_ or a heap block. */
+  size_t size_;     /**< Number of elements. */
+  size_t capacity_; /**< Number of elements fitting in data_. */
+
+  /**
+   * Moves the elements into a heap block twice as large.
+   */
+  void grow() {
+    size_t capacity = capacity_ * 2;
+    T *data = static_cast<T *>(::operator new(capacity * sizeof(T)));
+    for (size_t i = 0; i < size_; i++) {
+      new (data + i) T(std::move(data_[i]));
+      data_[i].~T();
+    }
+    if (data_ != reinterpret_cast<T *>(inline_)) {
+      ::operator delete(data_);
+    }
+    data_ = data;
+    capacity_ = capacity;
+  }
+
+public:
+  typedef T *iterator;             /**< Iterator type. */
+  typedef const T *const_iterator; /**< Constant iterator type. */
+
+  /**
+   * Constructor.
+   */
+  SmallVector()
+      : data_{reinterpret_cast<T *>(inline_)}, size_{0}, capacity_{N} {}
+
+  /**
+   * Destructor.
+   */
+  ~SmallVector() {
+    clear();
+    if (data_ != reinterpret_cast<T *>(inline_)) {
+      ::operator delete(data_);
+    }
+  }
+
+  /**
+   * Copy constructor, explicitly deleted.
+   */
+  SmallVector(const SmallVector &) = delete;
+
+  /**
+   * Copy assignment operator, explicitly deleted.
+   */
+  SmallVector &operator=(const SmallVector &) = delete;
+
+  /**
+   * Appends an element.
+   * @param value the element
+   */
+  void push_back(T &&value) {
+    if (size_ == capacity_) {
+      grow();
+    }
+    new (data_ + size_) T(std::move(value));
+    size_++;
+  }
+
+  /**
+   * Destroys every element, keeping the storage.
+   */
+  void clear() {
+    for (size_t i = 0; i < size_; i++) {
+      data_[i].~T();
+    }
+    size_ = 0;
+  }
+
+  size_t size() const { return size_; } /**< Getter for the size. */
+  bool empty() const {
+    return size_ == 0;
+  } /**< Returns whether there are no elements. */
+  T &operator[](size_t i) { return data_[i]; } /**< Element access. */
+  const T &operator[](size_t i) const {
+    return data_[i];
+  } /**< Element access. */
+  T &back() { return data_[size_ - 1]; } /**< Access to the last element. */
+  iterator begin() { return data_; } /**< Iterator to the first element. */
+  iterator end() {
+    return data_ + size_;
+  } /**< Iterator past the last element. */
+  const_iterator begin() const {
+    return data_;
+  } /**< Iterator to the first element. */
+  const_iterator end() const {
+    return data_ + size_;
+  } /**< Iterator past the last element. */
+};
+
 /**
  * Class to represent a DNS header.
  * Note: this class is not constructed, but casted \a on the raw byte stream.
@@ -341,6 +450,11 @@ struct DNSLabel {
  */
 bool operator==(const DNSLabel &lhs, const DNSLabel &rhs);
 
+/**
+ * The labels of a packet, a typical packet has fewer than 32.
+ */
+typedef SmallVector<DNSLabel, 32> DNSLabelList;
+
 /**
  * Class to represent a DNS Query Name.
  */
@@ -349,8 +463,12 @@ struct DNSQName {
 
   DNSPacket &packet_; /**< Packet to which the QName belongs.*/
 
+  size_t size_; /**< Size of the QName in the packet, up to and including
+                   its terminating label or pointer. */
+
   /**
    * Constructor.
+   * Adds the labels of the QName to the label list of the DNSPacket.
    * @param begin pointer to the beginning of the QName
    * @param maxlen the maximum possible length of the QName
    * @param packet packet to which the DNSQName belongs
@@ -358,20 +476,10 @@ struct DNSQName {
   DNSQName(uint8_t *begin, size_t maxlen, DNSPacket &packet);
 
   /**
-   * Function to construct a string beginning with the given label,
-   * using the global label list constructed during packet processing in
-   * the DNSPacket.
-   * This function is recursive, and follows the pointers.
-   * @param first the iterator to the first label
-   * @param buffer the string buffer
-   * @param maxlen length of the string buffer
-   * @return the number of bytes written to the buffer
-   */
-  size_t labelsToString(std::vector<DNSLabel>::iterator first, char *buffer,
-                        size_t maxlen) const;
-
-  /**
-   * Converts the QName to a string using the labelsToString function.
+   * Converts the QName to a string, following the compression pointers.
+   * The labels are read straight from their offsets in the packet. Every
+   * pointer has to point before all the labels read so far, which rules out
+   * compression loops; the name is cut at the first pointer which does not.
    * @param buffer the string buffer
    * @param maxlen the length of the buffer
    * @return number of bytes written to the buffer
@@ -433,6 +541,11 @@ struct DNSQuestion {
   size_t size() const;
 };
 
+/**
+ * The Questions of a packet, which almost always has exactly one.
+ */
+typedef SmallVector<DNSQuestion, 2> DNSQuestionList;
+
 /**
  * Class to represent a DNS Resource.
  */
@@ -534,40 +647,280 @@ struct DNSResource {
   size_t size() const;
 };
 
+/**
+ * Type of the function synthesizing IPv6 addresses from IPv4 addresses.
+ * The parameters are the IPv4 addresses (4 bytes each), the buffer of the
+ * IPv6 addresses (16 bytes each), both in network byte order, and the number
+ * of addresses.
+ */
+typedef std::function<void(const uint8_t *, uint8_t *, size_t)>
+    AddressSynthesizer;
+
+/**
+ * The Resources of a section, a typical section has fewer than 8.
+ */
+typedef SmallVector<DNSResource, 8> DNSResourceList;
+
 /**
  * Class to represent a DNS packet.
+ * The Labels, Questions and Resources are stored inline, so parsing a typical
+ * packet does not allocate.
+ * A lazy DNSPacket only parses its header when it is constructed, and every
+ * section up to the one accessed through question(), answer(), authority()
+ * or additional() when it is first needed. The section members of a lazy
+ * DNSPacket are only valid after the respective accessor was called.
+ * If parsing a section throws, the packet must not be used any more.
  */
 struct DNSPacket {
+  /**
+   * Enum for the sections of the packet, in the order they are parsed.
+   */
+  enum section { HEADER, QUESTION, ANSWER, AUTHORITY, ADDITIONAL };
+
   uint8_t *begin_; /**< Pointer to the beginning of the packet. */
   size_t len_;     /**< Length of the packet. */
   size_t buflen_;  /**< Length of the buffer storing the packet. */
+  section parsed_; /**< The last section parsed. */
+  uint8_t *next_;  /**< Pointer to the beginning of the next section. */
 
-  DNSHeader *header_;            /**< The header of the packet. */
-  std::vector<DNSLabel> labels_; /**< All the labels contained in the packet. */
-  std::vector<DNSQuestion>
+  DNSHeader *header_;   /**< The header of the packet. */
+  DNSLabelList labels_; /**< All the labels contained in the packet, whose
+                           pointers are fixed up by resize(). */
+  DNSQuestionList
       question_; /**< All the Questions contained in the packet. */
-  std::vector<DNSResource>
+  DNSResourceList
       answer_; /**< All the Answer Resources contained in the packet. */
-  std::vector<DNSResource>
+  DNSResourceList
       authority_; /**< All the Authority Resources contained in the packet. */
-  std::vector<DNSResource>
+  DNSResourceList
       additional_; /**< All the Additional Resources contained in the packet. */
 
+private:
+  /**
+   * Parses the Resources of a section from next_.
+   * @param resources the list of the section
+   * @param count the number of Resources in the section
+   */
+  void parseResources(DNSResourceList &resources, uint16_t count);
+
+public:
   /**
    * Constructor.
    * @param begin pointer to the beginning of the packet
    * @param len the length of the packet
    * @param buflen the length of the buffer storing the packet
+   * @param lazy whether to parse the sections only when they are accessed
+   */
+  DNSPacket(uint8_t *begin, size_t len, size_t buflen, bool lazy = false);
+
+  /**
+   * Parses the sections which are not parsed yet, up to a given one.
+   * @param last the last section to parse
+   */
+  void parse(section last);
+
+  /**
+   * Getter for the Questions, parsing them if needed.
+   * @return the Questions
+   */
+  DNSQuestionList &question();
+
+  /**
+   * Getter for the Answer Resources, parsing them if needed.
+   * @return the Answer Resources
+   */
+  DNSResourceList &answer();
+
+  /**
+   * Getter for the Authority Resources, parsing them if needed.
+   * @return the Authority Resources
    */
-  DNSPacket(uint8_t *begin, size_t len, size_t buflen);
+  DNSResourceList &authority();
+
+  /**
+   * Getter for the Additional Resources, parsing them if needed.
+   * @return the Additional Resources
+   */
+  DNSResourceList &additional();
 
   /**
    * Function to resize the packet.
+   * Parses the whole packet first.
    * @param begin the beginning of the field which is being changed
    * @param oldsize the old size of the field
    * @param newsize the new size of the field
    */
   void resize(uint8_t *begin, size_t oldsize, size_t newsize);
+
+  /**
+   * Writes the packet into another buffer with the A records of the Answer
+   * section turned into AAAA records, and the QTYPE of the first Question
+   * set to AAAA.
+   * The addresses of the A records are synthesized in batches.
+   * The packet is copied in one forward pass through a DNSPacketWriter, so
+   * the names are compressed again and the result is truncated to the
+   * buffer like any other response.
+   * Parses the whole packet first.
+   * @param out the buffer of the result
+   * @param outlen the length of the buffer (the maximum response length)
+   * @param synth the function synthesizing the IPv6 addresses
+   * @return the length of the result
+   */
+  size_t rewriteAToAAAA(uint8_t *out, size_t outlen,
+                        const AddressSynthesizer &synth);
+};
+
+/**
+ * Class to build a DNS packet in a caller-supplied buffer.
+ * The Questions and Resources are appended in order, the section counts of
+ * the header are kept up to date. The names are copied from parsed packets
+ * and compressed against every name written before, so building a packet
+ * does not allocate.
+ * A Resource which does not fit in the buffer is left out, along with every
+ * later one. Leaving out a Question, an Answer or an Authority Resource also
+ * sets the TC flag, while the Additional section may be cut silently
+ * (RFC 2181 9).
+ */
+class DNSPacketWriter {
+private:
+  static const size_t max_names = 64; /**< Maximum number of compression
+                                         targets remembered. */
+
+  uint8_t *begin_;            /**< Pointer to the beginning of the buffer. */
+  size_t buflen_;             /**< Length of the buffer. */
+  size_t len_;                /**< Length of the packet written so far. */
+  DNSPacket::section section_; /**< The section written last. */
+  bool truncated_;            /**< Whether something was left out. */
+  uint16_t names_[max_names]; /**< Offsets of the labels written, which the
+                                 later names may point to. */
+  size_t names_count_;        /**< Number of offsets in names_. */
+
+  /**
+   * Appends a name, following the compression pointers of its packet and
+   * compressing it against the names already written.
+   * @param packet the packet containing the name
+   * @param name pointer to the beginning of the name in the packet
+   * @return whether the name fit in the buffer
+   */
+  bool name(const DNSPacket &packet, const uint8_t *name);
+
+  /**
+   * Appends the rdata of a parsed Resource, compressing its names again.
+   * @param resource the Resource
+   * @return whether the rdata fit in the buffer
+   */
+  bool rdata(const DNSResource &resource);
+
+  /**
+   * Returns whether a suffix of a name is written at an offset.
+   * @param labels the labels of the name
+   * @param count the number of labels of the suffix
+   * @param offset the offset in the buffer
+   * @return true if the names are equal, ignoring case
+   */
+  bool matches(const uint8_t *const *labels, size_t count,
+               size_t offset) const;
+
+  /**
+   * Starts a record in a section, checking the order of the sections.
+   * @param section the section of the record
+   * @return false if an earlier record was left out
+   */
+  bool begin(DNSPacket::section section);
+
+  /**
+   * Drops a partially written record and every later one.
+   * @param section the section of the record
+   * @param len the length of the packet before the record
+   * @return false
+   */
+  bool truncate(DNSPacket::section section, size_t len);
+
+  /**
+   * Increments the count of a section in the header.
+   * @param section the section
+   */
+  void count(DNSPacket::section section);
+
+public:
+  /**
+   * Constructor.
+   * Writes an empty header.
+   * Throws std::out_of_range if the buffer cannot hold a header.
+   * @param begin pointer to the beginning of the buffer
+   * @param buflen the length of the buffer, the maximum length of the packet
+   */
+  DNSPacketWriter(uint8_t *begin, size_t buflen);
+
+  /**
+   * Copy constructor, explicitly deleted.
+   */
+  DNSPacketWriter(const DNSPacketWriter &) = delete;
+
+  /**
+   * Copy assignment operator, explicitly deleted.
+   */
+  DNSPacketWriter &operator=(const DNSPacketWriter &) = delete;
+
+  /**
+   * Getter for the header, whose counts must not be changed.
+   * @return the header
+   */
+  DNSHeader &header();
+
+  /**
+   * Copies the ID and the flags of a header.
+   * @param header the header
+   */
+  void header(const DNSHeader &header);
+
+  /**
+   * Appends a Question.
+   * @param name the QName
+   * @param qtype the Query Type
+   * @param qclass the Query Class
+   * @return whether the Question fit in the buffer
+   */
+  bool question(const DNSQName &name, uint16_t qtype, uint16_t qclass);
+
+  /**
+   * Appends a Resource with the given rdata, which is copied as it is.
+   * Throws std::logic_error if the section precedes the last one written.
+   * @param section the section of the Resource
+   * @param name the name of the Resource
+   * @param qtype the Query Type
+   * @param qclass the Query Class
+   * @param ttl the TTL
+   * @param rdata the rdata
+   * @param rdlength the rdata length
+   * @return whether the Resource fit in the buffer
+   */
+  bool resource(DNSPacket::section section, const DNSQName &name,
+                uint16_t qtype, uint16_t qclass, uint32_t ttl,
+                const uint8_t *rdata, uint16_t rdlength);
+
+  /**
+   * Appends a copy of a parsed Resource. The names in the rdata of the types
+   * defined in RFC 1035 (the only ones which may be compressed, RFC 3597 4)
+   * are compressed again.
+   * Throws std::logic_error if the section precedes the last one written.
+   * @param section the section of the Resource
+   * @param resource the Resource
+   * @return whether the Resource fit in the buffer
+   */
+  bool resource(DNSPacket::section section, const DNSResource &resource);
+
+  /**
+   * Returns the length of the packet written so far.
+   * @return the length
+   */
+  size_t size() const;
+
+  /**
+   * Returns whether a record was left out.
+   * @return true if the packet is truncated
+   */
+  bool truncated() const;
 };
 
 #endif
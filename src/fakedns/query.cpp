@@ -33,31 +33,27 @@ Query::Query(uint8_t *data, size_t len, struct sockaddr_in6 sender,
   sender_ = sender;
 }
 
-Query::Query(const Query &rhs)
-    : data_{rhs.data_}, len_{rhs.len_},
-      sender_slen_{rhs.sender_slen_}, server_{rhs.server_} {
-  sender_ = rhs.sender_;
-}
-
-Query::Query(Query &&rhs)
+Query::Query(Query &&rhs) noexcept
     : data_{rhs.data_}, len_{rhs.len_},
       sender_slen_{rhs.sender_slen_}, server_{rhs.server_} {
   sender_ = rhs.sender_;
   rhs.data_ = nullptr;
 }
 
-Query::~Query() { delete[] data_; }
+Query::~Query() { server_.buffers_->release(data_); }
 
 void Query::operator()() {
   DNSHeader *header = (DNSHeader *)data_;
   uint8_t answer_data[Server::response_maxlength_];
-  size_t answer_len;
   char buffer[Server::response_maxlength_];
   uint8_t ip[4];
   if (header->qr() == 0 && header->opcode() == DNSHeader::OpCode::Query) {
     try {
       /* Parse the query */
-      DNSPacket packet{data_, len_, (size_t)server_.response_maxlength_};
+      DNSPacket packet{data_, len_, (size_t)server_.response_maxlength_, true};
+      if (packet.question().empty()) {
+        return;
+      }
       /* Parse the question label */
       packet.question_[0].name_.toString(buffer, sizeof(buffer));
       if (sscanf(buffer, "%hhu-%hhu-%hhu-%hhu.dns64perf.test.", ip, ip + 1,
@@ -65,89 +61,32 @@ void Query::operator()() {
         syslog(LOG_DAEMON | LOG_INFO, "Received unparsable query: %s", buffer);
         return;
       }
-      /* Creating base answer */
-      memset(answer_data, 0x00, sizeof(answer_data));
-      DNSHeader *header = reinterpret_cast<DNSHeader *>(answer_data);
-      header->id(packet.header_->id());
-      header->qr(1);
-      header->opcode(DNSHeader::OpCode::Query);
-      header->aa(false);
-      header->tc(false);
-      header->rd(true);
-      header->ra(false);
-      header->rcode(DNSHeader::RCODE::NoError);
-      header->qdcount(1);
-      header->ancount(0);
-      header->nscount(0);
-      header->arcount(0);
-      answer_len = sizeof(DNSHeader);
-      /* Copy question */
-      memcpy(answer_data + answer_len, packet.question_[0].begin_,
-             packet.question_[0].size());
-      answer_len += packet.question_[0].size();
-      if (packet.question_[0].qtype() == QType::A) {
-        /* Add answer */
-        header->ancount(1);
-        /* Add answer label */
-        uint16_t *ptr = reinterpret_cast<uint16_t *>(answer_data + answer_len);
-        *ptr = htons((packet.question_[0].begin_ - packet.begin_) | 0xc000);
-        answer_len += 2;
-        uint16_t *qtype =
-            reinterpret_cast<uint16_t *>(answer_data + answer_len);
-        *qtype = htons(QType::A);
-        answer_len += 2;
-        uint16_t *qclass =
-            reinterpret_cast<uint16_t *>(answer_data + answer_len);
-        *qclass = htons(QClass::IN);
-        answer_len += 2;
-        uint32_t *ttl = reinterpret_cast<uint32_t *>(answer_data + answer_len);
-        *ttl = htonl(0);
-        answer_len += 4;
-        uint16_t *rdlength =
-            reinterpret_cast<uint16_t *>(answer_data + answer_len);
-        *rdlength = htons(4);
-        answer_len += 2;
-        uint8_t *rdata = answer_data + answer_len;
-        memcpy(rdata, ip, 4);
-        answer_len += 4;
-      } else if (packet.question_[0].qtype() == QType::AAAA) {
-        /* Add answer */
+      /* Creating the answer */
+      DNSPacketWriter writer{answer_data, sizeof(answer_data)};
+      DNSHeader &header = writer.header();
+      header.id(packet.header_->id());
+      header.qr(1);
+      header.opcode(DNSHeader::OpCode::Query);
+      header.rd(true);
+      header.rcode(DNSHeader::RCODE::NoError);
+      const DNSQuestion &question = packet.question_[0];
+      writer.question(question.name_, question.qtype(), question.qclass());
+      if (question.qtype() == QType::A) {
+        writer.resource(DNSPacket::ANSWER, question.name_, QType::A,
+                        QClass::IN, 0, ip, sizeof(ip));
+      } else if (question.qtype() == QType::AAAA) {
         if (server_.aaaa_mode_ == Server::aaaaMode::YES ||
             (server_.aaaa_mode_ == Server::aaaaMode::PROBABILITY &&
              ((double)rand() / RAND_MAX) <= server_.aaaa_probability_)) {
-          header->ancount(1);
-          /* Add answer label */
-          uint16_t *ptr =
-              reinterpret_cast<uint16_t *>(answer_data + answer_len);
-          *ptr = htons((packet.question_[0].begin_ - packet.begin_) | 0xc000);
-          answer_len += 2;
-          uint16_t *qtype =
-              reinterpret_cast<uint16_t *>(answer_data + answer_len);
-          *qtype = htons(QType::AAAA);
-          answer_len += 2;
-          uint16_t *qclass =
-              reinterpret_cast<uint16_t *>(answer_data + answer_len);
-          *qclass = htons(QClass::IN);
-          answer_len += 2;
-          uint32_t *ttl =
-              reinterpret_cast<uint32_t *>(answer_data + answer_len);
-          *ttl = htonl(0);
-          answer_len += 4;
-          uint16_t *rdlength =
-              reinterpret_cast<uint16_t *>(answer_data + answer_len);
-          *rdlength = htons(16);
-          answer_len += 2;
-          uint8_t *rdata = answer_data + answer_len;
-          server_.synth(ip, rdata);
-          answer_len += 16;
+          uint8_t ip6[16];
+          server_.synth(ip, ip6);
+          writer.resource(DNSPacket::ANSWER, question.name_, QType::AAAA,
+                          QClass::IN, 0, ip6, sizeof(ip6));
         }
       }
       /* Send answer */
-      if (sendto(server_.sock6fd_, answer_data, answer_len, 0,
-                 (struct sockaddr *)&sender_, sizeof(sender_)) == -1) {
-        syslog(LOG_DAEMON | LOG_ERR,
-               "Can't send response: sendto failure: %d (%s)", errno,
-               strerror(errno));
+      if (!server_.io_->send(answer_data, writer.size(), sender_)) {
+        syslog(LOG_DAEMON | LOG_ERR, "Can't send response: response too long");
       }
     } catch (std::exception &e) {
       syslog(LOG_DAEMON | LOG_ERR, "%s", e.what());
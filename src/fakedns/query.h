@@ -56,16 +56,15 @@ public:
         socklen_t sender_slen, Server &server);
 
   /**
-   * Copy constructor.
-   * Needed because std::function, but preferably (and usually) optimized out by
-   * the compiler.
+   * Copy constructor, explicitly deleted.
    */
-  Query(const Query &rhs);
+  Query(const Query &) = delete;
 
   /**
    * Move constructor.
+   * Does not throw, so the Query is stored inline in a Task.
    */
-  Query(Query &&rhs);
+  Query(Query &&rhs) noexcept;
 
   /**
    * Copy assignment operator, explicitly deleted.
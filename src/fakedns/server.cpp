@@ -32,15 +32,27 @@
 
 #include "query.h"
 
+/* Queueing a Query must not allocate */
+static_assert(Task::fits<Query>::value,
+              "Query does not fit in the inline storage of Task");
+
 ServerException::ServerException(std::string what) : what_{what} {}
 
 const char *ServerException::what() const noexcept { return what_.c_str(); }
 
-Server::Server() : pool_{nullptr}, port_{53}, num_threads_{10}, debug_{false} {
+Server::Server()
+    : pool_{nullptr}, io_{nullptr}, buffers_{nullptr}, port_{53},
+      num_threads_{10}, task_queue_{ThreadPool::queueKind::MUTEX},
+      task_queue_size_{16384}, batch_size_{1}, batch_flush_time_{100},
+      packet_buffers_{8192}, packet_buffer_hugepages_{false}, debug_{false} {
   inet_pton(AF_INET6, "2001:db8::", &ipv6_);
 }
 
-Server::~Server() { delete pool_; }
+Server::~Server() {
+  delete pool_;
+  delete io_;
+  delete buffers_;
+}
 
 bool Server::loadConfig(const char *filename) {
   FILE *fp;
@@ -113,6 +125,99 @@ bool Server::loadConfig(const char *filename) {
                "Invalid num-threads at line %d. Defaulting to 10\n", linecount);
         continue;
       }
+    } else if (strlen(begin) >= strlen("task-queue-size") &&
+               !strncmp(begin, "task-queue-size", strlen("task-queue-size"))) {
+      begin += strlen("task-queue-size");
+      while (*begin != '\0' && isspace(*begin))
+        begin++;
+
+      if (sscanf(begin, "%ld", &task_queue_size_) != 1 ||
+          task_queue_size_ < 2 || task_queue_size_ > 16777216) {
+        task_queue_size_ = 16384;
+        syslog(LOG_WARNING,
+               "Invalid task-queue-size at line %d. Defaulting to 16384\n",
+               linecount);
+        continue;
+      }
+    } else if (strlen(begin) >= strlen("task-queue") &&
+               !strncmp(begin, "task-queue", strlen("task-queue"))) {
+      begin += strlen("task-queue");
+      while (*begin != '\0' && isspace(*begin))
+        begin++;
+
+      if (!strncmp(begin, "lockfree", strlen("lockfree"))) {
+        task_queue_ = ThreadPool::queueKind::LOCKFREE;
+      } else if (!strncmp(begin, "stealing", strlen("stealing"))) {
+        task_queue_ = ThreadPool::queueKind::STEALING;
+      } else if (!strncmp(begin, "mutex", strlen("mutex"))) {
+        task_queue_ = ThreadPool::queueKind::MUTEX;
+      } else {
+        task_queue_ = ThreadPool::queueKind::MUTEX;
+        syslog(LOG_WARNING,
+               "Invalid task-queue at line %d. Defaulting to mutex\n",
+               linecount);
+        continue;
+      }
+    } else if (strlen(begin) >= strlen("batch-size") &&
+               !strncmp(begin, "batch-size", strlen("batch-size"))) {
+      begin += strlen("batch-size");
+      while (*begin != '\0' && isspace(*begin))
+        begin++;
+
+      if (sscanf(begin, "%hd", &batch_size_) != 1 || batch_size_ < 1 ||
+          batch_size_ > 1024) {
+        batch_size_ = 1;
+        syslog(LOG_WARNING,
+               "Invalid batch-size at line %d. Defaulting to 1\n", linecount);
+        continue;
+      }
+    } else if (strlen(begin) >= strlen("batch-flush-time") &&
+               !strncmp(begin, "batch-flush-time", strlen("batch-flush-time"))) {
+      begin += strlen("batch-flush-time");
+      while (*begin != '\0' && isspace(*begin))
+        begin++;
+
+      if (sscanf(begin, "%ld", &batch_flush_time_) != 1 ||
+          batch_flush_time_ < 1 || batch_flush_time_ > 1000000) {
+        batch_flush_time_ = 100;
+        syslog(LOG_WARNING,
+               "Invalid batch-flush-time at line %d. Defaulting to 100 usec\n",
+               linecount);
+        continue;
+      }
+    } else if (strlen(begin) >= strlen("packet-buffers") &&
+               !strncmp(begin, "packet-buffers", strlen("packet-buffers"))) {
+      begin += strlen("packet-buffers");
+      while (*begin != '\0' && isspace(*begin))
+        begin++;
+
+      if (sscanf(begin, "%ld", &packet_buffers_) != 1 || packet_buffers_ < 0 ||
+          packet_buffers_ > 16777216) {
+        packet_buffers_ = 8192;
+        syslog(LOG_WARNING,
+               "Invalid packet-buffers at line %d. Defaulting to 8192\n",
+               linecount);
+        continue;
+      }
+    } else if (strlen(begin) >= strlen("packet-buffer-hugepages") &&
+               !strncmp(begin, "packet-buffer-hugepages",
+                        strlen("packet-buffer-hugepages"))) {
+      begin += strlen("packet-buffer-hugepages");
+      while (*begin != '\0' && isspace(*begin))
+        begin++;
+
+      if (!strncmp(begin, "yes", strlen("yes"))) {
+        packet_buffer_hugepages_ = true;
+      } else if (!strncmp(begin, "no", strlen("no"))) {
+        packet_buffer_hugepages_ = false;
+      } else {
+        packet_buffer_hugepages_ = false;
+        syslog(LOG_WARNING,
+               "Invalid packet-buffer-hugepages at line %d. Defaulting to "
+               "no\n",
+               linecount);
+        continue;
+      }
     } else if (strlen(begin) >= strlen("port") &&
                !strncmp(begin, "port", strlen("port"))) {
       begin += strlen("port");
@@ -149,41 +254,52 @@ void Server::start() {
     throw ServerException{ss.str()};
   }
 
+  /* Creating packet buffer pool */
+  buffers_ = new BufferPool{static_cast<size_t>(response_maxlength_),
+                            static_cast<size_t>(packet_buffers_),
+                            packet_buffer_hugepages_};
+
   /* Creating worker pool */
-  pool_ = new ThreadPool{static_cast<size_t>(num_threads_)};
+  pool_ = new ThreadPool{static_cast<size_t>(num_threads_), task_queue_,
+                         static_cast<size_t>(task_queue_size_)};
+
+  /* Creating I/O engine */
+  io_ = new BatchIO{sock6fd_, static_cast<size_t>(batch_size_),
+                    std::chrono::microseconds{batch_flush_time_},
+                    static_cast<size_t>(response_maxlength_), *buffers_};
 
   /* Receving packets */
   while (!pool_->isStopped()) {
-    struct sockaddr_in6 sender;
-    socklen_t sender_slen;
-    ssize_t recvlen;
+    int received;
     char client_ip[INET6_ADDRSTRLEN];
-    uint8_t *buffer = new uint8_t[response_maxlength_];
-    sender_slen = sizeof(sender);
-    if ((recvlen = recvfrom(sock6fd_, buffer, response_maxlength_, 0,
-                            reinterpret_cast<struct sockaddr *>(&sender),
-                            &sender_slen)) <= 0) {
-      delete[] buffer;
-      if (errno == EMSGSIZE) {
-        syslog(LOG_DAEMON | LOG_WARNING,
-               "The received message from IPv6 client is longer than %hd "
-               "bytes. Ignored",
-               response_maxlength_);
-        continue;
-      } else if (errno == EINTR) {
+    if ((received = io_->receive()) <= 0) {
+      if (errno == EINTR) {
         break;
       } else {
-        syslog(LOG_DAEMON | LOG_WARNING, "recvfrom() failure: %d (%s)", errno,
+        syslog(LOG_DAEMON | LOG_WARNING, "recvmmsg() failure: %d (%s)", errno,
                strerror(errno));
         continue;
       }
     }
-    inet_ntop(AF_INET6, &sender.sin6_addr, client_ip, INET6_ADDRSTRLEN);
-    syslog(LOG_DAEMON | LOG_INFO, "Received packet from [%s]:%hu, length %zd",
-           client_ip, ntohs(sender.sin6_port), recvlen);
+    for (int i = 0; i < received; i++) {
+      if (io_->truncated(i)) {
+        syslog(LOG_DAEMON | LOG_WARNING,
+               "The received message from IPv6 client is longer than %hd "
+               "bytes. Ignored",
+               response_maxlength_);
+        continue;
+      }
+      inet_ntop(AF_INET6, &io_->sender(i).sin6_addr, client_ip,
+                INET6_ADDRSTRLEN);
+      syslog(LOG_DAEMON | LOG_INFO, "Received packet from [%s]:%hu, length %zu",
+             client_ip, ntohs(io_->sender(i).sin6_port), io_->length(i));
 
-    pool_->addTask(Query{buffer, (size_t)recvlen, sender, sender_slen, *this});
+      pool_->addTask(Query{io_->take(i), io_->length(i), io_->sender(i),
+                           io_->senderLength(i), *this});
+    }
   }
+  delete io_;
+  io_ = nullptr;
   close(sock6fd_);
 }
 
@@ -206,8 +322,25 @@ std::ostream &operator<<(std::ostream &os, const Server &server) {
   snprintf(buffer, sizeof(buffer), "Worker threads: %hd\n",
            server.num_threads_);
   os << buffer;
+  snprintf(buffer, sizeof(buffer), "Task queue: %s, %ld tasks\n",
+           server.task_queue_ == ThreadPool::queueKind::LOCKFREE
+               ? "lockfree"
+               : server.task_queue_ == ThreadPool::queueKind::STEALING
+                     ? "stealing"
+                     : "mutex",
+           server.task_queue_size_);
+  os << buffer;
   snprintf(buffer, sizeof(buffer), "Port: %hu\n", server.port_);
   os << buffer;
+  snprintf(buffer, sizeof(buffer), "Batch size: %hd\n", server.batch_size_);
+  os << buffer;
+  snprintf(buffer, sizeof(buffer), "Batch flush time: %ld usec\n",
+           server.batch_flush_time_);
+  os << buffer;
+  snprintf(buffer, sizeof(buffer), "Packet buffers: %ld%s\n",
+           server.packet_buffers_,
+           server.packet_buffer_hugepages_ ? ", on hugepages" : "");
+  os << buffer;
   snprintf(buffer, sizeof(buffer), "Debug mode: %s\n",
            server.debug_ ? "yes" : "no");
   os << buffer;
@@ -24,6 +24,8 @@
 #ifndef SERVER_H_INCLUDED
 #define SERVER_H_INCLUDED
 
+#include "../batchio.h"
+#include "../bufferpool.h"
 #include "../pool.h"
 #include <atomic>
 #include <exception>
@@ -136,6 +138,8 @@ public:
 
 private:
   ThreadPool *pool_; /**< ThreadPool to process queries on multiple threads. */
+  BatchIO *io_;      /**< Batched I/O engine of the server socket. */
+  BufferPool *buffers_; /**< Pool of the packet buffers. */
 
   int sock6fd_;                         /**< Server socket. */
   struct sockaddr_in6 fakednssrv_addr_; /**< Server address. */
@@ -148,6 +152,18 @@ private:
                                behaviour */
 
   short int num_threads_; /**< Number of worker threads to use */
+  ThreadPool::queueKind task_queue_; /**< Task queue engine of the workers */
+  long int task_queue_size_; /**< Capacity of the lock-free task queue */
+
+  short int batch_size_; /**< Maximum number of packets per receive and send
+                            syscall (1 disables batching) */
+  long int batch_flush_time_; /**< Maximum time in microseconds a response can
+                                 wait for its batch to fill */
+
+  long int packet_buffers_; /**< Number of buffers in the packet buffer
+                               pool. */
+  bool packet_buffer_hugepages_; /**< Whether the packet buffer pool is
+                                    backed by hugepages. */
 
   bool debug_; /**< Debug flag */
 
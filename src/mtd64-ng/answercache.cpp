@@ -0,0 +1,581 @@
+/* mtd64-ng - a lightweight multithreaded C++11 DNS64 server
+ * Based on MTD64 (https://github.com/Yoso89/MTD64)
+ * Copyright (C) 2015  Daniel Bakai <bakaid@kszk.bme.hu>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+#include "answercache.h"
+#include "../dns.h"
+#include <cstring>
+#include <atomic>
+#include <functional>
+#include <memory>
+
+namespace {
+/*
+ * Estimated memory used by an entry besides its key, answer and TTL offsets
+ * (list and hash nodes, the copy of the key in the index).
+ */
+const size_t entry_overhead = 160;
+
+/*
+ * TTL of the stale answers in seconds, as recommended by RFC 8767.
+ */
+const uint32_t stale_ttl = 30;
+
+/*
+ * Number of threads sending the stale answers.
+ */
+const size_t stale_threads = 2;
+
+/*
+ * A query racing its upstream answer against its stale answer.
+ */
+struct StaleRequest {
+  std::atomic<bool> done_;           /**< Whether the client got an answer. */
+  std::unique_ptr<uint8_t[]> query_; /**< Copy of the query. */
+  std::unique_ptr<uint8_t[]> response_; /**< Buffer of the upstream answer. */
+  std::shared_ptr<uint8_t> stale_;      /**< The stale answer. */
+  size_t stale_len_;                    /**< Length of the stale answer. */
+  uint8_t *answer_;                     /**< The answer buffer of the client. */
+  DNSSource::Callback callback_;        /**< The callback of the client. */
+
+  /*
+   * Sends an answer to the client, unless it already got one.
+   */
+  bool finish(const uint8_t *data, size_t len) {
+    if (done_.exchange(true)) {
+      return false;
+    }
+    memcpy(answer_, data, len);
+    callback_(len);
+    return true;
+  }
+};
+
+/*
+ * Bits of the EDNS flags byte of the key.
+ */
+const uint8_t key_edns = 0x01;
+const uint8_t key_do = 0x02;
+const uint8_t key_cd = 0x04;
+
+/*
+ * Returns the length of the question of a packet (0 if it is malformed or
+ * compressed).
+ */
+size_t questionLength(const uint8_t *packet, size_t len) {
+  size_t pos = sizeof(DNSHeader);
+  while (pos < len && packet[pos] != 0) {
+    if ((packet[pos] & 0xc0) != 0) {
+      return 0;
+    }
+    pos += packet[pos] + 1;
+  }
+  /* The root label, QTYPE and QCLASS */
+  pos += 5;
+  return pos <= len ? pos - sizeof(DNSHeader) : 0;
+}
+
+/*
+ * Returns the memory used by an entry.
+ */
+size_t cost(const CacheEntry &entry) {
+  return entry_overhead + 2 * entry.key_.size() + entry.data_.size() +
+         entry.ttls_.size() * sizeof(uint16_t);
+}
+
+uint16_t read16(const uint8_t *p) { return (p[0] << 8) | p[1]; }
+
+uint32_t read32(const uint8_t *p) {
+  return (static_cast<uint32_t>(p[0]) << 24) | (p[1] << 16) | (p[2] << 8) |
+         p[3];
+}
+
+void write32(uint8_t *p, uint32_t value) {
+  p[0] = value >> 24;
+  p[1] = value >> 16;
+  p[2] = value >> 8;
+  p[3] = value;
+}
+} // namespace
+
+bool StaleTimer::operator>(const StaleTimer &rhs) const {
+  return deadline_ > rhs.deadline_;
+}
+
+CacheShard::CacheShard()
+    : size_{0}, hits_{0}, negative_hits_{0}, misses_{0}, prefetches_{0} {}
+
+AnswerCache::AnswerCache(DNSSource &source, bool blocking,
+                         Synthesizer synthesizer, size_t budget,
+                         uint32_t negative_ttl,
+                         unsigned prefetch_threshold,
+                         unsigned long prefetch_hits, unsigned prefetch_rate,
+                         std::chrono::seconds stale_window,
+                         std::chrono::milliseconds stale_timeout)
+    : source_(source), blocking_{blocking}, synthesizer_(synthesizer),
+      shard_budget_{budget / shards},
+      negative_ttl_{negative_ttl}, prefetch_threshold_{prefetch_threshold},
+      prefetch_hits_{prefetch_hits},
+      prefetch_interval_{prefetch_rate > 0 ? 1000000000LL / prefetch_rate
+                                           : 0},
+      prefetch_tat_{0}, stale_window_{stale_window},
+      stale_timeout_{stale_timeout}, stale_answers_{0}, timer_stop_{false},
+      stale_pool_{nullptr} {
+  if (prefetch_rate == 0) {
+    prefetch_threshold_ = 0;
+  }
+  /* A blocking source falls back to the stale answer without the timers */
+  if (stale_window_.count() > 0 && !blocking_) {
+    stale_pool_ = new ThreadPool{stale_threads};
+    timer_thread_ = std::thread{&AnswerCache::runTimers, this};
+  }
+}
+
+AnswerCache::~AnswerCache() {
+  stop();
+  delete stale_pool_;
+}
+
+void AnswerCache::stop() {
+  {
+    std::unique_lock<std::mutex> lock{timer_m_};
+    timer_stop_ = true;
+  }
+  timer_cv_.notify_all();
+  if (timer_thread_.joinable()) {
+    timer_thread_.join();
+  }
+  if (stale_pool_ != nullptr) {
+    stale_pool_->stop();
+  }
+  /* The timers added since are never fired */
+  std::priority_queue<StaleTimer, std::vector<StaleTimer>,
+                      std::greater<StaleTimer>>
+      timers;
+  {
+    std::unique_lock<std::mutex> lock{timer_m_};
+    timers.swap(timers_);
+  }
+}
+
+bool AnswerCache::key(const uint8_t *query, size_t query_len,
+                      std::string &key) {
+  if (query_len < sizeof(DNSHeader)) {
+    return false;
+  }
+  const DNSHeader *header = reinterpret_cast<const DNSHeader *>(query);
+  if (header->qdcount() != 1 || header->ancount() != 0 ||
+      header->nscount() != 0 || header->arcount() > 1) {
+    return false;
+  }
+  size_t qlen = questionLength(query, query_len);
+  if (qlen == 0) {
+    return false;
+  }
+  uint8_t flags = (read16(query + 2) & 0x0010) ? key_cd : 0;
+  if (header->arcount() == 1) {
+    /* Only an OPT record of the root is accepted in the additional section */
+    const uint8_t *opt = query + sizeof(DNSHeader) + qlen;
+    if (opt + 11 > query + query_len || opt[0] != 0 ||
+        read16(opt + 1) != QType::OPT) {
+      return false;
+    }
+    flags |= key_edns;
+    if (opt[7] & 0x80) {
+      flags |= key_do;
+    }
+  }
+  key.assign(reinterpret_cast<const char *>(query + sizeof(DNSHeader)), qlen);
+  /* Names are case-insensitive, the labels are lowercased with their length
+   * octets, which are all below 'A' */
+  for (size_t i = 0; i + 5 < qlen; i++) {
+    if (key[i] >= 'A' && key[i] <= 'Z') {
+      key[i] += 'a' - 'A';
+    }
+  }
+  key.push_back(flags);
+  return true;
+}
+
+CacheShard &AnswerCache::shard(const std::string &key) {
+  return shards_[std::hash<std::string>()(key) % shards];
+}
+
+ssize_t AnswerCache::lookup(const uint8_t *query, size_t query_len,
+                            uint8_t *answer, size_t answer_len,
+                            refreshKind *refresh, bool stale) {
+  std::string k;
+  if (!key(query, query_len, k)) {
+    return -1;
+  }
+  CacheShard &s = shard(k);
+  std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+  uint32_t elapsed;
+  size_t len;
+  {
+    std::unique_lock<std::mutex> lock{s.m_};
+    auto it = s.index_.find(k);
+    if (it == s.index_.end()) {
+      if (!stale) {
+        s.misses_++;
+      }
+      return -1;
+    }
+    CacheEntry &entry = *it->second;
+    bool expired = now >= entry.expires_;
+    len = entry.data_.size();
+    /* Expired answers are kept for serve-stale until the end of the window */
+    if (now >= entry.expires_ + stale_window_) {
+      s.size_ -= cost(entry);
+      s.lru_.erase(it->second);
+      s.index_.erase(it);
+      expired = true;
+      stale = false;
+    }
+    if ((expired && !stale) || len > answer_len) {
+      if (!stale) {
+        s.misses_++;
+      }
+      return -1;
+    }
+    /* Stale answers are counted when they are actually sent */
+    if (!stale) {
+      if (entry.negative_) {
+        s.negative_hits_++;
+      } else {
+        s.hits_++;
+      }
+      entry.hits_++;
+    }
+    /* Refreshing the answer if it is popular and in the end of its TTL */
+    if (refresh != nullptr && !stale && prefetch_threshold_ > 0 &&
+        !entry.prefetching_ && entry.hits_ >= prefetch_hits_ &&
+        (entry.expires_ - now) * 100 <
+            std::chrono::seconds{entry.ttl_} * prefetch_threshold_ &&
+        allowPrefetch()) {
+      entry.prefetching_ = true;
+      s.prefetches_++;
+      *refresh = entry.synthesized_ ? REFRESH_SYNTHESIS : REFRESH_ANSWER;
+    }
+    s.lru_.splice(s.lru_.begin(), s.lru_, it->second);
+    memcpy(answer, entry.data_.data(), len);
+    elapsed = std::chrono::duration_cast<std::chrono::seconds>(now -
+                                                               entry.stored_)
+                  .count();
+    for (uint16_t offset : entry.ttls_) {
+      write32(answer + offset,
+              expired ? stale_ttl : read32(answer + offset) - elapsed);
+    }
+  }
+  /* The ID, the RD flag and the case of the QName are the client's */
+  memcpy(answer, query, 2);
+  answer[2] = (answer[2] & ~0x01) | (query[2] & 0x01);
+  memcpy(answer + sizeof(DNSHeader), query + sizeof(DNSHeader),
+         k.size() - 1);
+  return len;
+}
+
+void AnswerCache::store(const uint8_t *query, size_t query_len,
+                        const uint8_t *answer, size_t answer_len,
+                        bool synthesized) {
+  CacheEntry entry;
+  if (!key(query, query_len, entry.key_) ||
+      answer_len < sizeof(DNSHeader) + entry.key_.size() - 1) {
+    return;
+  }
+  const DNSHeader *header = reinterpret_cast<const DNSHeader *>(answer);
+  if (!header->qr() || header->tc() ||
+      memcmp(answer + sizeof(DNSHeader), query + sizeof(DNSHeader),
+             entry.key_.size() - 1) != 0) {
+    return;
+  }
+  if (header->rcode() == DNSHeader::RCODE::NoError) {
+    entry.negative_ = header->ancount() == 0;
+  } else if (header->rcode() == DNSHeader::RCODE::NXDomain) {
+    entry.negative_ = true;
+  } else {
+    return;
+  }
+  if (entry.negative_ && negative_ttl_ == 0) {
+    return;
+  }
+  entry.data_.assign(answer, answer + answer_len);
+  uint32_t min_ttl = UINT32_MAX;
+  uint32_t soa_ttl = UINT32_MAX;
+  try {
+    DNSPacket packet{entry.data_.data(), answer_len, answer_len};
+    for (auto section : {&packet.answer_, &packet.authority_,
+                         &packet.additional_}) {
+      for (const DNSResource &resource : *section) {
+        /* The TTL of the OPT record holds the extended flags */
+        if (resource.qtype() == QType::OPT) {
+          continue;
+        }
+        entry.ttls_.push_back(reinterpret_cast<uint8_t *>(resource.ttl_) -
+                              packet.begin_);
+        if (resource.ttl() < min_ttl) {
+          min_ttl = resource.ttl();
+        }
+        /* The negative TTL is the lower of the SOA TTL and MINIMUM field */
+        if (section == &packet.authority_ &&
+            resource.qtype() == QType::SOA && resource.rdlength() >= 20) {
+          uint32_t minimum =
+              read32(resource.rdata() + resource.rdlength() - 4);
+          soa_ttl = resource.ttl() < minimum ? resource.ttl() : minimum;
+        }
+      }
+    }
+  } catch (std::exception &e) {
+    return;
+  }
+  if (entry.negative_) {
+    /* Negative answers without a SOA record are not cached (RFC 2308 5) */
+    if (soa_ttl == UINT32_MAX) {
+      return;
+    }
+    if (soa_ttl < min_ttl) {
+      min_ttl = soa_ttl;
+    }
+    if (negative_ttl_ < min_ttl) {
+      min_ttl = negative_ttl_;
+    }
+  }
+  if (min_ttl == 0 || min_ttl == UINT32_MAX) {
+    return;
+  }
+  size_t size = cost(entry);
+  if (size > shard_budget_) {
+    return;
+  }
+  entry.stored_ = std::chrono::steady_clock::now();
+  entry.expires_ = entry.stored_ + std::chrono::seconds{min_ttl};
+  entry.ttl_ = min_ttl;
+  entry.hits_ = 0;
+  entry.prefetching_ = false;
+  entry.synthesized_ = synthesized;
+
+  CacheShard &s = shard(entry.key_);
+  std::unique_lock<std::mutex> lock{s.m_};
+  auto it = s.index_.find(entry.key_);
+  if (it != s.index_.end()) {
+    s.size_ -= cost(*it->second);
+    s.lru_.erase(it->second);
+    s.index_.erase(it);
+  }
+  while (s.size_ + size > shard_budget_) {
+    s.size_ -= cost(s.lru_.back());
+    s.index_.erase(s.lru_.back().key_);
+    s.lru_.pop_back();
+  }
+  s.lru_.push_front(std::move(entry));
+  s.index_.emplace(s.lru_.front().key_, s.lru_.begin());
+  s.size_ += size;
+}
+
+ssize_t AnswerCache::sendQuery(uint8_t *query, size_t query_len,
+                               uint8_t *answer, size_t answer_len) {
+  ssize_t res = lookup(query, query_len, answer, answer_len);
+  if (res > 0) {
+    return res;
+  }
+  res = source_.sendQuery(query, query_len, answer, answer_len);
+  if (res > 0) {
+    store(query, query_len, answer, res);
+  } else if (stale_window_.count() > 0) {
+    res = fallback(query, query_len, answer, answer_len, res);
+  }
+  return res;
+}
+
+ssize_t AnswerCache::fallback(const uint8_t *query, size_t query_len,
+                              uint8_t *answer, size_t answer_len,
+                              ssize_t res) {
+  /* A blocking query can only fall back to the stale answer after its
+   * timeout */
+  ssize_t stale = lookup(query, query_len, answer, answer_len, nullptr, true);
+  if (stale > 0) {
+    stale_answers_++;
+    return stale;
+  }
+  return res;
+}
+
+void AnswerCache::sendQueryAsync(uint8_t *query, size_t query_len,
+                                 uint8_t *answer, size_t answer_len,
+                                 Callback callback) {
+  refreshKind refresh = NO_REFRESH;
+  ssize_t res = lookup(query, query_len, answer, answer_len, &refresh);
+  if (res > 0) {
+    /* The query may be released by the callback */
+    std::shared_ptr<uint8_t> request;
+    if (refresh != NO_REFRESH) {
+      request.reset(new uint8_t[query_len], std::default_delete<uint8_t[]>());
+      memcpy(request.get(), query, query_len);
+    }
+    callback(res);
+    if (refresh != NO_REFRESH) {
+      prefetch(request, query_len, answer_len, refresh);
+    }
+    return;
+  }
+  if (stale_pool_ != nullptr) {
+    std::shared_ptr<uint8_t> stale{new uint8_t[answer_len],
+                                   std::default_delete<uint8_t[]>()};
+    res = lookup(query, query_len, stale.get(), answer_len, nullptr, true);
+    if (res > 0) {
+      sendStale(query, query_len, answer, answer_len, stale, res, callback);
+      return;
+    }
+  }
+  source_.sendQueryAsync(
+      query, query_len, answer, answer_len,
+      [this, query, query_len, answer, answer_len, callback](ssize_t len) {
+        if (len > 0) {
+          store(query, query_len, answer, len);
+        } else if (stale_window_.count() > 0) {
+          len = fallback(query, query_len, answer, answer_len, len);
+        }
+        callback(len);
+      });
+}
+
+bool AnswerCache::allowPrefetch() {
+  int64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now().time_since_epoch())
+                    .count();
+  int64_t tat = prefetch_tat_.load(std::memory_order_relaxed);
+  int64_t next;
+  do {
+    int64_t start = tat > now ? tat : now;
+    if (start - now >= 1000000000LL) {
+      return false;
+    }
+    next = start + prefetch_interval_;
+  } while (!prefetch_tat_.compare_exchange_weak(tat, next,
+                                                std::memory_order_relaxed));
+  return true;
+}
+
+void AnswerCache::prefetch(std::shared_ptr<uint8_t> request,
+                           size_t query_len, size_t answer_len,
+                           refreshKind kind) {
+  std::shared_ptr<uint8_t> response{new uint8_t[answer_len],
+                                    std::default_delete<uint8_t[]>()};
+  /* The QTYPE is right before the QCLASS at the end of the question */
+  uint8_t *qtype = request.get() + sizeof(DNSHeader) +
+                   questionLength(request.get(), query_len) - 4;
+  if (kind == REFRESH_SYNTHESIS) {
+    qtype[0] = QType::A >> 8;
+    qtype[1] = QType::A & 0xff;
+  }
+  source_.sendQueryAsync(
+      request.get(), query_len, response.get(), answer_len,
+      [this, request, query_len, response, answer_len, kind,
+       qtype](ssize_t len) {
+        if (len <= 0) {
+          return;
+        }
+        store(request.get(), query_len, response.get(), len);
+        if (kind != REFRESH_SYNTHESIS) {
+          return;
+        }
+        try {
+          len = synthesizer_(response.get(), len, answer_len);
+        } catch (std::exception &e) {
+          return;
+        }
+        qtype[0] = QType::AAAA >> 8;
+        qtype[1] = QType::AAAA & 0xff;
+        store(request.get(), query_len, response.get(), len, true);
+      });
+}
+
+void AnswerCache::sendStale(const uint8_t *query, size_t query_len,
+                            uint8_t *answer, size_t answer_len,
+                            std::shared_ptr<uint8_t> stale, size_t stale_len,
+                            Callback callback) {
+  /* The query and the answer buffer of the client are not used after its
+   * callback, so the upstream query gets its own */
+  std::shared_ptr<StaleRequest> request = std::make_shared<StaleRequest>();
+  request->done_ = false;
+  request->query_.reset(new uint8_t[query_len]);
+  memcpy(request->query_.get(), query, query_len);
+  request->response_.reset(new uint8_t[answer_len]);
+  request->stale_ = stale;
+  request->stale_len_ = stale_len;
+  request->answer_ = answer;
+  request->callback_ = callback;
+  {
+    std::unique_lock<std::mutex> lock{timer_m_};
+    timers_.push(StaleTimer{std::chrono::steady_clock::now() + stale_timeout_,
+                            [this, request]() {
+                              if (request->finish(request->stale_.get(),
+                                                  request->stale_len_)) {
+                                stale_answers_++;
+                              }
+                            }});
+  }
+  timer_cv_.notify_one();
+  source_.sendQueryAsync(
+      request->query_.get(), query_len, request->response_.get(), answer_len,
+      [this, request, query_len](ssize_t len) {
+        if (len > 0) {
+          store(request->query_.get(), query_len, request->response_.get(),
+                len);
+          request->finish(request->response_.get(), len);
+        } else if (request->finish(request->stale_.get(),
+                                   request->stale_len_)) {
+          stale_answers_++;
+        }
+      });
+}
+
+void AnswerCache::runTimers() {
+  std::unique_lock<std::mutex> lock{timer_m_};
+  while (!timer_stop_) {
+    if (timers_.empty()) {
+      timer_cv_.wait(lock);
+      continue;
+    }
+    if (timer_cv_.wait_until(lock, timers_.top().deadline_) ==
+        std::cv_status::no_timeout) {
+      continue;
+    }
+    while (!timers_.empty() &&
+           timers_.top().deadline_ <= std::chrono::steady_clock::now()) {
+      stale_pool_->addTask(Task{timers_.top().fire_});
+      timers_.pop();
+    }
+  }
+}
+
+CacheCounters AnswerCache::counters() {
+  CacheCounters counters = {0, 0, 0, 0, 0, 0, 0};
+  counters.stale_answers_ = stale_answers_;
+  for (CacheShard &s : shards_) {
+    std::unique_lock<std::mutex> lock{s.m_};
+    counters.hits_ += s.hits_;
+    counters.negative_hits_ += s.negative_hits_;
+    counters.misses_ += s.misses_;
+    counters.prefetches_ += s.prefetches_;
+    counters.entries_ += s.index_.size();
+    counters.size_ += s.size_;
+  }
+  return counters;
+}
@@ -0,0 +1,359 @@
+/* mtd64-ng - a lightweight multithreaded C++11 DNS64 server
+ * Based on MTD64 (https://github.com/Yoso89/MTD64)
+ * Copyright (C) 2015  Daniel Bakai <bakaid@kszk.bme.hu>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+/** @file
+ *  @brief Header for the AnswerCache and related classes.
+ */
+
+#ifndef ANSWERCACHE_H_INCLUDED
+#define ANSWERCACHE_H_INCLUDED
+
+#include "../pool.h"
+#include "dnssource.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * A cached answer in wire format.
+ */
+struct CacheEntry {
+  std::string key_;            /**< The key of the answer. */
+  std::vector<uint8_t> data_;  /**< The answer as it was received. */
+  std::vector<uint16_t> ttls_; /**< Offsets of the TTLs in the answer. */
+  std::chrono::steady_clock::time_point stored_;  /**< Time of caching. */
+  std::chrono::steady_clock::time_point expires_; /**< Expiry of the answer
+                                                     (by its lowest TTL). */
+  uint32_t ttl_;       /**< The lowest TTL of the answer in seconds. */
+  bool negative_;      /**< Whether the answer is NXDOMAIN or NODATA. */
+  unsigned long hits_; /**< Number of hits since the answer was stored. */
+  bool prefetching_;   /**< Whether a refresh of the answer was sent. */
+  bool synthesized_;   /**< Whether the answer is a synthesized AAAA answer,
+                          which is refreshed by its A query. */
+};
+
+/**
+ * Counters of the AnswerCache.
+ */
+struct CacheCounters {
+  unsigned long hits_;          /**< Number of positive hits. */
+  unsigned long negative_hits_; /**< Number of negative hits. */
+  unsigned long misses_;        /**< Number of misses. */
+  unsigned long prefetches_;    /**< Number of refreshes sent upstream. */
+  unsigned long stale_answers_; /**< Number of stale answers sent. */
+  size_t entries_;              /**< Number of cached answers. */
+  size_t size_; /**< Memory used by the cached answers in bytes. */
+};
+
+/**
+ * A timer of the client-facing deadline of a query with a stale answer.
+ */
+struct StaleTimer {
+  std::chrono::steady_clock::time_point deadline_; /**< The deadline. */
+  std::function<void()> fire_; /**< Sends the stale answer. */
+
+  /**
+   * Orders the timers by their deadlines.
+   * @param rhs the other timer
+   * @return whether this timer expires later
+   */
+  bool operator>(const StaleTimer &rhs) const;
+};
+
+/**
+ * A part of the cache with its own lock and LRU list.
+ */
+struct CacheShard {
+  std::mutex m_;                /**< Mutex for the shard. */
+  std::list<CacheEntry> lru_;   /**< The entries, most recently used first. */
+  std::unordered_map<std::string, std::list<CacheEntry>::iterator>
+      index_;   /**< The entries by key. */
+  size_t size_; /**< The memory used by the entries in bytes. */
+  unsigned long hits_;          /**< Number of positive hits. */
+  unsigned long negative_hits_; /**< Number of negative hits. */
+  unsigned long misses_;        /**< Number of misses. */
+  unsigned long prefetches_;    /**< Number of refreshes sent upstream. */
+
+  /**
+   * Constructor.
+   */
+  CacheShard();
+};
+
+/**
+ * A DNSSource caching the answers of another DNSSource.
+ * The answers are stored in wire format, keyed by the question (the QName is
+ * case-insensitive) and the EDNS flags of the query. A hit is served by
+ * copying the answer and patching its ID, question and TTLs, without any
+ * upstream I/O. The synthesized AAAA answers can also be stored, so they are
+ * not synthesized again.
+ * NXDOMAIN and NODATA answers are cached as well (RFC 2308), until the
+ * minimum TTL of their SOA record, so a repeated AAAA query of an IPv4-only
+ * name goes straight to the A query and the synthesis.
+ * The cache is split into shards by the hash of the key, each limited to its
+ * share of the memory budget by evicting the least recently used entries.
+ * Popular answers are kept warm by prefetching: a hit in the last part of
+ * the TTL of an answer which had enough hits sends a refresh upstream, while
+ * the clients keep getting the cached answer. The refreshes are rate limited.
+ * A synthesized answer is refreshed by sending its A query and synthesizing
+ * the new answer.
+ * With serve-stale (RFC 8767), the expired answers are kept for a while. If
+ * the upstream does not answer a query with such an answer before the
+ * client-facing deadline (or fails), the stale answer is sent with a short
+ * TTL, and the upstream answer still refreshes the cache when it arrives.
+ * The stale answers due at the deadline are sent by a few worker threads of
+ * the cache. A blocking DNSSource can not be raced against the deadline, so
+ * with it the stale answer is only sent if the query fails.
+ * The counters are kept by the shards under their locks, so they need no
+ * atomic operations.
+ */
+class AnswerCache : public DNSSource {
+public:
+  /**
+   * Type of the function turning an A answer into the synthesized AAAA
+   * answer in place. The parameters are the buffer, the length of the answer
+   * and the length of the buffer, it returns the new length of the answer.
+   */
+  typedef std::function<size_t(uint8_t *, size_t, size_t)> Synthesizer;
+
+  /**
+   * Enum for the refresh needed by a hit.
+   */
+  enum refreshKind {
+    NO_REFRESH,       /**< the answer is fresh enough */
+    REFRESH_ANSWER,   /**< the query is sent upstream again */
+    REFRESH_SYNTHESIS /**< the A query is sent and the answer synthesized */
+  };
+
+private:
+  static const size_t shards = 64; /**< Number of shards. */
+
+  DNSSource &source_;        /**< The cached DNSSource. */
+  bool blocking_;            /**< Whether the cached DNSSource is blocking. */
+  Synthesizer synthesizer_;  /**< Synthesizes the refreshed AAAA answers. */
+  size_t shard_budget_;      /**< Memory budget of a shard in bytes. */
+  uint32_t negative_ttl_;    /**< Maximum TTL of the negative answers in
+                                seconds (0 disables negative caching). */
+  unsigned prefetch_threshold_; /**< Percentage of the TTL left at which a
+                                   hit refreshes the answer (0 disables
+                                   prefetching). */
+  unsigned long prefetch_hits_; /**< Hits needed for an answer to be
+                                   refreshed. */
+  int64_t prefetch_interval_;   /**< Minimum average time between two
+                                   refreshes in nanoseconds. */
+  std::atomic<int64_t> prefetch_tat_; /**< Theoretical arrival time of the
+                                         next refresh (GCRA). */
+  std::chrono::seconds stale_window_; /**< Time the expired answers are kept
+                                         for (0 disables serve-stale). */
+  std::chrono::milliseconds stale_timeout_; /**< Time the upstream answer is
+                                               waited for before sending the
+                                               stale answer. */
+  std::atomic<unsigned long> stale_answers_; /**< Number of stale answers
+                                                sent. */
+  std::mutex timer_m_; /**< Mutex for the timers. */
+  std::condition_variable timer_cv_; /**< Used to wake up the timer thread. */
+  std::priority_queue<StaleTimer, std::vector<StaleTimer>,
+                      std::greater<StaleTimer>>
+      timers_;         /**< The deadlines, earliest first. */
+  bool timer_stop_;    /**< Used to stop the timer thread. */
+  std::thread timer_thread_; /**< Hands the stale answers due at the
+                                deadlines over to stale_pool_. */
+  ThreadPool *stale_pool_;   /**< Sends the stale answers, so a slow client
+                                callback does not delay the other timers. */
+  CacheShard shards_[shards]; /**< The shards. */
+
+  /**
+   * Returns the shard of a key.
+   * @param key the key
+   * @return the shard
+   */
+  CacheShard &shard(const std::string &key);
+
+  /**
+   * Takes a refresh from the rate limit (a generic cell rate algorithm
+   * allowing a burst of one second of refreshes).
+   * @return whether the refresh may be sent
+   */
+  bool allowPrefetch();
+
+  /**
+   * Sends a refresh of an answer upstream, which is stored on success.
+   * A failed refresh leaves the answer to expire.
+   * @param request the query packet, kept until the answer arrives
+   * @param query_len length of the packet
+   * @param answer_len length of the answer buffer to use
+   * @param kind the kind of the refresh
+   */
+  void prefetch(std::shared_ptr<uint8_t> request, size_t query_len,
+                size_t answer_len, refreshKind kind);
+
+  /**
+   * Sends a query upstream, racing it against the client-facing deadline.
+   * The client gets the upstream answer if it arrives in time, the stale
+   * answer otherwise.
+   * @param query the query packet
+   * @param query_len length of the packet
+   * @param answer buffer for the answer
+   * @param answer_len length of the buffer
+   * @param stale the stale answer
+   * @param stale_len length of the stale answer
+   * @param callback the function to call with the result
+   */
+  void sendStale(const uint8_t *query, size_t query_len, uint8_t *answer,
+                 size_t answer_len, std::shared_ptr<uint8_t> stale,
+                 size_t stale_len, Callback callback);
+
+  /**
+   * Replaces the result of a failed query with the stale answer, if there
+   * is one.
+   * @param query the query packet
+   * @param query_len length of the packet
+   * @param answer buffer for the answer
+   * @param answer_len length of the buffer
+   * @param res the result of the query
+   * @return the length of the stale answer, or res if there is none
+   */
+  ssize_t fallback(const uint8_t *query, size_t query_len, uint8_t *answer,
+                   size_t answer_len, ssize_t res);
+
+  /**
+   * Main loop of the timer thread.
+   */
+  void runTimers();
+
+public:
+  /**
+   * Builds the key of a query.
+   * Queries with the same key get the same answer, apart from the ID, the RD
+   * flag and the case of the QName.
+   * @param query the query packet
+   * @param query_len length of the packet
+   * @param key the string to store the key in
+   * @return false if the query can not be cached
+   */
+  static bool key(const uint8_t *query, size_t query_len, std::string &key);
+
+  /**
+   * Constructor.
+   * @param source the DNSSource to cache
+   * @param blocking whether the source answers on the calling thread
+   * @param synthesizer the function synthesizing the refreshed AAAA answers
+   * @param budget the memory budget in bytes
+   * @param negative_ttl the maximum TTL of the negative answers in seconds
+   * (0 disables negative caching)
+   * @param prefetch_threshold the percentage of the TTL left at which a hit
+   * refreshes the answer (0 disables prefetching)
+   * @param prefetch_hits the hits needed for an answer to be refreshed
+   * @param prefetch_rate the maximum number of refreshes per second
+   * @param stale_window the time the expired answers are kept for (0
+   * disables serve-stale)
+   * @param stale_timeout the time the upstream answer is waited for before
+   * sending the stale answer
+   */
+  AnswerCache(DNSSource &source, bool blocking, Synthesizer synthesizer,
+              size_t budget, uint32_t negative_ttl,
+              unsigned prefetch_threshold, unsigned long prefetch_hits,
+              unsigned prefetch_rate, std::chrono::seconds stale_window,
+              std::chrono::milliseconds stale_timeout);
+
+  /**
+   * Destructor.
+   * Stops the timer thread, the pending stale answers are not sent.
+   */
+  ~AnswerCache();
+
+  /**
+   * Stops the timer thread and its workers, and drops the pending stale
+   * answers with the callbacks they hold. Must be called before the cached
+   * DNSSource is destroyed.
+   */
+  void stop();
+
+  /**
+   * Looks up the answer of a query in the cache.
+   * @param query the query packet
+   * @param query_len length of the packet
+   * @param answer buffer for the answer
+   * @param answer_len length of the buffer
+   * @param refresh set to the refresh needed by the answer (may be nullptr)
+   * @param stale whether an expired answer in the serve-stale window is
+   * accepted, with its TTLs set to the stale TTL (it is not counted as a hit)
+   * @return the length of the answer (-1 on miss)
+   */
+  ssize_t lookup(const uint8_t *query, size_t query_len, uint8_t *answer,
+                 size_t answer_len, refreshKind *refresh = nullptr,
+                 bool stale = false);
+
+  /**
+   * Stores the answer of a query, if it can be cached.
+   * Successful, untruncated answers with at least one resource are stored
+   * until the lowest TTL of their resources. NXDOMAIN and NODATA answers are
+   * stored until the minimum TTL of their SOA record, capped by negative_ttl.
+   * @param query the query packet
+   * @param query_len length of the packet
+   * @param answer the answer packet
+   * @param answer_len length of the answer
+   * @param synthesized whether the answer is a synthesized AAAA answer
+   */
+  void store(const uint8_t *query, size_t query_len, const uint8_t *answer,
+             size_t answer_len, bool synthesized = false);
+
+  /**
+   * Serves the query from the cache, or from the cached DNSSource on miss.
+   * @param query the query packet
+   * @param query_len length of the packet
+   * @param answer buffer for the answer
+   * @param answer_len length of the buffer
+   * @return the length of the answer (-1 on failure)
+   */
+  ssize_t sendQuery(uint8_t *query, size_t query_len, uint8_t *answer,
+                    size_t answer_len) override;
+
+  /**
+   * Serves the query from the cache, or from the cached DNSSource on miss.
+   * A hit calls the callback on the calling thread, then sends the refresh
+   * of the answer if it is due (which blocks the calling thread if the
+   * cached DNSSource is blocking).
+   * @param query the query packet
+   * @param query_len length of the packet
+   * @param answer buffer for the answer
+   * @param answer_len length of the buffer
+   * @param callback the function to call with the result
+   */
+  void sendQueryAsync(uint8_t *query, size_t query_len, uint8_t *answer,
+                      size_t answer_len, Callback callback) override;
+
+  /**
+   * Sums the counters of the shards.
+   * @return the counters
+   */
+  CacheCounters counters();
+};
+
+#endif
@@ -0,0 +1,515 @@
+/* mtd64-ng - a lightweight multithreaded C++11 DNS64 server
+ * Based on MTD64 (https://github.com/Yoso89/MTD64)
+ * Copyright (C) 2015  Daniel Bakai <bakaid@kszk.bme.hu>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+
+#include "asyncdnsclient.h"
+#include "../dns.h"
+#include "dnsclient.h"
+#include "server.h"
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cstring>
+#include <functional>
+#include <future>
+#include <memory>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <syslog.h>
+#include <unistd.h>
+
+namespace {
+/*
+ * Number of random IDs tried on a shared socket before moving to the next.
+ */
+const int id_attempts = 8;
+} // namespace
+
+AsyncDNSClient::AsyncDNSClient(Server &dns_server, size_t threads,
+                               size_t sockets)
+    : dns_server_{dns_server}, next_loop_{0}, stop_{false},
+      timeout_{std::chrono::seconds{dns_server.timeout_.tv_sec} +
+               std::chrono::microseconds{dns_server.timeout_.tv_usec}},
+      sockets_per_server_{sockets} {
+  if (threads == 0) {
+    threads = 1;
+  }
+  for (size_t i = 0; i < threads; i++) {
+    UpstreamLoop *loop = new UpstreamLoop;
+    loops_.push_back(loop);
+    loop->epollfd_ = epoll_create1(EPOLL_CLOEXEC);
+    loop->eventfd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = nullptr; // The wakeup event has no request
+    if (loop->epollfd_ == -1 || loop->eventfd_ == -1 ||
+        epoll_ctl(loop->epollfd_, EPOLL_CTL_ADD, loop->eventfd_, &ev) == -1 ||
+        !openSockets(*loop)) {
+      for (auto loop : loops_) {
+        for (auto socket : loop->sockets_) {
+          close(socket->sockfd_);
+          delete socket;
+        }
+        close(loop->epollfd_);
+        close(loop->eventfd_);
+        delete loop;
+      }
+      throw DNSClientException("Cannot create upstream event loop");
+    }
+  }
+  for (auto loop : loops_) {
+    loop->thread_ = std::thread{&AsyncDNSClient::run, this, std::ref(*loop)};
+  }
+}
+
+AsyncDNSClient::~AsyncDNSClient() {
+  stop_ = true;
+  for (auto loop : loops_) {
+    uint64_t one = 1;
+    if (write(loop->eventfd_, &one, sizeof(one)) == -1) {
+      syslog(LOG_DAEMON | LOG_ERR, "Cannot wake up upstream loop");
+    }
+  }
+  for (auto loop : loops_) {
+    if (loop->thread_.joinable()) {
+      loop->thread_.join();
+    }
+    for (auto request : loop->timeouts_) {
+      if (!request->done_ && request->sockfd_ != -1) {
+        close(request->sockfd_);
+      }
+      delete request;
+    }
+    for (auto request : loop->pending_) {
+      if (request->sockfd_ != -1) {
+        close(request->sockfd_);
+      }
+      delete request;
+    }
+    for (auto socket : loop->sockets_) {
+      close(socket->sockfd_);
+      delete socket;
+    }
+    close(loop->eventfd_);
+    close(loop->epollfd_);
+    delete loop;
+  }
+  loops_.clear();
+}
+
+bool AsyncDNSClient::openSockets(UpstreamLoop &loop) {
+  if (sockets_per_server_ == 0) {
+    return true;
+  }
+  loop.buffer_.resize(65535);
+  for (size_t server = 0; server < dns_server_.dns_servers_.size();
+       server++) {
+    for (size_t i = 0; i < sockets_per_server_; i++) {
+      UpstreamSocket *socket = new UpstreamSocket;
+      socket->server_ = server;
+      if ((socket->sockfd_ = ::socket(AF_INET,
+                                      SOCK_DGRAM | SOCK_NONBLOCK |
+                                          SOCK_CLOEXEC,
+                                      IPPROTO_UDP)) == -1) {
+        delete socket;
+        return false;
+      }
+      loop.sockets_.push_back(socket);
+      socket->slots_.reset(new std::atomic<AsyncRequest *>[65536]);
+      for (size_t id = 0; id < 65536; id++) {
+        socket->slots_[id] = nullptr;
+      }
+      struct sockaddr_in addr;
+      memset(&addr, 0x00, sizeof(addr));
+      addr.sin_family = AF_INET;
+      addr.sin_port = htons(53);
+      addr.sin_addr = dns_server_.dns_servers_[server];
+      struct epoll_event ev;
+      ev.events = EPOLLIN;
+      ev.data.ptr = socket;
+      /* The answers of many queries arrive on the socket at once */
+      int rcvbuf = 4 * 1024 * 1024;
+      if (setsockopt(socket->sockfd_, SOL_SOCKET, SO_RCVBUF, &rcvbuf,
+                     sizeof(rcvbuf)) == -1) {
+        syslog(LOG_DAEMON | LOG_WARNING,
+               "Cannot enlarge the receive buffer of an upstream socket");
+      }
+      /* Only the answers of this recursor are received on the socket */
+      if (connect(socket->sockfd_, (struct sockaddr *)&addr, sizeof(addr)) ==
+              -1 ||
+          epoll_ctl(loop.epollfd_, EPOLL_CTL_ADD, socket->sockfd_, &ev) ==
+              -1) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+ssize_t AsyncDNSClient::sendQuery(uint8_t *query, size_t query_len,
+                                  uint8_t *answer, size_t answer_len) {
+  std::shared_ptr<std::promise<ssize_t>> promise{new std::promise<ssize_t>};
+  std::future<ssize_t> result = promise->get_future();
+  sendQueryAsync(query, query_len, answer, answer_len,
+                 [promise](ssize_t len) { promise->set_value(len); });
+  return result.get();
+}
+
+void AsyncDNSClient::sendQueryAsync(uint8_t *query, size_t query_len,
+                                    uint8_t *answer, size_t answer_len,
+                                    Callback callback) {
+  if (query_len < sizeof(DNSHeader)) {
+    throw DNSClientException("Cannot send query: too short");
+  }
+  UpstreamLoop &loop = *loops_[next_loop_++ % loops_.size()];
+  AsyncRequest *request = new AsyncRequest;
+  request->sockfd_ = -1;
+  request->socket_[0] = request->socket_[1] = nullptr;
+  request->id_ = reinterpret_cast<DNSHeader *>(query)->id();
+  request->upstream_id_[0] = request->upstream_id_[1] = request->id_;
+  request->server_[0] = request->server_[1] = 0;
+  request->hedged_ = false;
+  request->query_ = query;
+  request->query_len_ = query_len;
+  request->answer_ = answer;
+  request->answer_len_ = answer_len;
+  request->attempts_ = 0;
+  request->done_ = false;
+  request->callback_ = std::move(callback);
+
+  if (sockets_per_server_ == 0) {
+    /* Create a UDP socket */
+    if ((request->sockfd_ = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK |
+                                                SOCK_CLOEXEC,
+                                   IPPROTO_UDP)) == -1) {
+      delete request;
+      throw DNSClientException("Cannot create socket");
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = request;
+    if (epoll_ctl(loop.epollfd_, EPOLL_CTL_ADD, request->sockfd_, &ev) ==
+        -1) {
+      close(request->sockfd_);
+      delete request;
+      throw DNSClientException("Cannot watch socket: epoll_ctl failed");
+    }
+  }
+  /* From this point on the request belongs to the loop, which sends it */
+  std::unique_lock<std::mutex> lock{loop.m_};
+  bool wakeup = loop.pending_.empty();
+  loop.pending_.push_back(request);
+  lock.unlock();
+  /* A non-empty queue already has a wakeup on the way */
+  if (wakeup) {
+    uint64_t one = 1;
+    if (write(loop.eventfd_, &one, sizeof(one)) == -1) {
+      syslog(LOG_DAEMON | LOG_ERR, "Cannot wake up upstream loop");
+    }
+  }
+}
+
+UpstreamSocket *AsyncDNSClient::bind(UpstreamLoop &loop,
+                                     AsyncRequest &request, size_t server,
+                                     int i) {
+  size_t first = DNSClient::randomId() % sockets_per_server_;
+  for (size_t k = 0; k < sockets_per_server_; k++) {
+    UpstreamSocket *socket =
+        loop.sockets_[server * sockets_per_server_ +
+                      (first + k) % sockets_per_server_];
+    for (int attempt = 0; attempt < id_attempts; attempt++) {
+      request.socket_[i] = socket;
+      request.upstream_id_[i] = DNSClient::randomId();
+      AsyncRequest *expected = nullptr;
+      if (socket->slots_[request.upstream_id_[i]].compare_exchange_strong(
+              expected, &request)) {
+        return socket;
+      }
+    }
+  }
+  request.socket_[i] = nullptr;
+  return nullptr;
+}
+
+void AsyncDNSClient::unbind(AsyncRequest &request) {
+  for (int i = 0; i < 2; i++) {
+    if (request.socket_[i] != nullptr) {
+      AsyncRequest *expected = &request;
+      request.socket_[i]
+          ->slots_[request.upstream_id_[i]]
+          .compare_exchange_strong(expected, nullptr);
+      request.socket_[i] = nullptr;
+    }
+  }
+}
+
+void AsyncDNSClient::send(UpstreamLoop &loop, AsyncRequest &request) {
+  size_t index = dns_server_.selectServer();
+  request.server_[0] = index;
+  request.hedged_ = false;
+  dns_server_.stats_->sent();
+  if (sockets_per_server_ > 0) {
+    /* Every attempt gets a new ID, the late answers to the old one are
+     * dropped */
+    unbind(request);
+    if (bind(loop, request, index, 0) == nullptr) {
+      syslog(LOG_DAEMON | LOG_ERR,
+             "Cannot send query: no free upstream DNS ID");
+      return;
+    }
+  }
+  request.sent_[0] = std::chrono::steady_clock::now();
+  transmit(request, 0);
+}
+
+void AsyncDNSClient::transmit(AsyncRequest &request, int i) {
+  if (sockets_per_server_ == 0) {
+    struct sockaddr_in server;
+    memset(&server, 0x00, sizeof(server));
+    server.sin_family = AF_INET;
+    server.sin_port = htons(53);
+    server.sin_addr = dns_server_.dns_servers_[request.server_[i]];
+    /* A failed attempt is retried when it times out */
+    if (sendto(request.sockfd_, request.query_, request.query_len_, 0,
+               (struct sockaddr *)&server, sizeof(server)) == -1) {
+      syslog(LOG_DAEMON | LOG_ERR,
+             "Cannot send query: sendto failure: %d (%s)", errno,
+             strerror(errno));
+    }
+    return;
+  }
+
+  /*
+   * The query can not be modified in place, as it may already be in use by
+   * the callback, so the new ID is sent from a separate buffer.
+   */
+  uint16_t id = htons(request.upstream_id_[i]);
+  struct iovec iov[2];
+  iov[0].iov_base = &id;
+  iov[0].iov_len = sizeof(id);
+  iov[1].iov_base = request.query_ + sizeof(id);
+  iov[1].iov_len = request.query_len_ - sizeof(id);
+  struct msghdr msg;
+  memset(&msg, 0x00, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = 2;
+  if (sendmsg(request.socket_[i]->sockfd_, &msg, 0) == -1) {
+    syslog(LOG_DAEMON | LOG_ERR,
+           "Cannot send query: sendmsg failure: %d (%s)", errno,
+           strerror(errno));
+  }
+}
+
+void AsyncDNSClient::hedge(UpstreamLoop &loop, AsyncRequest &request) {
+  size_t index = dns_server_.selectHedgeServer(request.server_[0]);
+  if (index == dns_server_.dns_servers_.size() ||
+      !dns_server_.stats_->hedge()) {
+    return;
+  }
+  request.server_[1] = index;
+  if (sockets_per_server_ > 0 && bind(loop, request, index, 1) == nullptr) {
+    return;
+  }
+  request.hedged_ = true;
+  request.sent_[1] = std::chrono::steady_clock::now();
+  transmit(request, 1);
+}
+
+void AsyncDNSClient::schedule(UpstreamLoop &loop, AsyncRequest *request) {
+  request->deadline_ = std::chrono::steady_clock::now() + timeout_;
+  loop.timeouts_.push_back(request);
+  std::chrono::microseconds delay =
+      dns_server_.stats_->hedgeDelay(request->server_[0]);
+  /* Until there are enough samples the requests are not hedged */
+  if (dns_server_.hedging_ && delay.count() > 0 && delay < timeout_) {
+    HedgeTimer timer;
+    timer.deadline_ = request->deadline_ - timeout_ + delay;
+    timer.request_ = request;
+    timer.attempt_ = request->attempts_;
+    loop.hedges_.push(timer);
+  }
+}
+
+void AsyncDNSClient::run(UpstreamLoop &loop) {
+  struct epoll_event events[64];
+  std::vector<AsyncRequest *> pending;
+  while (!stop_) {
+    std::unique_lock<std::mutex> lock{loop.m_};
+    pending.swap(loop.pending_);
+    lock.unlock();
+    for (auto request : pending) {
+      send(loop, *request);
+      schedule(loop, request);
+    }
+    pending.clear();
+    int timeout = -1;
+    if (!loop.timeouts_.empty()) {
+      std::chrono::steady_clock::time_point next =
+          loop.timeouts_.front()->deadline_;
+      if (!loop.hedges_.empty() && loop.hedges_.top().deadline_ < next) {
+        next = loop.hedges_.top().deadline_;
+      }
+      std::chrono::steady_clock::duration left =
+          next - std::chrono::steady_clock::now();
+      timeout = std::chrono::duration_cast<std::chrono::milliseconds>(left)
+                    .count() +
+                1;
+      if (timeout < 0) {
+        timeout = 0;
+      }
+    }
+    int n = epoll_wait(loop.epollfd_, events, sizeof(events) / sizeof(*events),
+                       timeout);
+    if (n == -1 && errno != EINTR) {
+      syslog(LOG_DAEMON | LOG_ERR, "epoll_wait failure: %d (%s)", errno,
+             strerror(errno));
+    }
+    for (int i = 0; i < n; i++) {
+      if (events[i].data.ptr == nullptr) {
+        uint64_t value;
+        if (read(loop.eventfd_, &value, sizeof(value)) == -1) {
+          /* Already cleared by an earlier wakeup */
+        }
+      } else if (sockets_per_server_ > 0) {
+        receive(loop, *static_cast<UpstreamSocket *>(events[i].data.ptr));
+      } else {
+        receive(*static_cast<AsyncRequest *>(events[i].data.ptr));
+      }
+    }
+    expire(loop);
+  }
+}
+
+void AsyncDNSClient::receive(AsyncRequest &request) {
+  struct sockaddr_in server;
+  socklen_t server_len;
+  ssize_t recvlen;
+  while (!request.done_) {
+    server_len = sizeof(server);
+    if ((recvlen = recvfrom(request.sockfd_, request.answer_,
+                            request.answer_len_, 0, (struct sockaddr *)&server,
+                            &server_len)) == -1) {
+      break;
+    }
+    /* Answers to an earlier attempt are just as good */
+    if (server.sin_port == htons(53) &&
+        (size_t)recvlen >= sizeof(DNSHeader) &&
+        reinterpret_cast<DNSHeader *>(request.answer_)->id() ==
+            reinterpret_cast<DNSHeader *>(request.query_)->id()) {
+      int i = request.hedged_ &&
+                      server.sin_addr.s_addr ==
+                          dns_server_.dns_servers_[request.server_[1]].s_addr
+                  ? 1
+                  : 0;
+      dns_server_.stats_->sample(request.server_[i],
+                                 std::chrono::steady_clock::now() -
+                                     request.sent_[i]);
+      complete(request, recvlen);
+    }
+  }
+}
+
+void AsyncDNSClient::receive(UpstreamLoop &loop, UpstreamSocket &socket) {
+  ssize_t recvlen;
+  while ((recvlen = recv(socket.sockfd_, loop.buffer_.data(),
+                         loop.buffer_.size(), 0)) != -1) {
+    if ((size_t)recvlen < sizeof(DNSHeader)) {
+      continue;
+    }
+    DNSHeader *header = reinterpret_cast<DNSHeader *>(loop.buffer_.data());
+    uint16_t id = header->id();
+    AsyncRequest *request = socket.slots_[id].load();
+    /* The source is checked by the connected socket */
+    if (request == nullptr ||
+        !DNSClient::sameQuestion(request->query_, request->query_len_,
+                                 loop.buffer_.data(), recvlen) ||
+        !socket.slots_[id].compare_exchange_strong(request, nullptr)) {
+      continue;
+    }
+    /* The loser of the attempt and its hedge is dropped as unknown */
+    int i = request->socket_[1] == &socket && request->upstream_id_[1] == id
+                ? 1
+                : 0;
+    dns_server_.stats_->sample(request->server_[i],
+                               std::chrono::steady_clock::now() -
+                                   request->sent_[i]);
+    unbind(*request);
+    header->id(request->id_);
+    size_t len = std::min(static_cast<size_t>(recvlen), request->answer_len_);
+    memcpy(request->answer_, loop.buffer_.data(), len);
+    complete(*request, len);
+  }
+}
+
+void AsyncDNSClient::complete(AsyncRequest &request, ssize_t len) {
+  /* Closing the socket also removes it from the epoll instance */
+  if (request.sockfd_ != -1) {
+    close(request.sockfd_);
+  }
+  request.done_ = true;
+  Callback callback = std::move(request.callback_);
+  request.callback_ = nullptr;
+  try {
+    callback(len);
+  } catch (std::exception &e) {
+    syslog(LOG_DAEMON | LOG_ERR, "%s", e.what());
+  }
+}
+
+void AsyncDNSClient::expire(UpstreamLoop &loop) {
+  std::vector<HedgeTimer> hedges;
+  std::vector<AsyncRequest *> expired;
+  std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+  while (!loop.hedges_.empty() && loop.hedges_.top().deadline_ <= now) {
+    hedges.push_back(loop.hedges_.top());
+    loop.hedges_.pop();
+  }
+  while (!loop.timeouts_.empty() && loop.timeouts_.front()->deadline_ <= now) {
+    expired.push_back(loop.timeouts_.front());
+    loop.timeouts_.pop_front();
+  }
+  /* The hedges go first, as the expired requests may be deleted */
+  for (auto &timer : hedges) {
+    if (!timer.request_->done_ &&
+        timer.request_->attempts_ == timer.attempt_) {
+      hedge(loop, *timer.request_);
+    }
+  }
+  /* The callbacks may start new requests, which are queued in pending_ */
+  for (auto request : expired) {
+    if (!request->done_) {
+      dns_server_.stats_->timeout(request->server_[0], timeout_);
+      if (request->hedged_) {
+        dns_server_.stats_->timeout(request->server_[1],
+                                    request->deadline_ - request->sent_[1]);
+      }
+    }
+    if (request->done_) {
+      delete request;
+    } else if (++request->attempts_ > dns_server_.resend_attempts_) {
+      unbind(*request);
+      complete(*request, -1);
+      delete request;
+    } else {
+      send(loop, *request);
+      schedule(loop, request);
+    }
+  }
+}
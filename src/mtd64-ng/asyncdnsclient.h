@@ -0,0 +1,287 @@
+/* mtd64-ng - a lightweight multithreaded C++11 DNS64 server
+ * Based on MTD64 (https://github.com/Yoso89/MTD64)
+ * Copyright (C) 2015  Daniel Bakai <bakaid@kszk.bme.hu>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+
+/** @file
+ *  @brief Header for the AsyncDNSClient and related classes.
+ */
+
+#ifndef ASYNCDNSCLIENT_H_INCLUDED
+#define ASYNCDNSCLIENT_H_INCLUDED
+#include "dnssource.h"
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <netinet/in.h>
+#include <queue>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <thread>
+#include <vector>
+
+class Server;
+struct UpstreamSocket;
+
+/**
+ * An outstanding upstream query of the AsyncDNSClient.
+ */
+struct AsyncRequest {
+  int sockfd_;          /**< Own socket of this query (-1 if multiplexed). */
+  UpstreamSocket *socket_[2]; /**< Shared sockets the current attempt and its
+                                 hedge were sent on (nullptr if none). */
+  uint16_t id_;         /**< The original DNS ID of the query. */
+  uint16_t upstream_id_[2]; /**< DNS IDs of the current attempt and of its
+                               hedge. */
+  size_t server_[2];    /**< Recursors of the current attempt and of its
+                           hedge. */
+  std::chrono::steady_clock::time_point
+      sent_[2];         /**< Send times of the current attempt and of its
+                           hedge. */
+  bool hedged_;         /**< Whether the current attempt was hedged. */
+  uint8_t *query_;      /**< The query packet. */
+  size_t query_len_;    /**< Length of the query packet. */
+  uint8_t *answer_;     /**< Buffer for the answer. */
+  size_t answer_len_;   /**< Length of the answer buffer. */
+  short int attempts_;  /**< Number of the (re)sent queries so far. */
+  bool done_;           /**< Whether the callback has been called. */
+  DNSSource::Callback callback_; /**< Function to call with the result. */
+  std::chrono::steady_clock::time_point
+      deadline_; /**< Time when the current attempt times out. */
+};
+
+/**
+ * A timer to hedge an attempt of a request.
+ * The hedge delay is always shorter than the timeout, so the request outlives
+ * its timers.
+ */
+struct HedgeTimer {
+  std::chrono::steady_clock::time_point deadline_; /**< Time of the hedge. */
+  AsyncRequest *request_; /**< The request. */
+  short int attempt_;     /**< The attempt to hedge. */
+
+  /**
+   * Orders the timers by deadline.
+   * @param rhs the other timer
+   * @return whether this timer expires later
+   */
+  bool operator>(const HedgeTimer &rhs) const {
+    return deadline_ > rhs.deadline_;
+  }
+};
+
+/**
+ * A socket connected to a recursor, shared by many queries.
+ * The answers are matched to the queries by their DNS ID, which indexes the
+ * dispatch table of the socket.
+ */
+struct UpstreamSocket {
+  int sockfd_;    /**< The socket. */
+  size_t server_; /**< Index of the recursor the socket is connected to. */
+  std::unique_ptr<std::atomic<AsyncRequest *>[]>
+      slots_; /**< Dispatch table: the request waiting for each DNS ID. */
+};
+
+/**
+ * An epoll event loop of the AsyncDNSClient running on its own thread.
+ */
+struct UpstreamLoop {
+  int epollfd_;  /**< The epoll instance watching the request sockets. */
+  int eventfd_;  /**< Used to wake up the loop. */
+  std::mutex m_; /**< Mutex for the pending_ queue. */
+  std::vector<AsyncRequest *>
+      pending_; /**< Requests handed over by the callers, not sent yet. */
+  std::deque<AsyncRequest *>
+      timeouts_; /**< Requests ordered by deadline. As every attempt uses the
+                    same timeout, appending keeps the queue sorted. */
+  std::priority_queue<HedgeTimer, std::vector<HedgeTimer>,
+                      std::greater<HedgeTimer>>
+      hedges_; /**< Hedge timers ordered by deadline. */
+  std::thread thread_; /**< The thread running the loop. */
+  std::vector<UpstreamSocket *>
+      sockets_; /**< Shared sockets of the loop, grouped by recursor. */
+  std::vector<uint8_t> buffer_; /**< Receive buffer of the shared sockets. */
+};
+
+/**
+ * An event driven DNSSource implementation using the configured recursors and
+ * no caching.
+ * The queries are handed over to a few epoll event loops, which send them and
+ * handle their answers and timeouts, so the number of outstanding queries
+ * does not depend on the number of worker threads. A request is only ever
+ * touched by the thread of its loop.
+ * Every loop either multiplexes the queries over a few shared sockets per
+ * recursor, rewriting their DNS IDs, or uses a new socket for every query.
+ */
+class AsyncDNSClient : public DNSSource {
+private:
+  Server
+      &dns_server_; /**< The Server, used to access configuration settings. */
+  std::vector<UpstreamLoop *> loops_; /**< The event loops. */
+  std::atomic<unsigned int> next_loop_; /**< Used to distribute the requests
+                                           among the loops. */
+  std::atomic<bool> stop_; /**< Used to stop the event loops. */
+  std::chrono::steady_clock::duration timeout_; /**< Timeout of an attempt. */
+  size_t sockets_per_server_; /**< Shared sockets per recursor in each loop
+                                 (0 means a new socket for every query). */
+
+  /**
+   * Creates the shared sockets of a loop.
+   * @param loop the loop
+   * @return whether all sockets could be created
+   */
+  bool openSockets(UpstreamLoop &loop);
+
+  /**
+   * Assigns a shared socket connected to a recursor and a free DNS ID to a
+   * request.
+   * @param loop the loop of the request
+   * @param request the request
+   * @param server the index of the recursor
+   * @param i 0 for the attempt, 1 for its hedge
+   * @return the socket, or nullptr if all tried IDs were in use
+   */
+  UpstreamSocket *bind(UpstreamLoop &loop, AsyncRequest &request,
+                       size_t server, int i);
+
+  /**
+   * Removes a request from the dispatch tables of its shared sockets.
+   * @param request the request
+   */
+  void unbind(AsyncRequest &request);
+
+  /**
+   * Main function of an event loop thread.
+   * @param loop the loop to run
+   */
+  void run(UpstreamLoop &loop);
+
+  /**
+   * Sends the query of a request to a nameserver chosen by the configured
+   * selection mode.
+   * @param loop the loop of the request
+   * @param request the request
+   */
+  void send(UpstreamLoop &loop, AsyncRequest &request);
+
+  /**
+   * Sends the current attempt or the hedge of a request to its recursor.
+   * @param request the request
+   * @param i 0 for the attempt, 1 for its hedge
+   */
+  void transmit(AsyncRequest &request, int i);
+
+  /**
+   * Sends the hedge of a request to another nameserver, if the budget allows.
+   * @param loop the loop of the request
+   * @param request the request
+   */
+  void hedge(UpstreamLoop &loop, AsyncRequest &request);
+
+  /**
+   * Appends a request to the timeout queue of a loop, and sets its hedge
+   * timer if hedging is enabled. Called by the thread of the loop.
+   * @param loop the loop
+   * @param request the request
+   */
+  void schedule(UpstreamLoop &loop, AsyncRequest *request);
+
+  /**
+   * Reads the pending datagrams of a request's socket.
+   * @param request the request
+   */
+  void receive(AsyncRequest &request);
+
+  /**
+   * Reads the pending datagrams of a shared socket and dispatches them.
+   * @param loop the loop of the socket
+   * @param socket the socket
+   */
+  void receive(UpstreamLoop &loop, UpstreamSocket &socket);
+
+  /**
+   * Finishes a request and calls its callback.
+   * @param request the request
+   * @param len the length of the answer (-1 on failure)
+   */
+  void complete(AsyncRequest &request, ssize_t len);
+
+  /**
+   * Hedges the requests whose hedge timer has expired, then retries or fails
+   * the requests whose deadline has passed.
+   * @param loop the loop
+   */
+  void expire(UpstreamLoop &loop);
+
+public:
+  /**
+   * Constructor.
+   * Starts the event loops.
+   * @param dns_server the Server to use
+   * @param threads the number of event loops
+   * @param sockets the number of shared sockets per recursor in each loop
+   * (0 means a new socket for every query)
+   */
+  AsyncDNSClient(Server &dns_server, size_t threads, size_t sockets);
+
+  /**
+   * Destructor.
+   * Stops the event loops and drops the outstanding requests.
+   */
+  ~AsyncDNSClient();
+
+  /**
+   * Copy constructor, explicitly deleted.
+   */
+  AsyncDNSClient(const AsyncDNSClient &) = delete;
+
+  /**
+   * Copy assignment operator, explicitly deleted.
+   */
+  AsyncDNSClient &operator=(const AsyncDNSClient &) = delete;
+
+  /**
+   * Sends a query and waits for its answer.
+   * @param query the query packet
+   * @param query_len length of the packet
+   * @param answer buffer for the answer
+   * @param answer_len length of the buffer
+   * @return the length of the answer (-1 on failure)
+   */
+  ssize_t sendQuery(uint8_t *query, size_t query_len, uint8_t *answer,
+                    size_t answer_len) override;
+
+  /**
+   * Sends a query and returns right away. The callback is called on one of
+   * the event loop threads.
+   * @param query the query packet
+   * @param query_len length of the packet
+   * @param answer buffer for the answer
+   * @param answer_len length of the buffer
+   * @param callback the function to call with the result
+   */
+  void sendQueryAsync(uint8_t *query, size_t query_len, uint8_t *answer,
+                      size_t answer_len, Callback callback) override;
+};
+
+#endif
@@ -0,0 +1,135 @@
+/* mtd64-ng - a lightweight multithreaded C++11 DNS64 server
+ * Based on MTD64 (https://github.com/Yoso89/MTD64)
+ * Copyright (C) 2015  Daniel Bakai <bakaid@kszk.bme.hu>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+#include "coalescer.h"
+#include "answercache.h"
+#include "../dns.h"
+#include <condition_variable>
+#include <cstring>
+
+Coalescer::Coalescer(DNSSource &source, bool blocking)
+    : source_(source), blocking_{blocking}, coalesced_{0} {}
+
+InflightShard &Coalescer::shard(const std::string &key) {
+  return shards_[std::hash<std::string>()(key) % shards];
+}
+
+bool Coalescer::join(const std::string &key, const InflightWaiter &waiter) {
+  InflightShard &s = shard(key);
+  std::unique_lock<std::mutex> lock{s.m_};
+  auto it = s.index_.find(key);
+  if (it != s.index_.end()) {
+    it->second.push_back(waiter);
+    coalesced_.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+  s.index_.emplace(key, std::vector<InflightWaiter>{});
+  return true;
+}
+
+void Coalescer::finish(const std::string &key, const uint8_t *answer,
+                       ssize_t len, const Callback &callback) {
+  std::vector<InflightWaiter> waiters;
+  {
+    InflightShard &s = shard(key);
+    std::unique_lock<std::mutex> lock{s.m_};
+    auto it = s.index_.find(key);
+    if (it != s.index_.end()) {
+      waiters.swap(it->second);
+      s.index_.erase(it);
+    }
+  }
+  /* The question of the answer is the same as the key without its flags */
+  size_t question_len = key.size() - 1;
+  std::vector<ssize_t> results(waiters.size(), -1);
+  for (size_t i = 0; i < waiters.size(); i++) {
+    InflightWaiter &waiter = waiters[i];
+    if (len <= 0 || static_cast<size_t>(len) > waiter.answer_len_) {
+      continue;
+    }
+    memcpy(waiter.answer_, answer, len);
+    /* The ID, the RD flag and the case of the QName are the waiter's */
+    memcpy(waiter.answer_, waiter.query_, 2);
+    waiter.answer_[2] = (waiter.answer_[2] & ~0x01) | (waiter.query_[2] & 0x01);
+    if (static_cast<size_t>(len) >= sizeof(DNSHeader) + question_len &&
+        reinterpret_cast<const DNSHeader *>(answer)->qdcount() == 1) {
+      memcpy(waiter.answer_ + sizeof(DNSHeader),
+             waiter.query_ + sizeof(DNSHeader), question_len);
+    }
+    results[i] = len;
+  }
+  if (callback) {
+    callback(len);
+  }
+  for (size_t i = 0; i < waiters.size(); i++) {
+    waiters[i].callback_(results[i]);
+  }
+}
+
+ssize_t Coalescer::sendQuery(uint8_t *query, size_t query_len, uint8_t *answer,
+                             size_t answer_len) {
+  std::string key;
+  if (!AnswerCache::key(query, query_len, key)) {
+    return source_.sendQuery(query, query_len, answer, answer_len);
+  }
+  std::mutex m;
+  std::condition_variable cv;
+  bool done = false;
+  ssize_t res = -1;
+  InflightWaiter waiter{query, answer, answer_len, [&](ssize_t len) {
+                          std::unique_lock<std::mutex> lock{m};
+                          res = len;
+                          done = true;
+                          cv.notify_one();
+                        }};
+  if (!join(key, waiter)) {
+    std::unique_lock<std::mutex> lock{m};
+    cv.wait(lock, [&] { return done; });
+    return res;
+  }
+  res = source_.sendQuery(query, query_len, answer, answer_len);
+  finish(key, answer, res, Callback{});
+  return res;
+}
+
+void Coalescer::sendQueryAsync(uint8_t *query, size_t query_len,
+                               uint8_t *answer, size_t answer_len,
+                               Callback callback) {
+  if (blocking_) {
+    DNSSource::sendQueryAsync(query, query_len, answer, answer_len, callback);
+    return;
+  }
+  std::string key;
+  if (!AnswerCache::key(query, query_len, key)) {
+    source_.sendQueryAsync(query, query_len, answer, answer_len, callback);
+    return;
+  }
+  if (!join(key, InflightWaiter{query, answer, answer_len, callback})) {
+    return;
+  }
+  source_.sendQueryAsync(query, query_len, answer, answer_len,
+                         [this, key, answer, callback](ssize_t len) {
+                           finish(key, answer, len, callback);
+                         });
+}
+
+unsigned long Coalescer::coalesced() const {
+  return coalesced_.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,151 @@
+/* mtd64-ng - a lightweight multithreaded C++11 DNS64 server
+ * Based on MTD64 (https://github.com/Yoso89/MTD64)
+ * Copyright (C) 2015  Daniel Bakai <bakaid@kszk.bme.hu>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+/** @file
+ *  @brief Header for the Coalescer and related classes.
+ */
+
+#ifndef COALESCER_H_INCLUDED
+#define COALESCER_H_INCLUDED
+
+#include "dnssource.h"
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * A query waiting for the answer of an identical query in flight.
+ */
+struct InflightWaiter {
+  const uint8_t *query_;        /**< The query packet. */
+  uint8_t *answer_;             /**< Buffer for the answer. */
+  size_t answer_len_;           /**< Length of the buffer. */
+  DNSSource::Callback callback_; /**< The function to call with the result. */
+};
+
+/**
+ * A shard of the in-flight table.
+ */
+struct InflightShard {
+  std::mutex m_; /**< Mutex for the table. */
+  std::unordered_map<std::string, std::vector<InflightWaiter>>
+      index_; /**< The waiters of the questions in flight. */
+};
+
+/**
+ * A DNSSource coalescing the identical queries of another DNSSource.
+ * The first query of a question is sent upstream, and the identical queries
+ * arriving while it is in flight wait for its answer instead of sending their
+ * own. The answer is copied to each of them with their own ID, RD flag and
+ * QName case. The queries are identical if they have the same AnswerCache
+ * key; the others are passed through.
+ * If the coalesced DNSSource is blocking, the waiters block on their own
+ * threads as well, so they are not resumed one after another on the thread
+ * of the query sent upstream.
+ */
+class Coalescer : public DNSSource {
+private:
+  static const size_t shards = 64; /**< Number of shards. */
+
+  DNSSource &source_;                   /**< The coalesced DNSSource. */
+  bool blocking_; /**< Whether the coalesced DNSSource is blocking. */
+  std::atomic<unsigned long> coalesced_; /**< Number of queries answered by
+                                            another query. */
+  InflightShard shards_[shards];        /**< The shards. */
+
+  /**
+   * Returns the shard of a key.
+   * @param key the key
+   * @return the shard
+   */
+  InflightShard &shard(const std::string &key);
+
+  /**
+   * Registers a query in the in-flight table.
+   * @param key the key of the query
+   * @param waiter the query, added to the waiters if the question is already
+   * in flight
+   * @return true if the query has to be sent upstream
+   */
+  bool join(const std::string &key, const InflightWaiter &waiter);
+
+  /**
+   * Removes a question from the in-flight table and answers its waiters.
+   * The answer is copied before any callback is called, so the callbacks may
+   * release the buffer of the answer.
+   * @param key the key of the question
+   * @param answer the answer of the question
+   * @param len the length of the answer (-1 on failure)
+   * @param callback the callback of the query sent upstream
+   */
+  void finish(const std::string &key, const uint8_t *answer, ssize_t len,
+              const Callback &callback);
+
+public:
+  /**
+   * Constructor.
+   * @param source the DNSSource to coalesce the queries of
+   * @param blocking whether the source answers on the calling thread
+   */
+  Coalescer(DNSSource &source, bool blocking);
+
+  /**
+   * Copy constructor, explicitly deleted.
+   */
+  Coalescer(const Coalescer &) = delete;
+
+  /**
+   * Copy assignment operator, explicitly deleted.
+   */
+  Coalescer &operator=(const Coalescer &) = delete;
+
+  /**
+   * Sends a query, or waits for the answer of an identical query in flight.
+   * @param query the query packet
+   * @param query_len length of the packet
+   * @param answer buffer for the answer
+   * @param answer_len length of the buffer
+   * @return the length of the answer (-1 on failure)
+   */
+  ssize_t sendQuery(uint8_t *query, size_t query_len, uint8_t *answer,
+                    size_t answer_len) override;
+
+  /**
+   * Sends a query asynchronously, or adds it to the waiters of an identical
+   * query in flight.
+   * @param query the query packet
+   * @param query_len length of the packet
+   * @param answer buffer for the answer
+   * @param answer_len length of the buffer
+   * @param callback the function to call with the result
+   */
+  void sendQueryAsync(uint8_t *query, size_t query_len, uint8_t *answer,
+                      size_t answer_len, Callback callback) override;
+
+  /**
+   * Getter for the number of coalesced queries.
+   * @return the number of queries answered by another query
+   */
+  unsigned long coalesced() const;
+};
+
+#endif
@@ -19,22 +19,76 @@
  */
 
 #include "dnsclient.h"
+#include "../dns.h"
+#include "../uring.h"
 #include "server.h"
+#include "socketpool.h"
 #include <arpa/inet.h>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
 #include <cstdlib>
 #include <cstring>
+#include <functional>
+#include <memory>
 #include <net/if.h>
+#include <poll.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <syslog.h>
+#include <thread>
 #include <time.h>
 #include <unistd.h>
 
+namespace {
+/*
+ * Per-thread io_uring of the upstream queries.
+ */
+thread_local std::unique_ptr<IOUring> local_ring;
+
+/*
+ * Set if the io_uring of this thread could not be created.
+ */
+thread_local bool local_ring_failed = false;
+
+/*
+ * user_data values of the linked requests.
+ */
+enum : uint64_t { SEND = 1, RECV = 2, TIMEOUT = 3 };
+
+/*
+ * State of the per-thread xorshift generator of the upstream DNS IDs.
+ */
+thread_local uint32_t id_state = 0;
+
+/*
+ * Returns the length of the header and the question of a packet, or 0 if it
+ * is malformed. Queries do not use name compression.
+ */
+size_t questionEnd(const uint8_t *packet, size_t len) {
+  size_t i = sizeof(DNSHeader);
+  while (i < len && packet[i] != 0) {
+    if (packet[i] > 63) {
+      return 0;
+    }
+    i += packet[i] + 1;
+  }
+  /* The root label, the type and the class */
+  i += 5;
+  return i <= len ? i : 0;
+}
+} // namespace
+
 DNSClientException::DNSClientException(std::string what) : what_{what} {}
 
 const char *DNSClientException::what() const noexcept { return what_.c_str(); }
 
-DNSClient::DNSClient(Server &dns_server) : dns_server_{dns_server} {
+DNSClient::DNSClient(Server &dns_server, bool pooled)
+    : dns_server_{dns_server}, sockfd_{-1}, pool_{nullptr} {
+  if (pooled) {
+    pool_ = new SocketPool{dns_server_.dns_servers_, dns_server_.timeout_};
+    return;
+  }
   /* Create a UDP socket */
   if ((sockfd_ = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1) {
     throw DNSClientException("Cannot create socket");
@@ -50,39 +104,369 @@ DNSClient::DNSClient(Server &dns_server) : dns_server_{dns_server} {
 
 DNSClient::~DNSClient() {
   /* Close socket */
-  close(sockfd_);
+  if (sockfd_ != -1) {
+    close(sockfd_);
+  }
+  delete pool_;
+}
+
+uint16_t DNSClient::randomId() {
+  if (id_state == 0) {
+    id_state = static_cast<uint32_t>(
+        std::chrono::steady_clock::now().time_since_epoch().count() ^
+        std::hash<std::thread::id>()(std::this_thread::get_id()));
+    if (id_state == 0) {
+      id_state = 1;
+    }
+  }
+  id_state ^= id_state << 13;
+  id_state ^= id_state >> 17;
+  id_state ^= id_state << 5;
+  return id_state >> 16;
+}
+
+bool DNSClient::sameQuestion(const uint8_t *query, size_t query_len,
+                             const uint8_t *answer, size_t answer_len) {
+  size_t end = questionEnd(query, query_len);
+  if (end == 0 || end > answer_len) {
+    return false;
+  }
+  for (size_t i = sizeof(DNSHeader); i < end - 4; i++) {
+    if (tolower(query[i]) != tolower(answer[i])) {
+      return false;
+    }
+  }
+  return memcmp(query + end - 4, answer + end - 4, 4) == 0;
+}
+
+bool DNSClient::matches(const uint8_t *query, size_t query_len,
+                        const uint8_t *answer, ssize_t len) {
+  return len >= 2 && answer[0] == query[0] && answer[1] == query[1] &&
+         sameQuestion(query, query_len, answer, len);
+}
+
+IOUring *DNSClient::ring() {
+  if (local_ring == nullptr && !local_ring_failed) {
+    try {
+      local_ring.reset(new IOUring{8});
+    } catch (URingException &e) {
+      syslog(LOG_DAEMON | LOG_WARNING,
+             "%s, upstream queries use the socket backend", e.what());
+      local_ring_failed = true;
+    }
+  }
+  return local_ring.get();
+}
+
+ssize_t DNSClient::exchange(IOUring &ring, int sockfd,
+                            struct sockaddr_in &server, uint8_t *query,
+                            size_t query_len, uint8_t *answer,
+                            size_t answer_len) {
+  struct iovec iov;
+  iov.iov_base = query;
+  iov.iov_len = query_len;
+  struct msghdr msg;
+  memset(&msg, 0x00, sizeof(msg));
+  msg.msg_name = &server;
+  msg.msg_namelen = sizeof(server);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  /* The skipped answers do not extend the timeout of the query */
+  std::chrono::steady_clock::time_point deadline =
+      std::chrono::steady_clock::now() +
+      std::chrono::seconds{dns_server_.timeout_.tv_sec} +
+      std::chrono::microseconds{dns_server_.timeout_.tv_usec};
+  struct __kernel_timespec ts;
+
+  bool send = true;
+  while (true) {
+    std::chrono::nanoseconds left = deadline - std::chrono::steady_clock::now();
+    if (left.count() <= 0) {
+      errno = ETIMEDOUT;
+      return -1;
+    }
+    ts.tv_sec = left.count() / 1000000000;
+    ts.tv_nsec = left.count() % 1000000000;
+    /* The ring is empty between the calls, so there is room for all three */
+    struct io_uring_sqe *sqe;
+    if (send) {
+      sqe = ring.getSqe();
+      sqe->opcode = IORING_OP_SENDMSG;
+      sqe->fd = sockfd;
+      sqe->addr = reinterpret_cast<uintptr_t>(&msg);
+      sqe->len = 1;
+      sqe->flags = IOSQE_IO_LINK;
+      sqe->user_data = SEND;
+    }
+    sqe = ring.getSqe();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = sockfd;
+    sqe->addr = reinterpret_cast<uintptr_t>(answer);
+    sqe->len = answer_len;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->user_data = RECV;
+    sqe = ring.getSqe();
+    sqe->opcode = IORING_OP_LINK_TIMEOUT;
+    sqe->addr = reinterpret_cast<uintptr_t>(&ts);
+    sqe->len = 1;
+    sqe->user_data = TIMEOUT;
+
+    int send_res = 0;
+    ssize_t recvlen = -1;
+    int expected = send ? 3 : 2;
+    int completed = 0;
+    while (completed < expected) {
+      if (ring.submit(expected - completed) == -1 && errno != EINTR) {
+        throw DNSClientException("Cannot send query: io_uring_enter failed");
+      }
+      struct io_uring_cqe *cqe;
+      while ((cqe = ring.peek()) != nullptr) {
+        if (cqe->user_data == SEND) {
+          send_res = cqe->res;
+        } else if (cqe->user_data == RECV) {
+          recvlen = cqe->res;
+        }
+        ring.seen();
+        completed++;
+      }
+    }
+    if (send_res < 0) {
+      throw DNSClientException("Cannot send query");
+    }
+    /* The completion holds the negated errno, like the timeout's -ECANCELED */
+    if (recvlen < 0) {
+      errno = -recvlen;
+      return -1;
+    }
+    /* A late answer to an earlier query is skipped */
+    if (recvlen == 0 || matches(query, query_len, answer, recvlen)) {
+      return recvlen;
+    }
+    send = false;
+  }
+}
+
+ssize_t DNSClient::transfer(int sockfd, struct sockaddr_in &server,
+                            uint8_t *query, size_t query_len, uint8_t *answer,
+                            size_t answer_len) {
+  /* Send DNS query */
+  if (sendto(sockfd, query, query_len, 0, (struct sockaddr *)&server,
+             sizeof(server)) == -1) {
+    throw DNSClientException("Cannot send query");
+  }
+  /* Receive DNS answer, skipping the late answers to earlier queries, which
+   * do not extend the timeout of the query */
+  std::chrono::steady_clock::time_point deadline =
+      std::chrono::steady_clock::now() +
+      std::chrono::seconds{dns_server_.timeout_.tv_sec} +
+      std::chrono::microseconds{dns_server_.timeout_.tv_usec};
+  struct pollfd fd;
+  fd.fd = sockfd;
+  fd.events = POLLIN;
+  while (true) {
+    std::chrono::nanoseconds left = deadline - std::chrono::steady_clock::now();
+    if (left.count() <= 0) {
+      return -1;
+    }
+    struct timespec ts;
+    ts.tv_sec = left.count() / 1000000000;
+    ts.tv_nsec = left.count() % 1000000000;
+    fd.revents = 0;
+    if (ppoll(&fd, 1, &ts, nullptr) == -1 && errno != EINTR) {
+      throw DNSClientException("Cannot receive answer: poll failed");
+    }
+    if (!(fd.revents & (POLLIN | POLLERR))) {
+      continue;
+    }
+    ssize_t recvlen = recv(sockfd, answer, answer_len, MSG_DONTWAIT);
+    if (recvlen == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      continue;
+    }
+    if (recvlen <= 0 || matches(query, query_len, answer, recvlen)) {
+      return recvlen;
+    }
+  }
+}
+
+ssize_t DNSClient::hedgedTransfer(size_t index, int sockfd,
+                                  struct sockaddr_in &server, uint8_t *query,
+                                  size_t query_len, uint8_t *answer,
+                                  size_t answer_len) {
+  UpstreamStats &stats = *dns_server_.stats_;
+  std::chrono::steady_clock::time_point sent[2];
+  sent[0] = std::chrono::steady_clock::now();
+  std::chrono::steady_clock::time_point deadline =
+      sent[0] + std::chrono::seconds{dns_server_.timeout_.tv_sec} +
+      std::chrono::microseconds{dns_server_.timeout_.tv_usec};
+  std::chrono::microseconds delay = stats.hedgeDelay(index);
+  /* Until there are enough samples the query is not hedged */
+  bool hedge_pending = delay.count() > 0 && sent[0] + delay < deadline;
+  std::chrono::steady_clock::time_point hedge_at = sent[0] + delay;
+
+  if (sendto(sockfd, query, query_len, 0, (struct sockaddr *)&server,
+             sizeof(server)) == -1) {
+    throw DNSClientException("Cannot send query");
+  }
+
+  size_t servers[2] = {index, index};
+  struct pollfd fds[2];
+  fds[0].fd = sockfd;
+  fds[0].events = POLLIN;
+  nfds_t nfds = 1;
+  int hedge_sockfd = -1;
+  ssize_t recvlen = -1;
+  try {
+    while (recvlen == -1) {
+      std::chrono::steady_clock::time_point now =
+          std::chrono::steady_clock::now();
+      if (now >= deadline) {
+        break;
+      }
+      if (hedge_pending && now >= hedge_at) {
+        hedge_pending = false;
+        size_t hedge = dns_server_.selectHedgeServer(index);
+        if (hedge == dns_server_.dns_servers_.size() || !stats.hedge()) {
+          continue;
+        }
+        servers[1] = hedge;
+        struct sockaddr_in hedge_server = server;
+        hedge_server.sin_addr = dns_server_.dns_servers_[servers[1]];
+        /* An own socket is not connected, so it receives both answers */
+        if (pool_ == nullptr) {
+          hedge_sockfd = sockfd;
+        } else if ((hedge_sockfd = pool_->acquire(servers[1])) == -1) {
+          continue;
+        } else {
+          fds[1].fd = hedge_sockfd;
+          fds[1].events = POLLIN;
+          nfds = 2;
+        }
+        sent[1] = now;
+        if (sendto(hedge_sockfd, query, query_len, 0,
+                   (struct sockaddr *)&hedge_server,
+                   sizeof(hedge_server)) == -1) {
+          syslog(LOG_DAEMON | LOG_ERR,
+                 "Cannot send hedged query: sendto failure: %d (%s)", errno,
+                 strerror(errno));
+        }
+        continue;
+      }
+      std::chrono::nanoseconds left =
+          (hedge_pending ? hedge_at : deadline) - now;
+      struct timespec ts;
+      ts.tv_sec = left.count() / 1000000000;
+      ts.tv_nsec = left.count() % 1000000000;
+      if (ppoll(fds, nfds, &ts, nullptr) == -1 && errno != EINTR) {
+        throw DNSClientException("Cannot receive answer: poll failed");
+      }
+      for (nfds_t i = 0; i < nfds && recvlen == -1; i++) {
+        if (!(fds[i].revents & (POLLIN | POLLERR))) {
+          continue;
+        }
+        /* Skipping the late answers to earlier queries */
+        struct sockaddr_in from;
+        socklen_t from_len;
+        ssize_t len;
+        do {
+          from_len = sizeof(from);
+          len = recvfrom(fds[i].fd, answer, answer_len, MSG_DONTWAIT,
+                         (struct sockaddr *)&from, &from_len);
+        } while (len > 0 && !matches(query, query_len, answer, len));
+        if (len > 0) {
+          size_t answered = i;
+          if (pool_ == nullptr && hedge_sockfd != -1 &&
+              from.sin_addr.s_addr ==
+                  dns_server_.dns_servers_[servers[1]].s_addr) {
+            answered = 1;
+          }
+          stats.sample(servers[answered],
+                       std::chrono::steady_clock::now() - sent[answered]);
+          recvlen = len;
+        } else if (len == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+          /* The receive cleared the error (e.g. port unreachable) of the
+           * connected socket, which is not polled any more */
+          fds[i].fd = -1;
+        }
+      }
+      /* Without a hedge on the way the attempt has failed */
+      if (fds[0].fd == -1 && (nfds == 1 || fds[1].fd == -1)) {
+        break;
+      }
+    }
+  } catch (...) {
+    if (nfds == 2) {
+      pool_->release(servers[1], hedge_sockfd);
+    }
+    throw;
+  }
+  if (nfds == 2) {
+    pool_->release(servers[1], hedge_sockfd);
+  }
+  return recvlen;
 }
 
 ssize_t DNSClient::sendQuery(uint8_t *query, size_t query_len, uint8_t *answer,
                              size_t answer_len) {
   struct sockaddr_in server;
-  socklen_t resp_len;
   ssize_t recvlen;
   short int attempts = 0;
+  if (query_len < sizeof(DNSHeader)) {
+    throw DNSClientException("Cannot send query: too short");
+  }
+  /* Every attempt gets a random ID, as the pooled sockets keep their ports
+   * and the IDs of the clients may collide with a late answer */
+  DNSHeader *header = reinterpret_cast<DNSHeader *>(query);
+  uint16_t id = header->id();
+  IOUring *uring =
+      dns_server_.io_backend_ == Server::ioBackend::URING ? ring() : nullptr;
   /* Attempt to get an answer, at most resend_attempts times. */
   while (attempts <= dns_server_.resend_attempts_) {
+    /* Use the configured selection mode to select the nameserver */
+    size_t index = dns_server_.selectServer();
     memset(&server, 0x00, sizeof(server));
     server.sin_family = AF_INET;
     server.sin_port = htons(53);
-    /* Use the configured selection mode to select the nameserver */
-    if (dns_server_.sel_mode_ == Server::selectionMode::ROUND_ROBIN) {
-      server.sin_addr =
-          dns_server_.dns_servers_[(++dns_server_.rr_) %
-                                   dns_server_.dns_servers_.size()];
-    } else {
-      server.sin_addr =
-          dns_server_.dns_servers_[rand() % dns_server_.dns_servers_.size()];
-    }
-    /* Send DNS query */
-    if (sendto(sockfd_, query, query_len, 0, (struct sockaddr *)&server,
-               sizeof(server)) == -1) {
-      throw DNSClientException("Cannot send query");
+    server.sin_addr = dns_server_.dns_servers_[index];
+    int sockfd = sockfd_;
+    if (pool_ != nullptr && (sockfd = pool_->acquire(index)) == -1) {
+      throw DNSClientException("Cannot create socket");
+    }
+    dns_server_.stats_->sent();
+    header->id(randomId());
+    std::chrono::steady_clock::time_point sent =
+        std::chrono::steady_clock::now();
+    try {
+      if (dns_server_.hedging_) {
+        recvlen = hedgedTransfer(index, sockfd, server, query, query_len,
+                                 answer, answer_len);
+      } else if (uring != nullptr) {
+        recvlen = exchange(*uring, sockfd, server, query, query_len, answer,
+                           answer_len);
+      } else {
+        recvlen =
+            transfer(sockfd, server, query, query_len, answer, answer_len);
+      }
+    } catch (...) {
+      header->id(id);
+      if (pool_ != nullptr) {
+        pool_->release(index, sockfd);
+      }
+      throw;
+    }
+    header->id(id);
+    if (pool_ != nullptr) {
+      pool_->release(index, sockfd);
     }
-    /* Receive DNS answer */
-    if ((recvlen = recvfrom(sockfd_, answer, answer_len, 0,
-                            (struct sockaddr *)&server, &resp_len)) > 0) {
+    if (recvlen > 0) {
+      reinterpret_cast<DNSHeader *>(answer)->id(id);
+      if (!dns_server_.hedging_) {
+        dns_server_.stats_->sample(index,
+                                   std::chrono::steady_clock::now() - sent);
+      }
       return recvlen;
     }
+    dns_server_.stats_->timeout(index,
+                                std::chrono::steady_clock::now() - sent);
     attempts++;
   }
   return -1;
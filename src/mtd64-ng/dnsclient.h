@@ -34,6 +34,8 @@
 #include <sys/types.h>
 
 class Server;
+class IOUring;
+class SocketPool;
 
 /**
  * An std::exception class for the DNSClient.
@@ -57,18 +59,120 @@ public:
 
 /**
  * A DNSClient implementation using the configured recursors and no caching.
+ * It either owns a single socket and serves one query at a time, or borrows
+ * connected sockets from a SocketPool and can be shared by the workers.
  */
 class DNSClient : public DNSSource {
 private:
   Server
       &dns_server_; /**< The Server, used to access configuration settings. */
-  int sockfd_;      /**< Socket for sending the DNS query. */
+  int sockfd_;      /**< Own socket for sending the DNS query (-1 if the
+                       sockets are pooled). */
+  SocketPool *pool_; /**< The pool of connected sockets (nullptr if the
+                        client has its own socket). */
+
+  /**
+   * Checks whether an answer belongs to a query.
+   * A pooled socket can still hold the answer to an earlier, timed out query.
+   * @param query the query packet
+   * @param query_len length of the packet
+   * @param answer the answer packet
+   * @param len the length of the answer
+   * @return whether the IDs and the questions match
+   */
+  static bool matches(const uint8_t *query, size_t query_len,
+                      const uint8_t *answer, ssize_t len);
+
+  /**
+   * Returns the io_uring of the calling thread, creating it if needed.
+   * @return the io_uring, or nullptr if it is not supported
+   */
+  static IOUring *ring();
+
+  /**
+   * Sends the query and waits for the answer with one io_uring_enter call.
+   * The send, the receive and the timeout of the receive are linked.
+   * @param ring the io_uring to use
+   * @param sockfd the socket to use
+   * @param server the address of the nameserver
+   * @param query the query packet
+   * @param query_len length of the packet
+   * @param answer buffer for the answer
+   * @param answer_len length of the buffer
+   * @return the length of the answer (-1 on timeout or failure, with errno
+   * set)
+   */
+  ssize_t exchange(IOUring &ring, int sockfd, struct sockaddr_in &server,
+                   uint8_t *query, size_t query_len, uint8_t *answer,
+                   size_t answer_len);
+
+  /**
+   * Sends the query and waits for the answer with blocking system calls,
+   * until the configured timeout.
+   * @param sockfd the socket to use
+   * @param server the address of the nameserver
+   * @param query the query packet
+   * @param query_len length of the packet
+   * @param answer buffer for the answer
+   * @param answer_len length of the buffer
+   * @return the length of the answer (-1 on timeout or failure)
+   */
+  ssize_t transfer(int sockfd, struct sockaddr_in &server, uint8_t *query,
+                   size_t query_len, uint8_t *answer, size_t answer_len);
+
+  /**
+   * Sends the query and waits for the answer, hedging it if no answer
+   * arrives within the hedge delay of the recursor. The hedge goes to another
+   * recursor, and the first answer wins.
+   * @param index the index of the recursor
+   * @param sockfd the socket to use
+   * @param server the address of the nameserver
+   * @param query the query packet
+   * @param query_len length of the packet
+   * @param answer buffer for the answer
+   * @param answer_len length of the buffer
+   * @return the length of the answer (-1 on timeout or failure)
+   */
+  ssize_t hedgedTransfer(size_t index, int sockfd, struct sockaddr_in &server,
+                         uint8_t *query, size_t query_len, uint8_t *answer,
+                         size_t answer_len);
+
 public:
   /**
    * Constructor.
-   * @return the Server to use
+   * @param dns_server the Server to use
+   * @param pooled whether to use a SocketPool instead of an own socket
+   */
+  DNSClient(Server &dns_server, bool pooled = false);
+
+  /**
+   * Returns a random DNS ID for an upstream query, from a per-thread
+   * generator seeded on first use from the time and the thread.
+   * @return the ID
+   */
+  static uint16_t randomId();
+
+  /**
+   * Checks whether an answer repeats the question of a query. Names are
+   * compared case-insensitively.
+   * @param query the query packet
+   * @param query_len length of the query
+   * @param answer the answer packet
+   * @param answer_len length of the answer
+   * @return whether the questions match
+   */
+  static bool sameQuestion(const uint8_t *query, size_t query_len,
+                           const uint8_t *answer, size_t answer_len);
+
+  /**
+   * Copy constructor, explicitly deleted.
+   */
+  DNSClient(const DNSClient &) = delete;
+
+  /**
+   * Copy assignment operator, explicitly deleted.
    */
-  DNSClient(Server &dns_server);
+  DNSClient &operator=(const DNSClient &) = delete;
 
   /**
    * Destructor.
@@ -25,6 +25,7 @@
 #ifndef DNSSOURCE_H_INCLUDED
 #define DNSSOURCE_H_INCLUDED
 
+#include <functional>
 #include <stddef.h>
 #include <stdint.h>
 #include <sys/socket.h>
@@ -36,6 +37,12 @@
  */
 class DNSSource {
 public:
+  /**
+   * Type of the function called with the result of an asynchronous query.
+   * The parameter is the length of the answer (-1 on failure).
+   */
+  typedef std::function<void(ssize_t)> Callback;
+
   /**
    * Sends a DNS query, writes the response into the answer buffer and returns
    * with the answer length.
@@ -48,6 +55,25 @@ public:
   virtual ssize_t sendQuery(uint8_t *query, size_t query_len, uint8_t *answer,
                             size_t answer_len) = 0;
 
+  /**
+   * Sends a DNS query and calls the callback with the answer length when the
+   * response is written into the answer buffer.
+   * The query and answer buffers must stay valid until the callback is
+   * called. The default implementation calls sendQuery and the callback on
+   * the calling thread; event driven sources return right away and call the
+   * callback later, possibly on another thread.
+   * @param query the query packet
+   * @param query_len length of the packet
+   * @param answer buffer for the answer
+   * @param answer_len length of the buffer
+   * @param callback the function to call with the result
+   */
+  virtual void sendQueryAsync(uint8_t *query, size_t query_len,
+                              uint8_t *answer, size_t answer_len,
+                              Callback callback) {
+    callback(sendQuery(query, query_len, answer, answer_len));
+  }
+
   /**
    * Virtual desctrutor.
    * Empty. Allows the classes implementing the interace to have own
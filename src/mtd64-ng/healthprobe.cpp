@@ -0,0 +1,118 @@
+/* mtd64-ng - a lightweight multithreaded C++11 DNS64 server
+ * Based on MTD64 (https://github.com/Yoso89/MTD64)
+ * Copyright (C) 2015  Daniel Bakai <bakaid@kszk.bme.hu>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+#include "healthprobe.h"
+#include "upstreamstats.h"
+#include <arpa/inet.h>
+#include <cstdlib>
+#include <cstring>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <syslog.h>
+#include <unistd.h>
+
+HealthProbe::HealthProbe(const std::vector<struct in_addr> &servers,
+                         UpstreamStats &stats, std::chrono::seconds interval,
+                         struct timeval timeout)
+    : servers_(servers), stats_(stats), interval_{interval},
+      timeout_(timeout), reported_(servers.size(), false), stop_{false} {
+  thread_ = std::thread{&HealthProbe::run, this};
+}
+
+HealthProbe::~HealthProbe() {
+  {
+    std::unique_lock<std::mutex> lock{m_};
+    stop_ = true;
+  }
+  cv_.notify_all();
+  if (thread_.joinable()) {
+    thread_.join();
+  }
+}
+
+void HealthProbe::run() {
+  std::unique_lock<std::mutex> lock{m_};
+  while (!cv_.wait_for(lock, interval_, [this] { return stop_; })) {
+    lock.unlock();
+    for (size_t i = 0; i < servers_.size(); i++) {
+      if (stats_.up(i)) {
+        if (reported_[i]) {
+          syslog(LOG_DAEMON | LOG_WARNING, "Nameserver %s is up again",
+                 inet_ntoa(servers_[i]));
+          reported_[i] = false;
+        }
+        continue;
+      }
+      if (!reported_[i]) {
+        syslog(LOG_DAEMON | LOG_WARNING,
+               "Nameserver %s is down, probing it every %ld seconds",
+               inet_ntoa(servers_[i]),
+               static_cast<long>(interval_.count()));
+        reported_[i] = true;
+      }
+      if (probe(i)) {
+        syslog(LOG_DAEMON | LOG_WARNING, "Nameserver %s is up again",
+               inet_ntoa(servers_[i]));
+        reported_[i] = false;
+      }
+    }
+    lock.lock();
+  }
+}
+
+bool HealthProbe::probe(size_t server) {
+  /* Query for the NS records of the root */
+  uint8_t query[17] = {0, 0, 0x01, 0x00, 0, 1, 0, 0, 0,
+                       0, 0, 0,    0,    0, 2, 0, 1};
+  uint16_t id = rand() & 0xffff;
+  query[0] = id >> 8;
+  query[1] = id & 0xff;
+
+  int sockfd;
+  if ((sockfd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1) {
+    return false;
+  }
+  struct sockaddr_in addr;
+  memset(&addr, 0x00, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(53);
+  addr.sin_addr = servers_[server];
+  std::chrono::steady_clock::time_point sent =
+      std::chrono::steady_clock::now();
+  uint8_t answer[512];
+  ssize_t len = -1;
+  if (setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout_,
+                 sizeof(timeout_)) == 0 &&
+      connect(sockfd, reinterpret_cast<struct sockaddr *>(&addr),
+              sizeof(addr)) == 0 &&
+      send(sockfd, query, sizeof(query), 0) == sizeof(query)) {
+    do {
+      len = recv(sockfd, answer, sizeof(answer), 0);
+    } while (len > 0 && (len < 2 || answer[0] != query[0] ||
+                         answer[1] != query[1]));
+  }
+  close(sockfd);
+  if (len <= 0) {
+    return false;
+  }
+  stats_.sample(server, std::chrono::steady_clock::now() - sent);
+  return true;
+}
@@ -0,0 +1,99 @@
+/* mtd64-ng - a lightweight multithreaded C++11 DNS64 server
+ * Based on MTD64 (https://github.com/Yoso89/MTD64)
+ * Copyright (C) 2015  Daniel Bakai <bakaid@kszk.bme.hu>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+/** @file
+ *  @brief Header for the HealthProbe and related classes.
+ */
+
+#ifndef HEALTHPROBE_H_INCLUDED
+#define HEALTHPROBE_H_INCLUDED
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <netinet/in.h>
+#include <sys/time.h>
+#include <thread>
+#include <vector>
+
+class UpstreamStats;
+
+/**
+ * Background prober of the recursors taken down by the circuit breaker.
+ * Periodically sends a query for the NS records of the root to every recursor
+ * which is down. An answer brings the recursor back into the selection.
+ */
+class HealthProbe {
+private:
+  std::vector<struct in_addr> servers_; /**< The recursors. */
+  UpstreamStats &stats_;                /**< The state of the recursors. */
+  std::chrono::seconds interval_;       /**< Time between two probes. */
+  struct timeval timeout_;              /**< Timeout of a probe. */
+  std::vector<bool> reported_; /**< Whether the outage of a recursor was
+                                  already logged. */
+  std::mutex m_;               /**< Mutex for the stop_ condition. */
+  std::condition_variable cv_; /**< Used to wake up the probe thread. */
+  bool stop_;                  /**< Used to stop the probe thread. */
+  std::thread thread_;         /**< The probe thread. */
+
+  /**
+   * Main loop of the probe thread.
+   */
+  void run();
+
+  /**
+   * Sends a probe to a recursor and waits for its answer.
+   * @param server the index of the recursor
+   * @return whether the recursor answered
+   */
+  bool probe(size_t server);
+
+public:
+  /**
+   * Constructor.
+   * Starts the probe thread.
+   * @param servers the recursors
+   * @param stats the state of the recursors
+   * @param interval the time between two probes
+   * @param timeout the timeout of a probe
+   */
+  HealthProbe(const std::vector<struct in_addr> &servers,
+              UpstreamStats &stats, std::chrono::seconds interval,
+              struct timeval timeout);
+
+  /**
+   * Destructor.
+   * Stops the probe thread.
+   */
+  ~HealthProbe();
+
+  /**
+   * Copy constructor, explicitly deleted.
+   */
+  HealthProbe(const HealthProbe &) = delete;
+
+  /**
+   * Copy assignment operator, explicitly deleted.
+   */
+  HealthProbe &operator=(const HealthProbe &) = delete;
+};
+
+#endif
@@ -0,0 +1,77 @@
+/* mtd64-ng - a lightweight multithreaded C++11 DNS64 server
+ * Based on MTD64 (https://github.com/Yoso89/MTD64)
+ * Copyright (C) 2015  Daniel Bakai <bakaid@kszk.bme.hu>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+#include "metrics.h"
+#include <cstdio>
+#include <fstream>
+#include <syslog.h>
+
+Metrics::Metrics(const std::string &path, std::chrono::seconds interval)
+    : path_(path), interval_{interval}, stop_{false} {}
+
+Metrics::~Metrics() {
+  {
+    std::unique_lock<std::mutex> lock{m_};
+    stop_ = true;
+  }
+  cv_.notify_all();
+  if (thread_.joinable()) {
+    thread_.join();
+    write();
+  }
+}
+
+void Metrics::add(Source source) { sources_.push_back(source); }
+
+void Metrics::start() { thread_ = std::thread{&Metrics::run, this}; }
+
+void Metrics::run() {
+  std::unique_lock<std::mutex> lock{m_};
+  do {
+    lock.unlock();
+    write();
+    lock.lock();
+  } while (!cv_.wait_for(lock, interval_, [this] { return stop_; }));
+}
+
+bool Metrics::write() {
+  /* Written to a temporary file first, so readers never see a partial file */
+  std::string tmp = path_ + ".tmp";
+  {
+    std::ofstream file{tmp, std::ios::trunc};
+    if (!file) {
+      syslog(LOG_DAEMON | LOG_ERR, "Can't write the stats file: %s",
+             tmp.c_str());
+      return false;
+    }
+    for (const Source &source : sources_) {
+      source(file);
+    }
+    if (!file) {
+      return false;
+    }
+  }
+  if (rename(tmp.c_str(), path_.c_str()) == -1) {
+    syslog(LOG_DAEMON | LOG_ERR, "Can't write the stats file: %s",
+           path_.c_str());
+    return false;
+  }
+  return true;
+}
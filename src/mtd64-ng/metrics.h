@@ -0,0 +1,106 @@
+/* mtd64-ng - a lightweight multithreaded C++11 DNS64 server
+ * Based on MTD64 (https://github.com/Yoso89/MTD64)
+ * Copyright (C) 2015  Daniel Bakai <bakaid@kszk.bme.hu>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+/** @file
+ *  @brief Header for the Metrics and related classes.
+ */
+
+#ifndef METRICS_H_INCLUDED
+#define METRICS_H_INCLUDED
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * Periodic writer of the runtime metrics.
+ * The metrics are written in the Prometheus text exposition format to a file,
+ * which is replaced atomically, so it can be read at any time (e.g. by the
+ * textfile collector of the node exporter).
+ */
+class Metrics {
+public:
+  /**
+   * Writes a group of metrics to a stream.
+   */
+  typedef std::function<void(std::ostream &)> Source;
+
+private:
+  std::string path_;              /**< The metrics file. */
+  std::chrono::seconds interval_; /**< Time between two writes. */
+  std::vector<Source> sources_;   /**< The metrics to write. */
+  std::mutex m_;                  /**< Mutex for the stop_ condition. */
+  std::condition_variable cv_;    /**< Used to wake up the writer thread. */
+  bool stop_;                     /**< Used to stop the writer thread. */
+  std::thread thread_;            /**< The writer thread. */
+
+  /**
+   * Main loop of the writer thread.
+   */
+  void run();
+
+public:
+  /**
+   * Constructor.
+   * @param path the metrics file
+   * @param interval the time between two writes
+   */
+  Metrics(const std::string &path, std::chrono::seconds interval);
+
+  /**
+   * Destructor.
+   * Stops the writer thread and writes the metrics a last time.
+   */
+  ~Metrics();
+
+  /**
+   * Copy constructor, explicitly deleted.
+   */
+  Metrics(const Metrics &) = delete;
+
+  /**
+   * Copy assignment operator, explicitly deleted.
+   */
+  Metrics &operator=(const Metrics &) = delete;
+
+  /**
+   * Adds a group of metrics. Must be called before start().
+   * @param source the function writing the metrics
+   */
+  void add(Source source);
+
+  /**
+   * Starts the writer thread.
+   */
+  void start();
+
+  /**
+   * Writes the metrics to the file.
+   * @return whether the file was written
+   */
+  bool write();
+};
+
+#endif
@@ -19,96 +19,213 @@
  */
 
 #include "query.h"
+#include "../batchio.h"
 #include "dnsclient.h"
 #include "server.h"
 #include <algorithm>
 #include <arpa/inet.h>
 #include <net/if.h>
+#include <new>
 #include <stdint.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <unistd.h>
 
 Query::Query(uint8_t *data, size_t len, struct sockaddr_in6 sender,
-             socklen_t sender_slen, Server &server)
-    : data_{data}, len_{len}, sender_slen_{sender_slen}, server_{server} {
+             socklen_t sender_slen, Server &server, Receiver &receiver,
+             BatchIO &io)
+    : data_{data}, len_{len}, sender_slen_{sender_slen}, server_{server},
+      receiver_{receiver}, io_{io}, answer_{nullptr}, source_{nullptr},
+      a_query_{nullptr}, a_answer_{nullptr}, a_done_{false}, a_res_{-1},
+      synth_needed_{false}, refs_{1} {
   sender_ = sender;
 }
 
-Query::Query(const Query &rhs)
-    : data_{rhs.data_}, len_{rhs.len_},
-      sender_slen_{rhs.sender_slen_}, server_{rhs.server_} {
-  sender_ = rhs.sender_;
-}
-
-Query::Query(Query &&rhs)
-    : data_{rhs.data_}, len_{rhs.len_},
-      sender_slen_{rhs.sender_slen_}, server_{rhs.server_} {
+Query::Query(Query &&rhs) noexcept
+    : data_{rhs.data_}, len_{rhs.len_}, sender_slen_{rhs.sender_slen_},
+      server_{rhs.server_}, receiver_{rhs.receiver_}, io_{rhs.io_},
+      answer_{rhs.answer_}, client_{std::move(rhs.client_)},
+      source_{rhs.source_}, a_query_{rhs.a_query_}, a_answer_{rhs.a_answer_},
+      a_done_{rhs.a_done_}, a_res_{rhs.a_res_},
+      synth_needed_{rhs.synth_needed_}, refs_{1} {
   sender_ = rhs.sender_;
   rhs.data_ = nullptr;
+  rhs.answer_ = nullptr;
+  rhs.a_query_ = nullptr;
+  rhs.a_answer_ = nullptr;
 }
 
-Query::~Query() { delete[] data_; }
+Query::~Query() {
+  receiver_.release(data_);
+  server_.buffers_->release(answer_);
+  server_.buffers_->release(a_query_);
+  server_.buffers_->release(a_answer_);
+}
 
 void Query::operator()() {
-  ssize_t res;
   DNSHeader *header = (DNSHeader *)data_;
   if (header->qr() == 0 && header->opcode() == DNSHeader::OpCode::Query) {
-    try {
-      std::unique_ptr<uint8_t> answer{new uint8_t[server_.response_maxlength_]};
-      std::unique_ptr<DNSSource> s{new DNSClient{server_}};
-      if ((res = s->sendQuery(data_, len_, answer.get(),
-                              server_.response_maxlength_)) <= 0) {
-        syslog(LOG_DAEMON | LOG_INFO,
-               "Didn't receive answer from the nameservers");
-        return;
-      }
-      DNSPacket packet{answer.get(), (size_t)res,
-                       (size_t)server_.response_maxlength_};
-      if (packet.question_[0].qtype() == QType::AAAA &&
-          (packet.header_->rcode() != DNSHeader::RCODE::NXDomain &&
-           !(packet.header_->rcode() != DNSHeader::RCODE::NXDomain &&
-             packet.header_->ancount() >= 1 &&
-             std::find_if(packet.answer_.begin(), packet.answer_.end(),
-                          [](const DNSResource &r) {
-                            return r.qtype() == QType::AAAA;
-                          }) != packet.answer_.end()))) {
-        // Synthesizing
-        DNSPacket qpacket{data_, len_, len_};
-        qpacket.question_[0].qtype(QType::A);
-        if ((res = s->sendQuery(data_, len_, answer.get(),
-                                server_.response_maxlength_)) <= 0) {
-          syslog(LOG_DAEMON | LOG_INFO,
-                 "Didn't receive answer from the nameservers");
-          return;
-        }
-        DNSPacket apacket{answer.get(), (size_t)res,
-                          (size_t)server_.response_maxlength_};
-        apacket.question_[0].qtype(QType::AAAA);
-        for (auto &answer : apacket.answer_) {
-          if (answer.qtype() == QType::A) {
-            uint8_t ipv6[16];
-            answer.qtype(QType::AAAA);
-            server_.synth(answer.rdata(), ipv6);
-            answer.rdata(ipv6, 16);
+    Query *query =
+        new (server_.queries_->acquire()) Query{std::move(*this)};
+    query->resolve();
+    query->release();
+  }
+}
+
+void Query::retain() { refs_.fetch_add(1, std::memory_order_relaxed); }
+
+void Query::release() {
+  if (refs_.fetch_sub(1, std::memory_order_acq_rel) != 1) {
+    return;
+  }
+  BufferPool &queries = *server_.queries_;
+  this->~Query();
+  queries.release(reinterpret_cast<uint8_t *>(this));
+}
+
+template <void (Query::*Next)(ssize_t)>
+void Query::send(uint8_t *query, uint8_t *answer) {
+  retain();
+  try {
+    source_->sendQueryAsync(query, len_, answer, server_.response_maxlength_,
+                            [this](ssize_t res) {
+                              (this->*Next)(res);
+                              release();
+                            });
+  } catch (...) {
+    /* The callback is not called if the query can not be sent */
+    release();
+    throw;
+  }
+}
+
+void Query::resolve() {
+  try {
+    answer_ = server_.buffers_->acquire();
+    if (server_.cache_ != nullptr) {
+      source_ = server_.cache_;
+    } else if (server_.coalescer_ != nullptr) {
+      source_ = server_.coalescer_;
+    } else if (server_.upstream_ != nullptr) {
+      source_ = server_.upstream_;
+    } else {
+      client_.reset(new DNSClient{server_});
+      source_ = client_.get();
+    }
+    if (server_.parallel_a_) {
+      resolveA();
+    }
+    send<&Query::answer>(data_, answer_);
+  } catch (std::exception &e) {
+    syslog(LOG_DAEMON | LOG_ERR, "%s", e.what());
+  }
+}
+
+void Query::resolveA() {
+  uint8_t *a_query = server_.buffers_->acquire();
+  memcpy(a_query, data_, len_);
+  try {
+    DNSPacket qpacket{a_query, len_, len_, true};
+    if (qpacket.question().size() != 1 ||
+        qpacket.question_[0].qtype() != QType::AAAA) {
+      server_.buffers_->release(a_query);
+      return;
+    }
+    qpacket.question_[0].qtype(QType::A);
+  } catch (std::exception &e) {
+    // The AAAA query is still sent, its answer is forwarded as it is
+    server_.buffers_->release(a_query);
+    return;
+  }
+  a_query_ = a_query;
+  a_answer_ = server_.buffers_->acquire();
+  send<&Query::answerA>(a_query_, a_answer_);
+}
+
+void Query::answer(ssize_t res) {
+  try {
+    if (res <= 0) {
+      syslog(LOG_DAEMON | LOG_INFO,
+             "Didn't receive answer from the nameservers");
+      return;
+    }
+    /* Forwarded answers are only parsed up to the question */
+    DNSPacket packet{answer_, (size_t)res, (size_t)server_.response_maxlength_,
+                     true};
+    bool synth_needed = !packet.question().empty() &&
+                        packet.question_[0].qtype() == QType::AAAA &&
+                        packet.header_->rcode() != DNSHeader::RCODE::NXDomain;
+    /* The answer section is only parsed if it may hold AAAA records */
+    if (synth_needed && packet.header_->ancount() >= 1) {
+      DNSResourceList &answers = packet.answer();
+      synth_needed = std::find_if(answers.begin(), answers.end(),
+                                  [](const DNSResource &r) {
+                                    return r.qtype() == QType::AAAA;
+                                  }) == answers.end();
+    }
+    if (synth_needed) {
+      // Synthesizing
+      if (a_query_) {
+        ssize_t a_res;
+        {
+          std::unique_lock<std::mutex> lock{a_m_};
+          synth_needed_ = true;
+          if (!a_done_) {
+            return;
           }
+          a_res = a_res_;
         }
-        if (sendto(server_.sock6fd_, answer.get(), apacket.len_, 0,
-                   (struct sockaddr *)&sender_, sizeof(sender_)) == -1) {
-          syslog(LOG_DAEMON | LOG_ERR,
-                 "Can't send response: sendto failure: %d (%s)", errno,
-                 strerror(errno));
-        }
-      } else {
-        if (sendto(server_.sock6fd_, answer.get(), res, 0,
-                   (struct sockaddr *)&sender_, sizeof(sender_)) == -1) {
-          syslog(LOG_DAEMON | LOG_ERR,
-                 "Can't send response: sendto failure: %d (%s)", errno,
-                 strerror(errno));
-        }
+        synthesize(a_res);
+        return;
       }
-    } catch (std::exception &e) {
-      syslog(LOG_DAEMON | LOG_ERR, "%s", e.what());
+      DNSPacket qpacket{data_, len_, len_, true};
+      qpacket.question()[0].qtype(QType::A);
+      a_answer_ = server_.buffers_->acquire();
+      send<&Query::synthesize>(data_, a_answer_);
+    } else {
+      respond(answer_, res);
     }
+  } catch (std::exception &e) {
+    syslog(LOG_DAEMON | LOG_ERR, "%s", e.what());
+  }
+}
+
+void Query::answerA(ssize_t res) {
+  {
+    std::unique_lock<std::mutex> lock{a_m_};
+    a_done_ = true;
+    a_res_ = res;
+    if (!synth_needed_) {
+      return;
+    }
+  }
+  synthesize(res);
+}
+
+void Query::synthesize(ssize_t res) {
+  try {
+    if (res <= 0) {
+      syslog(LOG_DAEMON | LOG_INFO,
+             "Didn't receive answer from the nameservers");
+      return;
+    }
+    /* The answer to the original query is not needed any more */
+    size_t len = server_.synthesize(a_answer_, (size_t)res, answer_,
+                                    (size_t)server_.response_maxlength_);
+    respond(answer_, len);
+    if (server_.cache_ != nullptr) {
+      /* The query itself may have been turned into the A query */
+      DNSPacket qpacket{data_, len_, len_, true};
+      qpacket.question()[0].qtype(QType::AAAA);
+      server_.cache_->store(data_, len_, answer_, len, true);
+    }
+  } catch (std::exception &e) {
+    syslog(LOG_DAEMON | LOG_ERR, "%s", e.what());
+  }
+}
+
+void Query::respond(const uint8_t *response, size_t len) {
+  if (!io_.send(response, len, sender_)) {
+    syslog(LOG_DAEMON | LOG_ERR, "Can't send response: response too long");
   }
 }
@@ -26,16 +26,28 @@
 #define QUERY_H_INCLUDED
 
 #include "../dns.h"
+#include <atomic>
 #include <cstring>
+#include <memory>
+#include <mutex>
 #include <netinet/in.h>
 #include <sys/socket.h>
 #include <syslog.h>
 #include <thread>
 
 class Server;
+class BatchIO;
+class Receiver;
+class DNSSource;
 
 /**
  * Class to execute a DNS query.
+ * The query is processed in steps: each upstream answer resumes the Query in
+ * the callback of the DNSSource, which may happen on another thread. To
+ * survive until then, the Query is moved into a buffer of the query pool of
+ * the Server when it starts processing, and counts the references held by
+ * its pending callbacks. The callbacks only capture the Query pointer, so
+ * they are stored inline in the std::function, without any allocation.
  */
 class Query {
 private:
@@ -44,6 +56,82 @@ private:
   struct sockaddr_in6 sender_; /**< The address of the sender of the packet. */
   socklen_t sender_slen_;      /**< The length of sender address. */
   Server &server_;             /**< The parent Server */
+  Receiver &receiver_;         /**< The owner of the packet buffer */
+  BatchIO &io_;                /**< The I/O engine to send the response on */
+  uint8_t *answer_;            /**< Buffer for the upstream answer. */
+  std::unique_ptr<DNSSource>
+      client_;        /**< Own DNSSource if the Server has no shared one. */
+  DNSSource *source_; /**< The DNSSource used to resolve the query. */
+
+  uint8_t *a_query_;  /**< The A query sent in parallel with the AAAA query. */
+  uint8_t *a_answer_; /**< Buffer for the A answer. */
+  std::mutex a_m_;    /**< Mutex for the parallel A query state. */
+  bool a_done_;       /**< Whether the A answer has arrived. */
+  ssize_t a_res_;     /**< The length of the A answer (-1 on failure). */
+  bool synth_needed_; /**< Whether the AAAA answer needs synthesis. */
+  std::atomic<unsigned> refs_; /**< Number of references to the pooled
+                                  Query. */
+
+  /**
+   * Takes a reference to the pooled Query.
+   */
+  void retain();
+
+  /**
+   * Drops a reference to the pooled Query, destroying it and giving its
+   * buffer back to the query pool with the last one.
+   */
+  void release();
+
+  /**
+   * Sends a query to the DNSSource, holding a reference until the callback.
+   * @tparam Next the step processing the answer
+   * @param query the query packet (of len_ bytes)
+   * @param answer buffer for the answer
+   */
+  template <void (Query::*Next)(ssize_t)>
+  void send(uint8_t *query, uint8_t *answer);
+
+  /**
+   * Sends the query to the upstream.
+   */
+  void resolve();
+
+  /**
+   * Sends the A query in parallel with an AAAA query, if it is enabled.
+   */
+  void resolveA();
+
+  /**
+   * Processes the upstream answer to the original query.
+   * Forwards it to the client, or asks for the A records if the AAAA records
+   * have to be synthesized.
+   * @param res the length of the answer (-1 on failure)
+   */
+  void answer(ssize_t res);
+
+  /**
+   * Processes the upstream answer to the parallel A query.
+   * Synthesizes the AAAA records if the AAAA answer has already arrived and
+   * needs synthesis, otherwise keeps the answer for answer().
+   * @param res the length of the answer (-1 on failure)
+   */
+  void answerA(ssize_t res);
+
+  /**
+   * Synthesizes the AAAA records from the upstream answer to the A query in
+   * a_answer_ into answer_, and sends the result to the client.
+   * @param res the length of the A answer (-1 on failure)
+   */
+  void synthesize(ssize_t res);
+
+  /**
+   * Sends a response to the client.
+   * @param response the response
+   * @param len the length of the response
+   */
+  void respond(const uint8_t *response, size_t len);
+
 public:
   /**
    * Constructor.
@@ -52,21 +140,23 @@ public:
    * @param sender the address of the sender of the packet
    * @param sender_slen the length of sender address
    * @param server the parent Server
+   * @param receiver the receiving engine the packet was taken from
+   * @param io the I/O engine of the socket the packet was received on
    */
   Query(uint8_t *data, size_t len, struct sockaddr_in6 sender,
-        socklen_t sender_slen, Server &server);
+        socklen_t sender_slen, Server &server, Receiver &receiver,
+        BatchIO &io);
 
   /**
-   * Copy constructor.
-   * Needed because std::function, but preferably (and usually) optimized out by
-   * the compiler.
+   * Copy constructor, explicitly deleted.
    */
-  Query(const Query &rhs);
+  Query(const Query &) = delete;
 
   /**
    * Move constructor.
+   * Does not throw, so the Query is stored inline in a Task.
    */
-  Query(Query &&rhs);
+  Query(Query &&rhs) noexcept;
 
   /**
    * Copy assignment operator, explicitly deleted.
@@ -80,6 +170,8 @@ public:
 
   /**
    * Desctuctor.
+   * Gives the packet buffer back to its Receiver, and the answer buffers to
+   * the BufferPool of the Server.
    */
   ~Query();
 
@@ -19,11 +19,16 @@
  */
 
 #include "server.h"
+#include <algorithm>
 #include <arpa/inet.h>
+#include <chrono>
 #include <cstdio>
 #include <cstring>
+#include <functional>
 #include <net/if.h>
 #include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
 #include <sstream>
 #include <stdint.h>
 #include <sys/socket.h>
@@ -31,21 +36,99 @@
 #include <syslog.h>
 #include <unistd.h>
 
+#include "../dns.h"
+#include "asyncdnsclient.h"
+#include "dnsclient.h"
 #include "query.h"
+#include "../uring.h"
+
+/* Queueing a Query must not allocate */
+static_assert(Task::fits<Query>::value,
+              "Query does not fit in the inline storage of Task");
+
+namespace {
+/*
+ * State of the per-thread xorshift generator of the latency selection mode.
+ */
+thread_local uint32_t random_state = 0;
+
+/*
+ * Returns a random number. Seeded on first use from the time and the thread.
+ */
+uint32_t nextRandom() {
+  if (random_state == 0) {
+    random_state = static_cast<uint32_t>(
+        std::chrono::steady_clock::now().time_since_epoch().count() ^
+        std::hash<std::thread::id>()(std::this_thread::get_id()));
+    if (random_state == 0) {
+      random_state = 1;
+    }
+  }
+  random_state ^= random_state << 13;
+  random_state ^= random_state >> 17;
+  random_state ^= random_state << 5;
+  return random_state;
+}
+} // namespace
 
 ServerException::ServerException(std::string what) : what_{what} {}
 
 const char *ServerException::what() const noexcept { return what_.c_str(); }
 
+Listener::Listener()
+    : sockfd_{-1}, pool_{nullptr}, io_{nullptr}, receiver_{nullptr} {}
+
+Listener::~Listener() {
+  delete pool_;
+  if (receiver_ != io_) {
+    delete receiver_;
+  }
+  delete io_;
+  if (sockfd_ != -1) {
+    close(sockfd_);
+  }
+}
+
 Server::Server()
-    : pool_{nullptr}, port_{53}, sel_mode_{selectionMode::RANDOM}, rr_{0},
+    : stop_{false}, upstream_mode_{upstreamMode::BLOCKING},
+      upstream_threads_{1}, upstream_sockets_{4}, socket_pool_{true},
+      parallel_a_{false}, hedging_{false}, hedge_percentile_{95},
+      hedge_budget_{5}, stats_{nullptr}, health_failures_{3},
+      health_probe_interval_{5}, probe_{nullptr}, stats_interval_{10},
+      metrics_{nullptr}, upstream_{nullptr}, cache_size_{0},
+      cache_negative_ttl_{3600}, prefetch_threshold_{10},
+      prefetch_min_hits_{3}, prefetch_rate_{100}, serve_stale_{0},
+      stale_answer_timeout_{1800}, coalesce_{true}, coalescer_{nullptr},
+      cache_{nullptr}, port_{53},
+      sel_mode_{selectionMode::RANDOM}, rr_{0}, latency_exploration_{5},
       resend_attempts_{2}, num_threads_{10},
-      response_maxlength_{512}, debug_{false} {
+      task_queue_{ThreadPool::queueKind::MUTEX}, task_queue_size_{16384},
+      num_listeners_{1},
+      batch_size_{1}, batch_flush_time_{100},
+      io_backend_{ioBackend::SOCKET}, uring_buffers_{4096},
+      response_maxlength_{512}, packet_buffers_{8192},
+      packet_buffer_hugepages_{false}, buffers_{nullptr}, queries_{nullptr},
+      debug_{false} {
   timeout_.tv_sec = 1;
   timeout_.tv_usec = 0;
 }
 
-Server::~Server() { delete pool_; }
+Server::~Server() {
+  delete metrics_;
+  delete probe_;
+  if (cache_ != nullptr) {
+    cache_->stop();
+  }
+  delete upstream_;
+  delete coalescer_;
+  delete cache_;
+  delete stats_;
+  for (auto listener : listeners_) {
+    delete listener;
+  }
+  delete queries_;
+  delete buffers_;
+}
 
 bool Server::loadConfig(const char *filename) {
   FILE *fp;
@@ -108,12 +191,107 @@ bool Server::loadConfig(const char *filename) {
         sel_mode_ = selectionMode::RANDOM;
       } else if (!strncmp(begin, "round-robin", strlen("round-robin"))) {
         sel_mode_ = selectionMode::ROUND_ROBIN;
+      } else if (!strncmp(begin, "latency", strlen("latency"))) {
+        sel_mode_ = selectionMode::LATENCY;
       } else {
         syslog(LOG_WARNING,
                "Invalid selection-mode at line %d, defaulting to \"random\"\n",
                linecount);
         sel_mode_ = selectionMode::RANDOM;
       }
+    } else if (strlen(begin) >= strlen("latency-exploration") &&
+               !strncmp(begin, "latency-exploration",
+                        strlen("latency-exploration"))) {
+      begin += strlen("latency-exploration");
+      while (*begin != '\0' && isspace(*begin))
+        begin++;
+
+      if (sscanf(begin, "%hd", &latency_exploration_) != 1 ||
+          latency_exploration_ < 0 || latency_exploration_ > 100) {
+        latency_exploration_ = 5;
+        syslog(LOG_WARNING,
+               "Invalid latency-exploration at line %d. Defaulting to 5\n",
+               linecount);
+        continue;
+      }
+    } else if (strlen(begin) >= strlen("upstream-mode") &&
+               !strncmp(begin, "upstream-mode", strlen("upstream-mode"))) {
+      begin += strlen("upstream-mode");
+      while (*begin != '\0' && isspace(*begin))
+        begin++;
+      if (!strncmp(begin, "blocking", strlen("blocking"))) {
+        upstream_mode_ = upstreamMode::BLOCKING;
+      } else if (!strncmp(begin, "async", strlen("async"))) {
+        upstream_mode_ = upstreamMode::ASYNC;
+      } else {
+        syslog(LOG_WARNING,
+               "Invalid upstream-mode at line %d, defaulting to \"blocking\"\n",
+               linecount);
+        upstream_mode_ = upstreamMode::BLOCKING;
+      }
+    } else if (strlen(begin) >= strlen("upstream-threads") &&
+               !strncmp(begin, "upstream-threads", strlen("upstream-threads"))) {
+      begin += strlen("upstream-threads");
+      while (*begin != '\0' && isspace(*begin))
+        begin++;
+
+      if (sscanf(begin, "%hd", &upstream_threads_) != 1 ||
+          upstream_threads_ < 1) {
+        upstream_threads_ = 1;
+        syslog(LOG_WARNING,
+               "Invalid upstream-threads at line %d. Defaulting to 1\n",
+               linecount);
+        continue;
+      }
+    } else if (strlen(begin) >= strlen("upstream-sockets") &&
+               !strncmp(begin, "upstream-sockets", strlen("upstream-sockets"))) {
+      begin += strlen("upstream-sockets");
+      while (*begin != '\0' && isspace(*begin))
+        begin++;
+
+      if (sscanf(begin, "%hd", &upstream_sockets_) != 1 ||
+          upstream_sockets_ < 0 || upstream_sockets_ > 1024) {
+        upstream_sockets_ = 4;
+        syslog(LOG_WARNING,
+               "Invalid upstream-sockets at line %d. Defaulting to 4\n",
+               linecount);
+        continue;
+      }
+    } else if (strlen(begin) >= strlen("socket-pool") &&
+               !strncmp(begin, "socket-pool", strlen("socket-pool"))) {
+      begin += strlen("socket-pool");
+      while (*begin != '\0' && isspace(*begin))
+        begin++;
+
+      if (!strncmp(begin, "no", strlen("no"))) {
+        socket_pool_ = false;
+      } else {
+        socket_pool_ = true;
+      }
+    } else if (strlen(begin) >= strlen("parallel-a-query") &&
+               !strncmp(begin, "parallel-a-query",
+                        strlen("parallel-a-query"))) {
+      begin += strlen("parallel-a-query");
+      while (*begin != '\0' && isspace(*begin))
+        begin++;
+
+      if (!strncmp(begin, "yes", strlen("yes"))) {
+        parallel_a_ = true;
+      } else {
+        parallel_a_ = false;
+      }
+    } else if (strlen(begin) >= strlen("coalesce-queries") &&
+               !strncmp(begin, "coalesce-queries",
+                        strlen("coalesce-queries"))) {
+      begin += strlen("coalesce-queries");
+      while (*begin != '\0' && isspace(*begin))
+        begin++;
+
+      if (!strncmp(begin, "no", strlen("no"))) {
+        coalesce_ = false;
+      } else {
+        coalesce_ = true;
+      }
     } else if (strlen(begin) >= strlen("dns64-prefix") &&
                !strncmp(begin, "dns64-prefix", strlen("dns64-prefix"))) {
       begin += strlen("dns64-prefix");
@@ -147,6 +325,7 @@ bool Server::loadConfig(const char *filename) {
         success = false;
         break;
       }
+      synthesizer_.prefix(ipv6_, ipv6_prefix_);
     } else if (strlen(begin) >= strlen("debugging") &&
                !strncmp(begin, "debugging", strlen("debugging"))) {
       begin += strlen("debugging");
@@ -191,6 +370,202 @@ bool Server::loadConfig(const char *filename) {
                linecount);
         continue;
       }
+    } else if (strlen(begin) >= strlen("hedge-percentile") &&
+               !strncmp(begin, "hedge-percentile",
+                        strlen("hedge-percentile"))) {
+      begin += strlen("hedge-percentile");
+      while (*begin != '\0' && isspace(*begin))
+        begin++;
+
+      if (sscanf(begin, "%hd", &hedge_percentile_) != 1 ||
+          hedge_percentile_ < 1 || hedge_percentile_ > 99) {
+        hedge_percentile_ = 95;
+        syslog(LOG_WARNING,
+               "Invalid hedge-percentile at line %d. Defaulting to 95\n",
+               linecount);
+        continue;
+      }
+    } else if (strlen(begin) >= strlen("hedge-budget") &&
+               !strncmp(begin, "hedge-budget", strlen("hedge-budget"))) {
+      begin += strlen("hedge-budget");
+      while (*begin != '\0' && isspace(*begin))
+        begin++;
+
+      if (sscanf(begin, "%hd", &hedge_budget_) != 1 || hedge_budget_ < 0 ||
+          hedge_budget_ > 100) {
+        hedge_budget_ = 5;
+        syslog(LOG_WARNING,
+               "Invalid hedge-budget at line %d. Defaulting to 5\n",
+               linecount);
+        continue;
+      }
+    } else if (strlen(begin) >= strlen("hedging") &&
+               !strncmp(begin, "hedging", strlen("hedging"))) {
+      begin += strlen("hedging");
+      while (*begin != '\0' && isspace(*begin))
+        begin++;
+
+      if (!strncmp(begin, "yes", strlen("yes"))) {
+        hedging_ = true;
+      } else {
+        hedging_ = false;
+      }
+    } else if (strlen(begin) >= strlen("health-failures") &&
+               !strncmp(begin, "health-failures", strlen("health-failures"))) {
+      begin += strlen("health-failures");
+      while (*begin != '\0' && isspace(*begin))
+        begin++;
+
+      if (sscanf(begin, "%hd", &health_failures_) != 1 ||
+          health_failures_ < 0 || health_failures_ > 1000) {
+        health_failures_ = 3;
+        syslog(LOG_WARNING,
+               "Invalid health-failures at line %d. Defaulting to 3\n",
+               linecount);
+        continue;
+      }
+    } else if (strlen(begin) >= strlen("health-probe-interval") &&
+               !strncmp(begin, "health-probe-interval",
+                        strlen("health-probe-interval"))) {
+      begin += strlen("health-probe-interval");
+      while (*begin != '\0' && isspace(*begin))
+        begin++;
+
+      if (sscanf(begin, "%hd", &health_probe_interval_) != 1 ||
+          health_probe_interval_ < 1 || health_probe_interval_ > 3600) {
+        health_probe_interval_ = 5;
+        syslog(LOG_WARNING,
+               "Invalid health-probe-interval at line %d. Defaulting to 5\n",
+               linecount);
+        continue;
+      }
+    } else if (strlen(begin) >= strlen("stats-file") &&
+               !strncmp(begin, "stats-file", strlen("stats-file"))) {
+      begin += strlen("stats-file");
+      while (*begin != '\0' && isspace(*begin))
+        begin++;
+
+      if (sscanf(begin, "%255s", buffer) != 1) {
+        syslog(LOG_WARNING, "Invalid stats-file at line %d\n", linecount);
+        continue;
+      }
+      stats_file_ = buffer;
+    } else if (strlen(begin) >= strlen("stats-interval") &&
+               !strncmp(begin, "stats-interval", strlen("stats-interval"))) {
+      begin += strlen("stats-interval");
+      while (*begin != '\0' && isspace(*begin))
+        begin++;
+
+      if (sscanf(begin, "%hd", &stats_interval_) != 1 ||
+          stats_interval_ < 1 || stats_interval_ > 3600) {
+        stats_interval_ = 10;
+        syslog(LOG_WARNING,
+               "Invalid stats-interval at line %d. Defaulting to 10\n",
+               linecount);
+        continue;
+      }
+    } else if (strlen(begin) >= strlen("cache-size") &&
+               !strncmp(begin, "cache-size", strlen("cache-size"))) {
+      begin += strlen("cache-size");
+      while (*begin != '\0' && isspace(*begin))
+        begin++;
+
+      if (sscanf(begin, "%ld", &cache_size_) != 1 || cache_size_ < 0 ||
+          cache_size_ > 65536) {
+        cache_size_ = 0;
+        syslog(LOG_WARNING,
+               "Invalid cache-size at line %d. Defaulting to 0 (disabled)\n",
+               linecount);
+        continue;
+      }
+    } else if (strlen(begin) >= strlen("cache-negative-ttl") &&
+               !strncmp(begin, "cache-negative-ttl",
+                        strlen("cache-negative-ttl"))) {
+      begin += strlen("cache-negative-ttl");
+      while (*begin != '\0' && isspace(*begin))
+        begin++;
+
+      if (sscanf(begin, "%ld", &cache_negative_ttl_) != 1 ||
+          cache_negative_ttl_ < 0 || cache_negative_ttl_ > 86400) {
+        cache_negative_ttl_ = 3600;
+        syslog(LOG_WARNING,
+               "Invalid cache-negative-ttl at line %d. Defaulting to 3600\n",
+               linecount);
+        continue;
+      }
+    } else if (strlen(begin) >= strlen("prefetch-threshold") &&
+               !strncmp(begin, "prefetch-threshold",
+                        strlen("prefetch-threshold"))) {
+      begin += strlen("prefetch-threshold");
+      while (*begin != '\0' && isspace(*begin))
+        begin++;
+
+      if (sscanf(begin, "%hd", &prefetch_threshold_) != 1 ||
+          prefetch_threshold_ < 0 || prefetch_threshold_ > 99) {
+        prefetch_threshold_ = 10;
+        syslog(LOG_WARNING,
+               "Invalid prefetch-threshold at line %d. Defaulting to 10\n",
+               linecount);
+        continue;
+      }
+    } else if (strlen(begin) >= strlen("prefetch-min-hits") &&
+               !strncmp(begin, "prefetch-min-hits",
+                        strlen("prefetch-min-hits"))) {
+      begin += strlen("prefetch-min-hits");
+      while (*begin != '\0' && isspace(*begin))
+        begin++;
+
+      if (sscanf(begin, "%hd", &prefetch_min_hits_) != 1 ||
+          prefetch_min_hits_ < 1 || prefetch_min_hits_ > 10000) {
+        prefetch_min_hits_ = 3;
+        syslog(LOG_WARNING,
+               "Invalid prefetch-min-hits at line %d. Defaulting to 3\n",
+               linecount);
+        continue;
+      }
+    } else if (strlen(begin) >= strlen("prefetch-rate") &&
+               !strncmp(begin, "prefetch-rate", strlen("prefetch-rate"))) {
+      begin += strlen("prefetch-rate");
+      while (*begin != '\0' && isspace(*begin))
+        begin++;
+
+      if (sscanf(begin, "%hd", &prefetch_rate_) != 1 || prefetch_rate_ < 1 ||
+          prefetch_rate_ > 10000) {
+        prefetch_rate_ = 100;
+        syslog(LOG_WARNING,
+               "Invalid prefetch-rate at line %d. Defaulting to 100\n",
+               linecount);
+        continue;
+      }
+    } else if (strlen(begin) >= strlen("serve-stale") &&
+               !strncmp(begin, "serve-stale", strlen("serve-stale"))) {
+      begin += strlen("serve-stale");
+      while (*begin != '\0' && isspace(*begin))
+        begin++;
+
+      if (sscanf(begin, "%ld", &serve_stale_) != 1 || serve_stale_ < 0 ||
+          serve_stale_ > 604800) {
+        serve_stale_ = 0;
+        syslog(LOG_WARNING,
+               "Invalid serve-stale at line %d. Defaulting to 0 (disabled)\n",
+               linecount);
+        continue;
+      }
+    } else if (strlen(begin) >= strlen("stale-answer-timeout") &&
+               !strncmp(begin, "stale-answer-timeout",
+                        strlen("stale-answer-timeout"))) {
+      begin += strlen("stale-answer-timeout");
+      while (*begin != '\0' && isspace(*begin))
+        begin++;
+
+      if (sscanf(begin, "%ld", &stale_answer_timeout_) != 1 ||
+          stale_answer_timeout_ < 1 || stale_answer_timeout_ > 60000) {
+        stale_answer_timeout_ = 1800;
+        syslog(LOG_WARNING,
+               "Invalid stale-answer-timeout at line %d. Defaulting to 1800\n",
+               linecount);
+        continue;
+      }
     } else if (strlen(begin) >= strlen("num-threads") &&
                !strncmp(begin, "num-threads", strlen("num-threads"))) {
       begin += strlen("num-threads");
@@ -203,6 +578,107 @@ bool Server::loadConfig(const char *filename) {
                "Invalid num-threads at line %d. Defaulting to 10\n", linecount);
         continue;
       }
+    } else if (strlen(begin) >= strlen("task-queue-size") &&
+               !strncmp(begin, "task-queue-size", strlen("task-queue-size"))) {
+      begin += strlen("task-queue-size");
+      while (*begin != '\0' && isspace(*begin))
+        begin++;
+
+      if (sscanf(begin, "%ld", &task_queue_size_) != 1 ||
+          task_queue_size_ < 2 || task_queue_size_ > 16777216) {
+        task_queue_size_ = 16384;
+        syslog(LOG_WARNING,
+               "Invalid task-queue-size at line %d. Defaulting to 16384\n",
+               linecount);
+        continue;
+      }
+    } else if (strlen(begin) >= strlen("task-queue") &&
+               !strncmp(begin, "task-queue", strlen("task-queue"))) {
+      begin += strlen("task-queue");
+      while (*begin != '\0' && isspace(*begin))
+        begin++;
+
+      if (!strncmp(begin, "lockfree", strlen("lockfree"))) {
+        task_queue_ = ThreadPool::queueKind::LOCKFREE;
+      } else if (!strncmp(begin, "stealing", strlen("stealing"))) {
+        task_queue_ = ThreadPool::queueKind::STEALING;
+      } else if (!strncmp(begin, "mutex", strlen("mutex"))) {
+        task_queue_ = ThreadPool::queueKind::MUTEX;
+      } else {
+        task_queue_ = ThreadPool::queueKind::MUTEX;
+        syslog(LOG_WARNING,
+               "Invalid task-queue at line %d. Defaulting to mutex\n",
+               linecount);
+        continue;
+      }
+    } else if (strlen(begin) >= strlen("listeners") &&
+               !strncmp(begin, "listeners", strlen("listeners"))) {
+      begin += strlen("listeners");
+      while (*begin != '\0' && isspace(*begin))
+        begin++;
+
+      if (sscanf(begin, "%hd", &num_listeners_) != 1 || num_listeners_ < 1 ||
+          num_listeners_ > 256) {
+        num_listeners_ = 1;
+        syslog(LOG_WARNING, "Invalid listeners at line %d. Defaulting to 1\n",
+               linecount);
+        continue;
+      }
+    } else if (strlen(begin) >= strlen("batch-size") &&
+               !strncmp(begin, "batch-size", strlen("batch-size"))) {
+      begin += strlen("batch-size");
+      while (*begin != '\0' && isspace(*begin))
+        begin++;
+
+      if (sscanf(begin, "%hd", &batch_size_) != 1 || batch_size_ < 1 ||
+          batch_size_ > 1024) {
+        batch_size_ = 1;
+        syslog(LOG_WARNING,
+               "Invalid batch-size at line %d. Defaulting to 1\n", linecount);
+        continue;
+      }
+    } else if (strlen(begin) >= strlen("batch-flush-time") &&
+               !strncmp(begin, "batch-flush-time", strlen("batch-flush-time"))) {
+      begin += strlen("batch-flush-time");
+      while (*begin != '\0' && isspace(*begin))
+        begin++;
+
+      if (sscanf(begin, "%ld", &batch_flush_time_) != 1 ||
+          batch_flush_time_ < 1 || batch_flush_time_ > 1000000) {
+        batch_flush_time_ = 100;
+        syslog(LOG_WARNING,
+               "Invalid batch-flush-time at line %d. Defaulting to 100 usec\n",
+               linecount);
+        continue;
+      }
+    } else if (strlen(begin) >= strlen("io-backend") &&
+               !strncmp(begin, "io-backend", strlen("io-backend"))) {
+      begin += strlen("io-backend");
+      while (*begin != '\0' && isspace(*begin))
+        begin++;
+      if (!strncmp(begin, "socket", strlen("socket"))) {
+        io_backend_ = ioBackend::SOCKET;
+      } else if (!strncmp(begin, "uring", strlen("uring"))) {
+        io_backend_ = ioBackend::URING;
+      } else {
+        syslog(LOG_WARNING,
+               "Invalid io-backend at line %d, defaulting to \"socket\"\n",
+               linecount);
+        io_backend_ = ioBackend::SOCKET;
+      }
+    } else if (strlen(begin) >= strlen("uring-buffers") &&
+               !strncmp(begin, "uring-buffers", strlen("uring-buffers"))) {
+      begin += strlen("uring-buffers");
+      while (*begin != '\0' && isspace(*begin))
+        begin++;
+
+      if (sscanf(begin, "%hd", &uring_buffers_) != 1 || uring_buffers_ < 1) {
+        uring_buffers_ = 4096;
+        syslog(LOG_WARNING,
+               "Invalid uring-buffers at line %d. Defaulting to 4096\n",
+               linecount);
+        continue;
+      }
     } else if (strlen(begin) >= strlen("response-maxlength") &&
                !strncmp(begin, "response-maxlength",
                         strlen("response-maxlength"))) {
@@ -218,6 +694,39 @@ bool Server::loadConfig(const char *filename) {
                linecount);
         continue;
       }
+    } else if (strlen(begin) >= strlen("packet-buffers") &&
+               !strncmp(begin, "packet-buffers", strlen("packet-buffers"))) {
+      begin += strlen("packet-buffers");
+      while (*begin != '\0' && isspace(*begin))
+        begin++;
+
+      if (sscanf(begin, "%ld", &packet_buffers_) != 1 || packet_buffers_ < 0 ||
+          packet_buffers_ > 16777216) {
+        packet_buffers_ = 8192;
+        syslog(LOG_WARNING,
+               "Invalid packet-buffers at line %d. Defaulting to 8192\n",
+               linecount);
+        continue;
+      }
+    } else if (strlen(begin) >= strlen("packet-buffer-hugepages") &&
+               !strncmp(begin, "packet-buffer-hugepages",
+                        strlen("packet-buffer-hugepages"))) {
+      begin += strlen("packet-buffer-hugepages");
+      while (*begin != '\0' && isspace(*begin))
+        begin++;
+
+      if (!strncmp(begin, "yes", strlen("yes"))) {
+        packet_buffer_hugepages_ = true;
+      } else if (!strncmp(begin, "no", strlen("no"))) {
+        packet_buffer_hugepages_ = false;
+      } else {
+        packet_buffer_hugepages_ = false;
+        syslog(LOG_WARNING,
+               "Invalid packet-buffer-hugepages at line %d. Defaulting to "
+               "no\n",
+               linecount);
+        continue;
+      }
     } else if (strlen(begin) >= strlen("port") &&
                !strncmp(begin, "port", strlen("port"))) {
       begin += strlen("port");
@@ -240,62 +749,377 @@ bool Server::loadConfig(const char *filename) {
 }
 
 void Server::start() {
-  /* Creating socket */
-  if ((sock6fd_ = socket(AF_INET6, SOCK_DGRAM, 0)) == -1) {
-    throw ServerException{"Unable to create server socket"};
-  }
-
-  /* Binding socket */
+  /* Binding address */
   memset(&dns64srv_addr_, 0x00, sizeof(dns64srv_addr_));
   dns64srv_addr_.sin6_family = AF_INET6;   // Address family
   dns64srv_addr_.sin6_port = htons(port_); // UDP port number
   dns64srv_addr_.sin6_addr = in6addr_any;  // To any valid IP address
-  if (bind(sock6fd_, reinterpret_cast<struct sockaddr *>(&dns64srv_addr_),
-           sizeof(dns64srv_addr_)) == -1) {
-    std::stringstream ss;
-    ss << "Unable to bind server socket: " << strerror(errno);
-    throw ServerException{ss.str()};
+
+  /* The threads started here must leave SIGTERM to the main thread */
+  sigset_t sigterm, oldmask;
+  sigemptyset(&sigterm);
+  sigaddset(&sigterm, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &sigterm, &oldmask);
+
+  size_t threads_per_listener = num_threads_ / num_listeners_;
+  if (threads_per_listener == 0) {
+    threads_per_listener = 1;
   }
+  try {
+    /* Every packet buffer comes from the pool, so it must outlive the
+     * Listeners and the upstream callbacks */
+    buffers_ = new BufferPool{static_cast<size_t>(response_maxlength_),
+                              static_cast<size_t>(packet_buffers_),
+                              packet_buffer_hugepages_};
+    /* Every pending Query holds a packet buffer, so it needs no more slots */
+    queries_ = new BufferPool{sizeof(Query),
+                              static_cast<size_t>(packet_buffers_), false};
+    stats_ = new UpstreamStats{dns_servers_.size(),
+                               static_cast<unsigned>(hedge_percentile_),
+                               static_cast<unsigned>(hedge_budget_),
+                               static_cast<unsigned>(health_failures_)};
+    if (health_failures_ > 0) {
+      probe_ = new HealthProbe{dns_servers_, *stats_,
+                               std::chrono::seconds{health_probe_interval_},
+                               timeout_};
+    }
+
+    /* A blocking upstream answers the A query before the AAAA query is
+     * even sent, which only adds a round trip */
+    if (parallel_a_ && upstream_mode_ != upstreamMode::ASYNC) {
+      syslog(LOG_DAEMON | LOG_WARNING,
+             "Parallel A queries need the async upstream mode, disabling "
+             "them (upstream-mode blocking)");
+      parallel_a_ = false;
+    }
 
-  /* Creating worker pool */
-  pool_ = new ThreadPool{static_cast<size_t>(num_threads_)};
+    /* Creating the shared upstream client */
+    if (upstream_mode_ == upstreamMode::ASYNC) {
+      upstream_ =
+          new AsyncDNSClient{*this, static_cast<size_t>(upstream_threads_),
+                             static_cast<size_t>(upstream_sockets_)};
+    } else if (socket_pool_) {
+      upstream_ = new DNSClient{*this, true};
+    }
+
+    /* Coalescing the identical queries sent to the shared upstream client */
+    if (coalesce_ && upstream_ != nullptr) {
+      coalescer_ = new Coalescer{*upstream_,
+                                 upstream_mode_ == upstreamMode::BLOCKING};
+    }
+
+    /* Creating the answer cache in front of the shared upstream client */
+    if (cache_size_ > 0) {
+      if (upstream_ != nullptr) {
+        cache_ = new AnswerCache{
+            coalescer_ != nullptr ? static_cast<DNSSource &>(*coalescer_)
+                                  : *upstream_,
+            upstream_mode_ == upstreamMode::BLOCKING,
+            [this](uint8_t *buffer, size_t len, size_t buflen) {
+              return synthesize(buffer, len, buflen);
+            },
+            static_cast<size_t>(cache_size_) * 1024 * 1024,
+            static_cast<uint32_t>(cache_negative_ttl_),
+            static_cast<unsigned>(prefetch_threshold_),
+            static_cast<unsigned long>(prefetch_min_hits_),
+            static_cast<unsigned>(prefetch_rate_),
+            std::chrono::seconds{serve_stale_},
+            std::chrono::milliseconds{stale_answer_timeout_}};
+      } else {
+        syslog(LOG_DAEMON | LOG_WARNING,
+               "The answer cache needs a shared upstream client, "
+               "disabling it (socket-pool no)");
+      }
+    }
+
+    if (!stats_file_.empty()) {
+      metrics_ = new Metrics{stats_file_,
+                             std::chrono::seconds{stats_interval_}};
+      metrics_->add(std::bind(&Server::writeMetrics, this,
+                              std::placeholders::_1));
+      metrics_->start();
+    }
+
+    for (int i = 0; i < num_listeners_; i++) {
+      Listener *listener = new Listener;
+      listeners_.push_back(listener);
+
+      /* Creating socket */
+      if ((listener->sockfd_ = socket(AF_INET6, SOCK_DGRAM, 0)) == -1) {
+        throw ServerException{"Unable to create server socket"};
+      }
+
+      /* Sharing the port between the listeners */
+      int on = 1;
+      if (num_listeners_ > 1 &&
+          setsockopt(listener->sockfd_, SOL_SOCKET, SO_REUSEPORT, &on,
+                     sizeof(on)) == -1) {
+        std::stringstream ss;
+        ss << "Unable to set SO_REUSEPORT on server socket: "
+           << strerror(errno);
+        throw ServerException{ss.str()};
+      }
+
+      /* Binding socket */
+      if (bind(listener->sockfd_,
+               reinterpret_cast<struct sockaddr *>(&dns64srv_addr_),
+               sizeof(dns64srv_addr_)) == -1) {
+        std::stringstream ss;
+        ss << "Unable to bind server socket: " << strerror(errno);
+        throw ServerException{ss.str()};
+      }
+
+      /* Creating worker pool */
+      listener->pool_ =
+          new ThreadPool{threads_per_listener, task_queue_,
+                         static_cast<size_t>(task_queue_size_)};
+
+      /* Creating I/O engine */
+      listener->io_ =
+          new BatchIO{listener->sockfd_, static_cast<size_t>(batch_size_),
+                      std::chrono::microseconds{batch_flush_time_},
+                      static_cast<size_t>(response_maxlength_), *buffers_};
+      listener->receiver_ = listener->io_;
+
+      /* Replacing the receive path with io_uring when it is supported */
+      if (io_backend_ == ioBackend::URING) {
+        try {
+          listener->receiver_ = new URingReceiver{
+              listener->sockfd_, static_cast<size_t>(batch_size_),
+              static_cast<size_t>(response_maxlength_),
+              static_cast<unsigned>(uring_buffers_)};
+        } catch (URingException &e) {
+          syslog(LOG_DAEMON | LOG_WARNING,
+                 "%s, falling back to the socket backend", e.what());
+          io_backend_ = ioBackend::SOCKET;
+        }
+      }
+    }
+
+    /* Starting the receive loops of the additional listeners */
+    for (size_t i = 1; i < listeners_.size(); i++) {
+      receivers_.push_back(
+          std::thread{&Server::receive, this, std::ref(*listeners_[i])});
+    }
+  } catch (...) {
+    pthread_sigmask(SIG_SETMASK, &oldmask, nullptr);
+    stop();
+    throw;
+  }
+  pthread_sigmask(SIG_SETMASK, &oldmask, nullptr);
 
+  /* The first listener is served by the main thread */
+  receive(*listeners_[0]);
+
+  for (auto &receiver : receivers_) {
+    receiver.join();
+  }
+  receivers_.clear();
+  delete metrics_;
+  metrics_ = nullptr;
+  delete probe_;
+  probe_ = nullptr;
+  /* Stopping the stale answers and the upstream callbacks before their
+   * sockets, the coalescer and the cache they store into go away */
+  if (cache_ != nullptr) {
+    cache_->stop();
+  }
+  delete upstream_;
+  upstream_ = nullptr;
+  delete coalescer_;
+  coalescer_ = nullptr;
+  delete cache_;
+  cache_ = nullptr;
+  for (auto listener : listeners_) {
+    delete listener;
+  }
+  listeners_.clear();
+  delete queries_;
+  queries_ = nullptr;
+  delete buffers_;
+  buffers_ = nullptr;
+}
+
+size_t Server::selectServer() {
+  if (sel_mode_ == selectionMode::ROUND_ROBIN) {
+    return skipDown((++rr_) % dns_servers_.size());
+  } else if (sel_mode_ == selectionMode::LATENCY) {
+    /* Exploring keeps the RTTs of the slower recursors up to date */
+    if (nextRandom() % 100 < static_cast<uint32_t>(latency_exploration_)) {
+      return skipDown(nextRandom() % dns_servers_.size());
+    }
+    return stats_->fastest(dns_servers_.size());
+  } else {
+    return skipDown(rand() % dns_servers_.size());
+  }
+}
+
+size_t Server::selectHedgeServer(size_t server) {
+  if (dns_servers_.size() < 2) {
+    return dns_servers_.size();
+  }
+  size_t hedge;
+  if (sel_mode_ == selectionMode::LATENCY) {
+    hedge = stats_->fastest(server);
+  } else {
+    hedge = skipDown((server + 1 + rand() % (dns_servers_.size() - 1)) %
+                     dns_servers_.size());
+  }
+  /* Hedging to the same recursor, or to one which is down, does not help */
+  if (hedge == server || !stats_->up(hedge)) {
+    return dns_servers_.size();
+  }
+  return hedge;
+}
+
+size_t Server::skipDown(size_t server) {
+  /* The common case: every recursor is up */
+  if (stats_->down() == 0) {
+    return server;
+  }
+  for (size_t i = 0; i < dns_servers_.size(); i++) {
+    size_t candidate = (server + i) % dns_servers_.size();
+    if (stats_->up(candidate)) {
+      return candidate;
+    }
+  }
+  /* All of them are down, the answers will bring them back */
+  return server;
+}
+
+void Server::writeMetrics(std::ostream &os) {
+  char ip[INET_ADDRSTRLEN];
+  os << "# HELP mtd64_upstream_up Whether the recursor is used for queries.\n"
+     << "# TYPE mtd64_upstream_up gauge\n";
+  for (size_t i = 0; i < dns_servers_.size(); i++) {
+    inet_ntop(AF_INET, &dns_servers_[i], ip, sizeof(ip));
+    os << "mtd64_upstream_up{nameserver=\"" << ip << "\"} "
+       << (stats_->up(i) ? 1 : 0) << "\n";
+  }
+  os << "# HELP mtd64_upstream_failures Consecutive timeouts of the "
+        "recursor.\n"
+     << "# TYPE mtd64_upstream_failures gauge\n";
+  for (size_t i = 0; i < dns_servers_.size(); i++) {
+    inet_ntop(AF_INET, &dns_servers_[i], ip, sizeof(ip));
+    os << "mtd64_upstream_failures{nameserver=\"" << ip << "\"} "
+       << stats_->failures(i) << "\n";
+  }
+  os << "# HELP mtd64_upstream_srtt_seconds Smoothed RTT of the recursor.\n"
+     << "# TYPE mtd64_upstream_srtt_seconds gauge\n";
+  for (size_t i = 0; i < dns_servers_.size(); i++) {
+    inet_ntop(AF_INET, &dns_servers_[i], ip, sizeof(ip));
+    os << "mtd64_upstream_srtt_seconds{nameserver=\"" << ip << "\"} "
+       << stats_->srtt(i) / 1e6 << "\n";
+  }
+  os << "# HELP mtd64_upstream_rttvar_seconds Smoothed RTT deviation of the "
+        "recursor.\n"
+     << "# TYPE mtd64_upstream_rttvar_seconds gauge\n";
+  for (size_t i = 0; i < dns_servers_.size(); i++) {
+    inet_ntop(AF_INET, &dns_servers_[i], ip, sizeof(ip));
+    os << "mtd64_upstream_rttvar_seconds{nameserver=\"" << ip << "\"} "
+       << stats_->rttvar(i) / 1e6 << "\n";
+  }
+  os << "# HELP mtd64_upstream_hedges_total Hedged upstream queries.\n"
+     << "# TYPE mtd64_upstream_hedges_total counter\n"
+     << "mtd64_upstream_hedges_total " << stats_->hedges() << "\n";
+  if (coalescer_ != nullptr) {
+    os << "# HELP mtd64_upstream_coalesced_total Queries answered by an "
+          "identical query in flight.\n"
+       << "# TYPE mtd64_upstream_coalesced_total counter\n"
+       << "mtd64_upstream_coalesced_total " << coalescer_->coalesced()
+       << "\n";
+  }
+  if (cache_ != nullptr) {
+    CacheCounters counters = cache_->counters();
+    os << "# HELP mtd64_cache_hits_total Answers served from the cache.\n"
+       << "# TYPE mtd64_cache_hits_total counter\n"
+       << "mtd64_cache_hits_total{type=\"positive\"} " << counters.hits_
+       << "\n"
+       << "mtd64_cache_hits_total{type=\"negative\"} "
+       << counters.negative_hits_ << "\n"
+       << "mtd64_cache_hits_total{type=\"stale\"} "
+       << counters.stale_answers_ << "\n"
+       << "# HELP mtd64_cache_misses_total Cacheable queries sent upstream.\n"
+       << "# TYPE mtd64_cache_misses_total counter\n"
+       << "mtd64_cache_misses_total " << counters.misses_ << "\n"
+       << "# HELP mtd64_cache_prefetches_total Cached answers refreshed "
+          "before expiry.\n"
+       << "# TYPE mtd64_cache_prefetches_total counter\n"
+       << "mtd64_cache_prefetches_total " << counters.prefetches_ << "\n"
+       << "# HELP mtd64_cache_entries Answers in the cache.\n"
+       << "# TYPE mtd64_cache_entries gauge\n"
+       << "mtd64_cache_entries " << counters.entries_ << "\n"
+       << "# HELP mtd64_cache_size_bytes Memory used by the cache.\n"
+       << "# TYPE mtd64_cache_size_bytes gauge\n"
+       << "mtd64_cache_size_bytes " << counters.size_ << "\n";
+  }
+  BufferStats buffers = buffers_->stats();
+  os << "# HELP mtd64_buffers_capacity Buffers in the packet buffer pool.\n"
+     << "# TYPE mtd64_buffers_capacity gauge\n"
+     << "mtd64_buffers_capacity " << buffers.capacity_ << "\n"
+     << "# HELP mtd64_buffers_in_use Packet buffers taken from the pool.\n"
+     << "# TYPE mtd64_buffers_in_use gauge\n"
+     << "mtd64_buffers_in_use " << buffers.in_use_ << "\n"
+     << "# HELP mtd64_buffer_overflows_total Packet buffers allocated on the "
+        "heap because the pool was empty.\n"
+     << "# TYPE mtd64_buffer_overflows_total counter\n"
+     << "mtd64_buffer_overflows_total " << buffers.overflows_ << "\n";
+}
+
+void Server::receive(Listener &listener) {
   /* Receving packets */
-  while (!pool_->isStopped()) {
-    struct sockaddr_in6 sender;
-    socklen_t sender_slen;
-    ssize_t recvlen;
+  while (!stop_) {
+    int received;
     char client_ip[INET6_ADDRSTRLEN];
-    uint8_t *buffer = new uint8_t[response_maxlength_];
-    sender_slen = sizeof(sender);
-    if ((recvlen = recvfrom(sock6fd_, buffer, response_maxlength_, 0,
-                            reinterpret_cast<struct sockaddr *>(&sender),
-                            &sender_slen)) <= 0) {
-      delete[] buffer;
-      if (errno == EMSGSIZE) {
+    if ((received = listener.receiver_->receive()) < 0) {
+      if (errno == EINTR) {
+        break;
+      } else {
+        syslog(LOG_DAEMON | LOG_WARNING, "receive failure: %d (%s)", errno,
+               strerror(errno));
+        continue;
+      }
+    }
+    if (stop_) {
+      break;
+    }
+    for (int i = 0; i < received; i++) {
+      if (listener.receiver_->truncated(i)) {
         syslog(LOG_DAEMON | LOG_WARNING,
                "The received message from IPv6 client is longer than %hd "
                "bytes. Ignored",
                response_maxlength_);
         continue;
-      } else if (errno == EINTR) {
-        break;
-      } else {
-        syslog(LOG_DAEMON | LOG_WARNING, "recvfrom() failure: %d (%s)", errno,
-               strerror(errno));
+      }
+      if (listener.receiver_->length(i) < sizeof(DNSHeader)) {
         continue;
       }
-    }
-    inet_ntop(AF_INET6, &sender.sin6_addr, client_ip, INET6_ADDRSTRLEN);
-    syslog(LOG_DAEMON | LOG_INFO, "Received packet from [%s]:%hu, length %zd",
-           client_ip, ntohs(sender.sin6_port), recvlen);
+      inet_ntop(AF_INET6, &listener.receiver_->sender(i).sin6_addr, client_ip,
+                INET6_ADDRSTRLEN);
+      syslog(LOG_DAEMON | LOG_INFO, "Received packet from [%s]:%hu, length %zu",
+             client_ip, ntohs(listener.receiver_->sender(i).sin6_port),
+             listener.receiver_->length(i));
 
-    pool_->addTask(Query{buffer, (size_t)recvlen, sender, sender_slen, *this});
+      listener.pool_->addTask(Query{
+          listener.receiver_->take(i), listener.receiver_->length(i),
+          listener.receiver_->sender(i), listener.receiver_->senderLength(i),
+          *this, *listener.receiver_, *listener.io_});
+    }
   }
-  close(sock6fd_);
 }
 
-void Server::stop() { pool_->stop(); }
+void Server::stop() {
+  stop_ = true;
+  for (auto listener : listeners_) {
+    if (listener->pool_ != nullptr) {
+      listener->pool_->stop();
+    }
+    /* Wakes up the receive loop blocked on the socket */
+    if (listener->sockfd_ != -1) {
+      shutdown(listener->sockfd_, SHUT_RD);
+    }
+  }
+}
 
 std::ostream &operator<<(std::ostream &os, const Server &server) {
   char buffer[1024];
@@ -312,10 +1136,33 @@ std::ostream &operator<<(std::ostream &os, const Server &server) {
   if (server.sel_mode_ == Server::selectionMode::ROUND_ROBIN) {
     snprintf(buffer, sizeof(buffer), "round-robin\n");
     os << buffer;
+  } else if (server.sel_mode_ == Server::selectionMode::LATENCY) {
+    snprintf(buffer, sizeof(buffer), "latency (%hd%% exploration)\n",
+             server.latency_exploration_);
+    os << buffer;
   } else {
     snprintf(buffer, sizeof(buffer), "random\n");
     os << buffer;
   }
+  snprintf(buffer, sizeof(buffer), "Upstream mode: %s\n",
+           server.upstream_mode_ == Server::upstreamMode::ASYNC ? "async"
+                                                                 : "blocking");
+  os << buffer;
+  snprintf(buffer, sizeof(buffer), "Upstream threads: %hd\n",
+           server.upstream_threads_);
+  os << buffer;
+  snprintf(buffer, sizeof(buffer), "Upstream sockets: %hd\n",
+           server.upstream_sockets_);
+  os << buffer;
+  snprintf(buffer, sizeof(buffer), "Socket pool: %s\n",
+           server.socket_pool_ ? "yes" : "no");
+  os << buffer;
+  snprintf(buffer, sizeof(buffer), "Parallel A query: %s\n",
+           server.parallel_a_ ? "yes" : "no");
+  os << buffer;
+  snprintf(buffer, sizeof(buffer), "Coalesce queries: %s\n",
+           server.coalesce_ ? "yes" : "no");
+  os << buffer;
   char str[INET6_ADDRSTRLEN];
   inet_ntop(AF_INET6, &server.ipv6_, str, INET6_ADDRSTRLEN);
   snprintf(buffer, sizeof(buffer), "DNS64 IPv6 address: %s/%d\n", str,
@@ -330,41 +1177,114 @@ std::ostream &operator<<(std::ostream &os, const Server &server) {
   snprintf(buffer, sizeof(buffer), "Resend attempts: %hd\n",
            server.resend_attempts_);
   os << buffer;
+  snprintf(buffer, sizeof(buffer), "Hedging: %s\n",
+           server.hedging_ ? "yes" : "no");
+  os << buffer;
+  snprintf(buffer, sizeof(buffer), "Hedge percentile: %hd\n",
+           server.hedge_percentile_);
+  os << buffer;
+  snprintf(buffer, sizeof(buffer), "Hedge budget: %hd%%\n",
+           server.hedge_budget_);
+  os << buffer;
+  if (server.health_failures_ > 0) {
+    snprintf(buffer, sizeof(buffer), "Health failures: %hd\n",
+             server.health_failures_);
+  } else {
+    snprintf(buffer, sizeof(buffer), "Health failures: disabled\n");
+  }
+  os << buffer;
+  snprintf(buffer, sizeof(buffer), "Health probe interval: %hd s\n",
+           server.health_probe_interval_);
+  os << buffer;
+  if (server.cache_size_ > 0) {
+    snprintf(buffer, sizeof(buffer), "Cache size: %ld MB\n",
+             server.cache_size_);
+  } else {
+    snprintf(buffer, sizeof(buffer), "Cache size: disabled\n");
+  }
+  os << buffer;
+  snprintf(buffer, sizeof(buffer), "Cache negative TTL: %ld s\n",
+           server.cache_negative_ttl_);
+  os << buffer;
+  if (server.prefetch_threshold_ > 0) {
+    snprintf(buffer, sizeof(buffer),
+             "Prefetch: last %hd%% of the TTL, after %hd hits, at most %hd/s\n",
+             server.prefetch_threshold_, server.prefetch_min_hits_,
+             server.prefetch_rate_);
+  } else {
+    snprintf(buffer, sizeof(buffer), "Prefetch: disabled\n");
+  }
+  os << buffer;
+  if (server.serve_stale_ > 0) {
+    snprintf(buffer, sizeof(buffer),
+             "Serve stale: for %ld s, after %ld ms\n", server.serve_stale_,
+             server.stale_answer_timeout_);
+  } else {
+    snprintf(buffer, sizeof(buffer), "Serve stale: disabled\n");
+  }
+  os << buffer;
+  snprintf(buffer, sizeof(buffer), "Stats file: %s\n",
+           server.stats_file_.empty() ? "disabled"
+                                      : server.stats_file_.c_str());
+  os << buffer;
+  snprintf(buffer, sizeof(buffer), "Stats interval: %hd s\n",
+           server.stats_interval_);
+  os << buffer;
   snprintf(buffer, sizeof(buffer), "Maximum response length: %hd\n",
            server.response_maxlength_);
   os << buffer;
   snprintf(buffer, sizeof(buffer), "Worker threads: %hd\n",
            server.num_threads_);
   os << buffer;
+  snprintf(buffer, sizeof(buffer), "Task queue: %s, %ld tasks\n",
+           server.task_queue_ == ThreadPool::queueKind::LOCKFREE
+               ? "lockfree"
+               : server.task_queue_ == ThreadPool::queueKind::STEALING
+                     ? "stealing"
+                     : "mutex",
+           server.task_queue_size_);
+  os << buffer;
+  snprintf(buffer, sizeof(buffer), "Listeners: %hd\n", server.num_listeners_);
+  os << buffer;
+  snprintf(buffer, sizeof(buffer), "Batch size: %hd\n", server.batch_size_);
+  os << buffer;
+  snprintf(buffer, sizeof(buffer), "Batch flush time: %ld usec\n",
+           server.batch_flush_time_);
+  os << buffer;
+  snprintf(buffer, sizeof(buffer), "I/O backend: %s\n",
+           server.io_backend_ == Server::ioBackend::URING ? "uring" : "socket");
+  os << buffer;
+  snprintf(buffer, sizeof(buffer), "io_uring buffers: %hd\n",
+           server.uring_buffers_);
+  os << buffer;
+  snprintf(buffer, sizeof(buffer), "Packet buffers: %ld%s\n",
+           server.packet_buffers_,
+           server.packet_buffer_hugepages_ ? ", on hugepages" : "");
+  os << buffer;
   return os;
 }
 
 bool Server::debug() const { return debug_; }
 
-void Server::synth(const uint8_t *v4, uint8_t *v6) {
-  memset(v6, 0x00, 16);
-  memcpy(v6, ipv6_.s6_addr, ipv6_prefix_ / 8);
-  switch (ipv6_prefix_) {
-  case 32:
-    memcpy(v6 + 4, v4, 4);
-    break;
-  case 40:
-    memcpy(v6 + 5, v4, 3);
-    memcpy(v6 + 9, v4 + 3, 1);
-    break;
-  case 48:
-    memcpy(v6 + 6, v4, 2);
-    memcpy(v6 + 9, v4 + 2, 2);
-    break;
-  case 56:
-    memcpy(v6 + 7, v4, 1);
-    memcpy(v6 + 9, v4 + 1, 3);
-    break;
-  case 64:
-    memcpy(v6 + 9, v4, 4);
-    break;
-  case 96:
-    memcpy(v6 + 12, v4, 4);
-    break;
+size_t Server::synthesize(uint8_t *answer, size_t len, uint8_t *out,
+                          size_t outlen) {
+  DNSPacket apacket{answer, len, len};
+  return apacket.rewriteAToAAAA(
+      out, outlen, [this](const uint8_t *v4, uint8_t *v6, size_t count) {
+        synthesizer_(v4, v6, count);
+      });
+}
+
+size_t Server::synthesize(uint8_t *buffer, size_t len, size_t buflen) {
+  uint8_t *out = buffers_->acquire();
+  try {
+    len = synthesize(buffer, len, out,
+                     std::min(buflen, buffers_->bufferSize()));
+  } catch (...) {
+    buffers_->release(out);
+    throw;
   }
+  memcpy(buffer, out, len);
+  buffers_->release(out);
+  return len;
 }
@@ -25,13 +25,23 @@
 #ifndef SERVER_H_INCLUDED
 #define SERVER_H_INCLUDED
 
+#include "../batchio.h"
+#include "../bufferpool.h"
 #include "../pool.h"
+#include "../synth.h"
+#include "answercache.h"
+#include "coalescer.h"
+#include "dnssource.h"
+#include "healthprobe.h"
+#include "metrics.h"
+#include "upstreamstats.h"
 #include <atomic>
 #include <exception>
 #include <iostream>
 #include <netinet/in.h>
 #include <string>
 #include <sys/time.h>
+#include <thread>
 #include <vector>
 
 /**
@@ -54,6 +64,40 @@ public:
   const char *what() const noexcept override;
 };
 
+/**
+ * A listening socket with its own receive loop and worker pool.
+ * With SO_REUSEPORT several Listeners share the server port, and the kernel
+ * distributes the incoming packets among them.
+ */
+struct Listener {
+  int sockfd_;       /**< The socket of the Listener. */
+  ThreadPool *pool_; /**< Workers processing the packets of this Listener. */
+  BatchIO *io_;      /**< Batched I/O engine of the socket. */
+  Receiver *receiver_; /**< Receiving engine of the socket, either io_ or a
+                          URingReceiver. */
+
+  /**
+   * Constructor.
+   */
+  Listener();
+
+  /**
+   * Destructor.
+   * Closes the socket.
+   */
+  ~Listener();
+
+  /**
+   * Copy constructor, explicitly deleted.
+   */
+  Listener(const Listener &) = delete;
+
+  /**
+   * Copy assignment operator, explicitly deleted.
+   */
+  Listener &operator=(const Listener &) = delete;
+};
+
 /**
  * Main Server class.
  * This class aggregates the server parameters and functions.
@@ -65,7 +109,24 @@ public:
    */
   enum selectionMode {
     ROUND_ROBIN, /**< round-robin selection */
-    RANDOM       /**< random selection */
+    RANDOM,      /**< random selection */
+    LATENCY      /**< lowest smoothed RTT, with random exploration */
+  };
+
+  /**
+   * Enum for the upstream query mode.
+   */
+  enum upstreamMode {
+    BLOCKING, /**< every query blocks a worker thread (DNSClient) */
+    ASYNC     /**< queries are handled by event loops (AsyncDNSClient) */
+  };
+
+  /**
+   * Enum for the I/O backend of the sockets.
+   */
+  enum ioBackend {
+    SOCKET, /**< recvmmsg/sendmmsg and blocking recvfrom/sendto */
+    URING   /**< io_uring with multishot recvmsg and provided buffers */
   };
 
   /**
@@ -140,12 +201,67 @@ public:
    */
   friend class DNSClient;
 
+  /**
+   * AsyncDNSClient uses and can modify the Server (thread-safely).
+   */
+  friend class AsyncDNSClient;
+
 private:
-  ThreadPool *pool_; /**< ThreadPool to process queries on multiple threads. */
+  std::vector<Listener *> listeners_; /**< The listening sockets. */
+  std::vector<std::thread>
+      receivers_; /**< Receive threads of all but the first Listener. */
+  std::atomic<bool> stop_; /**< Used to stop the receive loops. */
 
   std::vector<struct in_addr> dns_servers_; /**< Configured recursors to use. */
 
-  int sock6fd_;                       /**< Server socket. */
+  upstreamMode upstream_mode_; /**< How the upstream queries are sent. */
+  short int upstream_threads_; /**< Number of event loops in async mode. */
+  short int upstream_sockets_; /**< Shared sockets per recursor in each event
+                                  loop in async mode (0 means a new socket
+                                  for every query). */
+  bool socket_pool_;    /**< Whether the blocking upstream queries use pooled
+                           connected sockets. */
+  bool parallel_a_;     /**< Whether the A query of an AAAA query is sent at
+                           the same time as the AAAA query (async upstream
+                           mode only). */
+  bool hedging_;        /**< Whether slow upstream queries are hedged. */
+  short int hedge_percentile_; /**< RTT percentile of a recursor after which
+                                  a query is hedged. */
+  short int hedge_budget_; /**< Maximum percentage of hedged queries. */
+  UpstreamStats *stats_;   /**< Statistics of the recursors. */
+  short int health_failures_; /**< Consecutive timeouts taking a recursor
+                                 down (0 disables the circuit breaker). */
+  short int health_probe_interval_; /**< Seconds between two probes of a
+                                       recursor which is down. */
+  HealthProbe *probe_;      /**< Prober of the recursors which are down. */
+  std::string stats_file_;  /**< The metrics file (empty if disabled). */
+  short int stats_interval_; /**< Seconds between two writes of the metrics
+                                file. */
+  Metrics *metrics_;         /**< Writer of the metrics file. */
+  DNSSource *upstream_; /**< The shared DNSSource, nullptr if every Query has
+                           its own (blocking mode without socket pool). */
+  long int cache_size_; /**< Memory budget of the answer cache in megabytes
+                           (0 disables the cache). */
+  long int cache_negative_ttl_; /**< Maximum TTL of the cached NXDOMAIN and
+                                   NODATA answers in seconds (0 disables
+                                   negative caching). */
+  short int prefetch_threshold_; /**< Percentage of the TTL left at which a
+                                    hit refreshes a cached answer (0
+                                    disables prefetching). */
+  short int prefetch_min_hits_;  /**< Hits needed for a cached answer to be
+                                    refreshed. */
+  short int prefetch_rate_; /**< Maximum number of refreshes per second. */
+  long int serve_stale_; /**< Time an expired answer may still be served in
+                            seconds (0 disables serve-stale). */
+  long int stale_answer_timeout_; /**< Time to wait for the upstream before
+                                     serving a stale answer in ms. */
+  bool coalesce_;        /**< Whether identical queries in flight are
+                            coalesced. */
+  Coalescer *coalescer_; /**< Coalescer of the queries sent to upstream_
+                            (nullptr if disabled). */
+  AnswerCache *cache_;   /**< The answer cache in front of upstream_ (nullptr
+                            if disabled). */
+
   struct sockaddr_in6 dns64srv_addr_; /**< Server address. */
   uint16_t port_;                     /**< Server port. */
 
@@ -153,30 +269,108 @@ private:
                               round-robin, (2) means random */
   std::atomic<int> rr_;    /**< The sequence number of the DNS server which is
                               actually in use in round-robin mode */
+  short int latency_exploration_; /**< Percentage of the queries sent to a
+                                     random recursor in latency mode */
 
   struct in6_addr ipv6_; /**< For checking if the address is valid, and used
                             later for conversion, too */
   unsigned char
       ipv6_prefix_; /**< Prefix length for IPv4 embedded IPv6 addresses */
+  PrefixSynthesizer synthesizer_; /**< Synthesizes the IPv6 addresses with
+                                     the kernel of the prefix length. */
 
   struct timeval timeout_; /**< DNS response packet arrival expectation time */
   short int resend_attempts_; /**< 0 = no resending attempt */
 
   short int num_threads_; /**< Number of worker threads to use */
+  ThreadPool::queueKind task_queue_; /**< Task queue engine of the workers */
+  long int task_queue_size_; /**< Capacity of the lock-free task queue */
+
+  short int num_listeners_; /**< Number of SO_REUSEPORT sockets, each with
+                               its own receive loop and worker pool */
+
+  short int batch_size_; /**< Maximum number of packets per receive and send
+                            syscall (1 disables batching) */
+  long int batch_flush_time_; /**< Maximum time in microseconds a response can
+                                 wait for its batch to fill */
+
+  ioBackend io_backend_; /**< I/O backend of the server socket and of the
+                            blocking upstream queries. */
+  short int uring_buffers_; /**< Number of provided receive buffers of a
+                               Listener with the io_uring backend. */
 
   short int response_maxlength_; /**< Maximum legth of the IPv6 DNS response
                                     packet (UDP payload) */
 
+  long int packet_buffers_; /**< Number of buffers in the packet buffer
+                               pool. */
+  bool packet_buffer_hugepages_; /**< Whether the packet buffer pool is
+                                    backed by hugepages. */
+  BufferPool *buffers_; /**< Pool of the packet buffers of the Listeners and
+                           of the Queries. */
+  BufferPool *queries_; /**< Pool of the Queries waiting for upstream
+                           answers. */
+
   bool debug_; /**< Debug flag */
 
   /**
-   * Function to synthesize the IPv6 address.
-   * As described in RFC 6052 2.
-   * @param v4 the IPv4 address in network byte order (4 bytes)
-   * @param v6 the buffer to store the synthesized IPv6 address (at least 16
-   * bytes)
+   * Selects a recursor using the configured selection mode.
+   * @return the index of the selected recursor in dns_servers_
+   */
+  size_t selectServer();
+
+  /**
+   * Selects a recursor for the hedge of a query.
+   * @param server the index of the recursor the query was sent to
+   * @return the index of another recursor which is up, or the number of
+   * recursors if there is none
+   */
+  size_t selectHedgeServer(size_t server);
+
+  /**
+   * Skips the recursors taken down by the circuit breaker.
+   * @param server the index of the selected recursor
+   * @return the index of the first recursor from server which is up, or
+   * server if all of them are down
+   */
+  size_t skipDown(size_t server);
+
+  /**
+   * Writes the metrics of the recursors and of the answer cache.
+   * @param os the stream of the metrics file
+   */
+  void writeMetrics(std::ostream &os);
+
+  /**
+   * Receive loop of a Listener.
+   * Receives packets until the server is stopped and passes them to the
+   * Listener's worker pool.
+   * @param listener the Listener
+   */
+  void receive(Listener &listener);
+
+  /**
+   * Writes the synthesized AAAA answer of an A answer into another buffer.
+   * Throws the exceptions of DNSPacket if the answer is malformed or the
+   * result does not fit.
+   * @param answer the A answer
+   * @param len the length of the answer
+   * @param out the buffer of the synthesized answer
+   * @param outlen the length of the buffer
+   * @return the length of the synthesized answer
+   */
+  size_t synthesize(uint8_t *answer, size_t len, uint8_t *out, size_t outlen);
+
+  /**
+   * Turns an A answer into the synthesized AAAA answer in place, through a
+   * buffer of the BufferPool.
+   * Throws the exceptions of DNSPacket if the answer is malformed.
+   * @param buffer the buffer storing the answer
+   * @param len the length of the answer
+   * @param buflen the length of the buffer
+   * @return the length of the synthesized answer
    */
-  void synth(const uint8_t *v4, uint8_t *v6);
+  size_t synthesize(uint8_t *buffer, size_t len, size_t buflen);
 };
 
 std::ostream &operator<<(std::ostream &, const Server &);
@@ -0,0 +1,106 @@
+/* mtd64-ng - a lightweight multithreaded C++11 DNS64 server
+ * Based on MTD64 (https://github.com/Yoso89/MTD64)
+ * Copyright (C) 2015  Daniel Bakai <bakaid@kszk.bme.hu>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+#include "socketpool.h"
+#include <algorithm>
+#include <arpa/inet.h>
+#include <atomic>
+#include <cstring>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <utility>
+
+namespace {
+/*
+ * Source of the unique SocketPool identifiers. Identifiers are never reused,
+ * so a stale entry in a per-thread cache can not match a new SocketPool.
+ */
+std::atomic<unsigned long> next_id{1};
+
+/*
+ * Per-thread cache of the free sockets of the pools.
+ */
+thread_local std::vector<std::pair<unsigned long, std::vector<int>>>
+    local_sockets;
+} // namespace
+
+SocketPool::SocketPool(const std::vector<struct in_addr> &servers,
+                       struct timeval timeout)
+    : servers_(servers), timeout_(timeout), id_{next_id++} {}
+
+SocketPool::~SocketPool() {
+  for (int sockfd : sockets_) {
+    close(sockfd);
+  }
+}
+
+std::vector<int> &SocketPool::local() {
+  for (auto &entry : local_sockets) {
+    if (entry.first == id_) {
+      return entry.second;
+    }
+  }
+  local_sockets.emplace_back(id_, std::vector<int>(servers_.size(), -1));
+  return local_sockets.back().second;
+}
+
+int SocketPool::acquire(size_t server) {
+  std::vector<int> &slots = local();
+  int sockfd = slots[server];
+  if (sockfd != -1) {
+    slots[server] = -1;
+    return sockfd;
+  }
+
+  if ((sockfd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1) {
+    return -1;
+  }
+  struct sockaddr_in addr;
+  memset(&addr, 0x00, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(53);
+  addr.sin_addr = servers_[server];
+  /* Only the answers of this recursor are received on the socket */
+  if (setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout_,
+                 sizeof(timeout_)) == -1 ||
+      connect(sockfd, reinterpret_cast<struct sockaddr *>(&addr),
+              sizeof(addr)) == -1) {
+    close(sockfd);
+    return -1;
+  }
+  std::unique_lock<std::mutex> lock{m_};
+  sockets_.push_back(sockfd);
+  return sockfd;
+}
+
+void SocketPool::release(size_t server, int sockfd) {
+  int &slot = local()[server];
+  if (slot == -1) {
+    slot = sockfd;
+    return;
+  }
+  {
+    std::unique_lock<std::mutex> lock{m_};
+    sockets_.erase(std::remove(sockets_.begin(), sockets_.end(), sockfd),
+                   sockets_.end());
+  }
+  close(sockfd);
+}
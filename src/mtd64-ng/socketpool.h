@@ -0,0 +1,96 @@
+/* mtd64-ng - a lightweight multithreaded C++11 DNS64 server
+ * Based on MTD64 (https://github.com/Yoso89/MTD64)
+ * Copyright (C) 2015  Daniel Bakai <bakaid@kszk.bme.hu>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+/** @file
+ *  @brief Header for the SocketPool and related classes.
+ */
+
+#ifndef SOCKETPOOL_H_INCLUDED
+#define SOCKETPOOL_H_INCLUDED
+
+#include <mutex>
+#include <netinet/in.h>
+#include <sys/time.h>
+#include <vector>
+
+/**
+ * Pool of long-lived UDP sockets connect()ed to the recursors.
+ * Every thread borrows its own sockets, so acquiring and returning one does
+ * not need any locking. The pool only takes a lock when a socket is created,
+ * to be able to close all of them in the destructor.
+ */
+class SocketPool {
+private:
+  std::vector<struct in_addr> servers_; /**< The recursors. */
+  struct timeval timeout_;              /**< Receive timeout of the sockets. */
+  unsigned long id_; /**< Unique identifier used by the per-thread lookup. */
+  std::mutex m_;     /**< Mutex for the sockets_ vector. */
+  std::vector<int> sockets_; /**< Every socket created by the pool. */
+
+  /**
+   * Returns the free sockets of the calling thread, one slot for each
+   * recursor (-1 if there is none).
+   * @return the slots
+   */
+  std::vector<int> &local();
+
+public:
+  /**
+   * Constructor.
+   * @param servers the recursors
+   * @param timeout the receive timeout of the sockets
+   */
+  SocketPool(const std::vector<struct in_addr> &servers,
+             struct timeval timeout);
+
+  /**
+   * Destructor.
+   * Closes all sockets.
+   */
+  ~SocketPool();
+
+  /**
+   * Copy constructor, explicitly deleted.
+   */
+  SocketPool(const SocketPool &) = delete;
+
+  /**
+   * Copy assignment operator, explicitly deleted.
+   */
+  SocketPool &operator=(const SocketPool &) = delete;
+
+  /**
+   * Borrows a socket connected to a recursor, creating it if needed.
+   * @param server the index of the recursor
+   * @return the socket (-1 on failure)
+   */
+  int acquire(size_t server);
+
+  /**
+   * Returns a borrowed socket to the calling thread's free sockets.
+   * The socket is closed if the thread already has a free socket to the
+   * recursor.
+   * @param server the index of the recursor
+   * @param sockfd the socket
+   */
+  void release(size_t server, int sockfd);
+};
+
+#endif
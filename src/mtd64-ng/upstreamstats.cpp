@@ -0,0 +1,234 @@
+/* mtd64-ng - a lightweight multithreaded C++11 DNS64 server
+ * Based on MTD64 (https://github.com/Yoso89/MTD64)
+ * Copyright (C) 2015  Daniel Bakai <bakaid@kszk.bme.hu>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+#include "upstreamstats.h"
+
+namespace {
+/*
+ * Number of samples between two updates of the percentile.
+ */
+const uint32_t update_interval = 256;
+
+/*
+ * Maximum number of hedges the budget can save up, in tokens.
+ */
+const long max_tokens = 20 * 100;
+
+/*
+ * Returns the histogram bucket of a round trip time in microseconds.
+ * Values below 4 have their own buckets, the rest are split into four
+ * buckets per octave by the two bits after the leading one.
+ */
+size_t bucket(uint64_t us) {
+  if (us < 4) {
+    return us;
+  }
+  if (us >= (1ULL << 31)) {
+    return UpstreamState::buckets - 1;
+  }
+  int log = 63 - __builtin_clzll(us);
+  return log * 4 + ((us >> (log - 2)) & 3);
+}
+
+/*
+ * Returns the upper bound of a histogram bucket in microseconds.
+ */
+int64_t upperBound(size_t bucket) {
+  if (bucket < 4) {
+    return bucket + 1;
+  }
+  return static_cast<int64_t>(4 + bucket % 4 + 1) << (bucket / 4 - 2);
+}
+} // namespace
+
+UpstreamState::UpstreamState()
+    : samples_{0}, percentile_{0}, srtt_{0}, rttvar_{0}, failures_{0},
+      up_{true} {
+  for (size_t i = 0; i < buckets; i++) {
+    histogram_[i] = 0;
+  }
+}
+
+UpstreamStats::UpstreamStats(size_t servers, unsigned percentile,
+                             unsigned budget, unsigned max_failures)
+    : servers_{servers}, states_{new UpstreamState[servers]},
+      percentile_{percentile}, budget_{static_cast<long>(budget)},
+      tokens_{0}, hedges_{0}, max_failures_{max_failures}, down_{0} {}
+
+void UpstreamStats::sample(size_t server,
+                           std::chrono::steady_clock::duration rtt) {
+  if (server >= servers_) {
+    return;
+  }
+  UpstreamState &state = states_[server];
+  int64_t us =
+      std::chrono::duration_cast<std::chrono::microseconds>(rtt).count();
+  if (us < 0) {
+    us = 0;
+  }
+  smooth(state, us);
+  if (state.failures_.load(std::memory_order_relaxed) != 0) {
+    state.failures_.store(0, std::memory_order_relaxed);
+  }
+  if (!state.up_.load(std::memory_order_relaxed) && !state.up_.exchange(true)) {
+    down_--;
+  }
+  state.histogram_[bucket(us)].fetch_add(1, std::memory_order_relaxed);
+  if ((state.samples_.fetch_add(1, std::memory_order_relaxed) + 1) %
+          update_interval ==
+      0) {
+    update(state);
+  }
+}
+
+void UpstreamStats::update(UpstreamState &state) {
+  uint32_t counts[UpstreamState::buckets];
+  uint64_t total = 0;
+  for (size_t i = 0; i < UpstreamState::buckets; i++) {
+    counts[i] = state.histogram_[i].load(std::memory_order_relaxed);
+    total += counts[i];
+  }
+  uint64_t rank = (total * percentile_ + 99) / 100;
+  uint64_t seen = 0;
+  for (size_t i = 0; i < UpstreamState::buckets; i++) {
+    seen += counts[i];
+    if (seen >= rank) {
+      state.percentile_.store(upperBound(i), std::memory_order_relaxed);
+      break;
+    }
+  }
+  /* Concurrent samples may be lost, which only slightly skews the decay */
+  for (size_t i = 0; i < UpstreamState::buckets; i++) {
+    state.histogram_[i].fetch_sub(counts[i] / 2, std::memory_order_relaxed);
+  }
+}
+
+void UpstreamStats::smooth(UpstreamState &state, int64_t us) {
+  /* Zero is reserved for the recursors without samples */
+  if (us == 0) {
+    us = 1;
+  }
+  int64_t srtt = state.srtt_.load(std::memory_order_relaxed);
+  if (srtt == 0) {
+    state.srtt_.store(us, std::memory_order_relaxed);
+    state.rttvar_.store(us / 2, std::memory_order_relaxed);
+    return;
+  }
+  int64_t err = us - srtt;
+  int64_t rttvar = state.rttvar_.load(std::memory_order_relaxed);
+  state.rttvar_.store(rttvar + ((err < 0 ? -err : err) - rttvar) / 4,
+                      std::memory_order_relaxed);
+  srtt += err / 8;
+  state.srtt_.store(srtt > 0 ? srtt : 1, std::memory_order_relaxed);
+}
+
+void UpstreamStats::timeout(size_t server,
+                            std::chrono::steady_clock::duration timeout) {
+  if (server >= servers_) {
+    return;
+  }
+  UpstreamState &state = states_[server];
+  smooth(state, std::chrono::duration_cast<std::chrono::microseconds>(timeout)
+                    .count());
+  if (state.failures_.fetch_add(1, std::memory_order_relaxed) + 1 >=
+          max_failures_ &&
+      max_failures_ > 0 && state.up_.exchange(false)) {
+    down_++;
+  }
+}
+
+size_t UpstreamStats::fastest(size_t exclude) const {
+  size_t best = exclude;
+  bool best_up = false;
+  int64_t best_srtt = 0;
+  for (size_t i = 0; i < servers_; i++) {
+    if (i == exclude) {
+      continue;
+    }
+    bool up = states_[i].up_.load(std::memory_order_relaxed);
+    int64_t srtt = states_[i].srtt_.load(std::memory_order_relaxed);
+    if (best == exclude || (up && !best_up) ||
+        (up == best_up && srtt < best_srtt)) {
+      best = i;
+      best_up = up;
+      best_srtt = srtt;
+    }
+  }
+  return best;
+}
+
+bool UpstreamStats::up(size_t server) const {
+  return server >= servers_ ||
+         states_[server].up_.load(std::memory_order_relaxed);
+}
+
+unsigned UpstreamStats::down() const {
+  return down_.load(std::memory_order_relaxed);
+}
+
+unsigned UpstreamStats::failures(size_t server) const {
+  return server < servers_
+             ? states_[server].failures_.load(std::memory_order_relaxed)
+             : 0;
+}
+
+int64_t UpstreamStats::srtt(size_t server) const {
+  return server < servers_
+             ? states_[server].srtt_.load(std::memory_order_relaxed)
+             : 0;
+}
+
+int64_t UpstreamStats::rttvar(size_t server) const {
+  return server < servers_
+             ? states_[server].rttvar_.load(std::memory_order_relaxed)
+             : 0;
+}
+
+void UpstreamStats::sent() {
+  long tokens = tokens_.load(std::memory_order_relaxed);
+  while (tokens < max_tokens &&
+         !tokens_.compare_exchange_weak(tokens, tokens + budget_,
+                                        std::memory_order_relaxed)) {
+  }
+}
+
+std::chrono::microseconds UpstreamStats::hedgeDelay(size_t server) const {
+  if (server >= servers_) {
+    return std::chrono::microseconds{0};
+  }
+  return std::chrono::microseconds{
+      states_[server].percentile_.load(std::memory_order_relaxed)};
+}
+
+bool UpstreamStats::hedge() {
+  long tokens = tokens_.load(std::memory_order_relaxed);
+  while (tokens >= 100) {
+    if (tokens_.compare_exchange_weak(tokens, tokens - 100,
+                                      std::memory_order_relaxed)) {
+      hedges_.fetch_add(1, std::memory_order_relaxed);
+      return true;
+    }
+  }
+  return false;
+}
+
+unsigned long UpstreamStats::hedges() const {
+  return hedges_.load(std::memory_order_relaxed);
+}
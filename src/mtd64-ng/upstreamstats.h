@@ -0,0 +1,206 @@
+/* mtd64-ng - a lightweight multithreaded C++11 DNS64 server
+ * Based on MTD64 (https://github.com/Yoso89/MTD64)
+ * Copyright (C) 2015  Daniel Bakai <bakaid@kszk.bme.hu>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+/** @file
+ *  @brief Header for the UpstreamStats and related classes.
+ */
+
+#ifndef UPSTREAMSTATS_H_INCLUDED
+#define UPSTREAMSTATS_H_INCLUDED
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Round trip time statistics of a recursor.
+ * The RTTs are counted in a histogram of quarter-octave buckets, which is
+ * halved after every update of the percentile to follow the recent values.
+ * They are also smoothed the way TCP does (RFC 6298), where a timeout counts
+ * as an RTT of the whole timeout.
+ * A recursor is taken down after a number of consecutive timeouts, and is
+ * brought back by its next answer.
+ */
+struct UpstreamState {
+  static const size_t buckets = 128; /**< Number of histogram buckets. */
+
+  std::atomic<uint32_t> histogram_[buckets]; /**< RTT histogram. */
+  std::atomic<uint32_t> samples_; /**< Number of samples since the start. */
+  std::atomic<int64_t>
+      percentile_; /**< The configured RTT percentile in microseconds (0 if
+                      there are not enough samples yet). */
+  std::atomic<int64_t> srtt_; /**< Smoothed RTT in microseconds (0 before the
+                                 first sample). */
+  std::atomic<int64_t>
+      rttvar_; /**< Smoothed mean deviation of the RTT in microseconds. */
+  std::atomic<unsigned> failures_; /**< Number of consecutive timeouts. */
+  std::atomic<bool> up_; /**< Whether the recursor is used for queries. */
+
+  /**
+   * Constructor.
+   */
+  UpstreamState();
+};
+
+/**
+ * Per-recursor statistics of the upstream queries.
+ * Every method is lock-free, so it can be called from the workers and the
+ * event loops on every query.
+ * It also keeps the budget of the hedged queries: every query adds a share
+ * of a hedge to a token bucket, and every hedge takes one whole.
+ * Finally it is the circuit breaker of the recursors: the selection skips the
+ * recursors which are down, unless all of them are.
+ */
+class UpstreamStats {
+private:
+  size_t servers_; /**< Number of recursors. */
+  std::unique_ptr<UpstreamState[]> states_; /**< State of each recursor. */
+  unsigned percentile_; /**< The RTT percentile used as hedge delay. */
+  long budget_;         /**< Tokens added by a query (100 pay for a hedge). */
+  std::atomic<long> tokens_; /**< The hedge budget. */
+  std::atomic<unsigned long> hedges_; /**< Number of hedged queries. */
+  unsigned max_failures_; /**< Consecutive timeouts taking a recursor down
+                             (0 means never). */
+  std::atomic<unsigned> down_; /**< Number of recursors which are down. */
+
+  /**
+   * Recomputes the percentile of a recursor and halves its histogram.
+   * @param state the state of the recursor
+   */
+  void update(UpstreamState &state);
+
+  /**
+   * Adds a value to the smoothed RTT and deviation of a recursor.
+   * Concurrent updates may overwrite each other, which only loses a sample.
+   * @param state the state of the recursor
+   * @param us the RTT in microseconds
+   */
+  void smooth(UpstreamState &state, int64_t us);
+
+public:
+  /**
+   * Constructor.
+   * @param servers the number of recursors
+   * @param percentile the RTT percentile after which a query is hedged
+   * @param budget the maximum percentage of hedged queries
+   * @param max_failures the number of consecutive timeouts which take a
+   * recursor down (0 means never)
+   */
+  UpstreamStats(size_t servers, unsigned percentile, unsigned budget,
+                unsigned max_failures);
+
+  /**
+   * Copy constructor, explicitly deleted.
+   */
+  UpstreamStats(const UpstreamStats &) = delete;
+
+  /**
+   * Copy assignment operator, explicitly deleted.
+   */
+  UpstreamStats &operator=(const UpstreamStats &) = delete;
+
+  /**
+   * Records the round trip time of an answer.
+   * Brings the recursor back up if it was down.
+   * @param server the index of the recursor
+   * @param rtt the round trip time
+   */
+  void sample(size_t server, std::chrono::steady_clock::duration rtt);
+
+  /**
+   * Records a timed out query.
+   * Only the smoothed RTT is affected, the histogram keeps the answers.
+   * Takes the recursor down after max_failures consecutive timeouts.
+   * @param server the index of the recursor
+   * @param timeout the timeout of the query
+   */
+  void timeout(size_t server, std::chrono::steady_clock::duration timeout);
+
+  /**
+   * Returns the recursor with the lowest smoothed RTT. Recursors without
+   * samples come first, so they are tried as soon as possible, and the ones
+   * which are down come last.
+   * @param exclude the index of a recursor to skip (servers if none)
+   * @return the index of the recursor, or exclude if there is no other
+   */
+  size_t fastest(size_t exclude) const;
+
+  /**
+   * Getter for the smoothed RTT of a recursor.
+   * @param server the index of the recursor
+   * @return the smoothed RTT in microseconds (0 if there is no sample)
+   */
+  int64_t srtt(size_t server) const;
+
+  /**
+   * Getter for the smoothed mean deviation of the RTT of a recursor.
+   * @param server the index of the recursor
+   * @return the deviation in microseconds
+   */
+  int64_t rttvar(size_t server) const;
+
+  /**
+   * Returns whether a recursor is used for queries.
+   * @param server the index of the recursor
+   * @return false if the circuit breaker took the recursor down
+   */
+  bool up(size_t server) const;
+
+  /**
+   * Returns the number of recursors which are down.
+   * @return the number of recursors
+   */
+  unsigned down() const;
+
+  /**
+   * Getter for the number of consecutive timeouts of a recursor.
+   * @param server the index of the recursor
+   * @return the number of timeouts
+   */
+  unsigned failures(size_t server) const;
+
+  /**
+   * Records a query sent to the upstream, adding to the hedge budget.
+   */
+  void sent();
+
+  /**
+   * Returns how long to wait for an answer before hedging a query.
+   * @param server the index of the recursor
+   * @return the delay, or zero if there are not enough samples yet
+   */
+  std::chrono::microseconds hedgeDelay(size_t server) const;
+
+  /**
+   * Takes a hedge from the budget.
+   * @return whether the budget allows a hedge
+   */
+  bool hedge();
+
+  /**
+   * Getter for the number of hedged queries.
+   * @return the number of hedged queries
+   */
+  unsigned long hedges() const;
+};
+
+#endif
@@ -20,47 +20,311 @@
 
 #include "pool.h"
 #include <iostream>
+#include <stdint.h>
 
-WorkerThread::WorkerThread(ThreadPool &pool) : pool_{pool} {}
+namespace {
+/*
+ * Number of times an idle worker polls the lock-free queue before it parks.
+ */
+const int spin_count = 1024;
+
+/*
+ * Hints the CPU that this is a spin-wait loop.
+ */
+inline void cpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#else
+  std::this_thread::yield();
+#endif
+}
+
+/*
+ * The work-stealing pool and the index of the worker running on this thread.
+ */
+thread_local ThreadPool *current_pool = nullptr;
+thread_local size_t current_worker = 0;
+} // namespace
+
+TaskQueue::TaskQueue() : mask_{0}, head_{0}, size_{0} {}
+
+void TaskQueue::grow() {
+  size_t capacity = tasks_ ? (mask_ + 1) * 2 : 16;
+  std::unique_ptr<Task[]> tasks{new Task[capacity]};
+  for (size_t i = 0; i < size_; i++) {
+    tasks[i] = std::move(tasks_[(head_ + i) & mask_]);
+  }
+  tasks_ = std::move(tasks);
+  mask_ = capacity - 1;
+  head_ = 0;
+}
+
+void TaskQueue::push(Task &&task) {
+  if (!tasks_ || size_ == mask_ + 1) {
+    grow();
+  }
+  tasks_[(head_ + size_) & mask_] = std::move(task);
+  size_++;
+}
+
+Task TaskQueue::popFront() {
+  Task task{std::move(tasks_[head_])};
+  head_ = (head_ + 1) & mask_;
+  size_--;
+  return task;
+}
+
+Task TaskQueue::popBack() {
+  size_--;
+  return Task{std::move(tasks_[(head_ + size_) & mask_])};
+}
+
+TaskRing::TaskRing(size_t capacity) : enqueue_pos_{0}, dequeue_pos_{0} {
+  size_t size = 2;
+  while (size < capacity) {
+    size <<= 1;
+  }
+  cells_.reset(new TaskCell[size]);
+  mask_ = size - 1;
+  for (size_t i = 0; i < size; i++) {
+    cells_[i].sequence_.store(i, std::memory_order_relaxed);
+  }
+}
+
+bool TaskRing::push(Task &task) {
+  TaskCell *cell;
+  size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+  while (1) {
+    cell = &cells_[pos & mask_];
+    size_t seq = cell->sequence_.load(std::memory_order_acquire);
+    intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+    if (diff == 0) {
+      if (enqueue_pos_.compare_exchange_weak(pos, pos + 1,
+                                             std::memory_order_relaxed)) {
+        break;
+      }
+    } else if (diff < 0) {
+      /* The cell still holds the task of the previous round */
+      return false;
+    } else {
+      pos = enqueue_pos_.load(std::memory_order_relaxed);
+    }
+  }
+  cell->task_ = std::move(task);
+  cell->sequence_.store(pos + 1, std::memory_order_release);
+  return true;
+}
+
+bool TaskRing::pop(Task &task) {
+  TaskCell *cell;
+  size_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+  while (1) {
+    cell = &cells_[pos & mask_];
+    size_t seq = cell->sequence_.load(std::memory_order_acquire);
+    intptr_t diff =
+        static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+    if (diff == 0) {
+      if (dequeue_pos_.compare_exchange_weak(pos, pos + 1,
+                                             std::memory_order_relaxed)) {
+        break;
+      }
+    } else if (diff < 0) {
+      /* The cell is not published yet */
+      return false;
+    } else {
+      pos = dequeue_pos_.load(std::memory_order_relaxed);
+    }
+  }
+  task = std::move(cell->task_);
+  cell->sequence_.store(pos + mask_ + 1, std::memory_order_release);
+  return true;
+}
+
+size_t TaskRing::size() const {
+  size_t dequeue = dequeue_pos_.load(std::memory_order_relaxed);
+  size_t enqueue = enqueue_pos_.load(std::memory_order_relaxed);
+  return enqueue > dequeue ? enqueue - dequeue : 0;
+}
+
+WorkerThread::WorkerThread(ThreadPool &pool, size_t index)
+    : pool_{pool}, index_{index} {}
 
 void WorkerThread::operator()() {
+  if (pool_.ring_ != nullptr) {
+    pool_.runRing();
+    return;
+  }
+  if (pool_.queues_ != nullptr) {
+    pool_.runStealing(index_);
+    return;
+  }
   while (1) {
     std::unique_lock<std::mutex> lock{pool_.m_};
     while (!pool_.stop_ && pool_.tasks_.size() == 0)
       pool_.work_to_do_.wait(lock);
     if (pool_.stop_)
       break;
-    std::function<void(void)> task = std::move(pool_.tasks_.front());
-    pool_.tasks_.pop_front();
+    Task task = pool_.tasks_.popFront();
     lock.unlock();
     task();
   }
 }
 
-ThreadPool::ThreadPool(size_t n) : stop_{false} {
-  for (int i = 0; i < n; i++) {
-    threads_.push_back(std::thread{WorkerThread{*this}});
+ThreadPool::ThreadPool(size_t n, queueKind queue, size_t capacity)
+    : stop_{false}, ring_{nullptr}, queues_{nullptr}, num_queues_{n},
+      next_queue_{0}, pending_{0}, sleepers_{0},
+      spin_{std::thread::hardware_concurrency() > 1 ? spin_count : 0} {
+  if (queue == LOCKFREE) {
+    ring_ = new TaskRing{capacity};
+  } else if (queue == STEALING && n > 0) {
+    queues_ = new WorkerQueue[n];
+  }
+  for (size_t i = 0; i < n; i++) {
+    threads_.push_back(std::thread{WorkerThread{*this, i}});
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  delete ring_;
+  delete[] queues_;
+}
+
+void ThreadPool::runRing() {
+  Task task;
+  while (!stop_) {
+    bool found = ring_->pop(task);
+    for (int i = 0; !found && i < spin_ && !stop_; i++) {
+      cpuRelax();
+      found = ring_->pop(task);
+    }
+    if (found) {
+      task();
+      task = nullptr;
+      continue;
+    }
+    park();
+  }
+}
+
+void ThreadPool::runStealing(size_t index) {
+  current_pool = this;
+  current_worker = index;
+  Task task;
+  while (!stop_) {
+    bool found = take(index, task);
+    for (int i = 0; !found && i < spin_ && !stop_; i++) {
+      cpuRelax();
+      found = pending_.load(std::memory_order_relaxed) > 0 && take(index, task);
+    }
+    if (found) {
+      task();
+      task = nullptr;
+      continue;
+    }
+    park();
+  }
+}
+
+bool ThreadPool::take(size_t index, Task &task) {
+  {
+    WorkerQueue &own = queues_[index];
+    std::unique_lock<std::mutex> lock{own.m_};
+    if (!own.tasks_.empty()) {
+      task = own.tasks_.popFront();
+      pending_.fetch_sub(1, std::memory_order_relaxed);
+      return true;
+    }
+  }
+  /* Stealing the newest task of a peer, the owner keeps the older ones */
+  for (size_t i = 1; i < num_queues_; i++) {
+    WorkerQueue &victim = queues_[(index + i) % num_queues_];
+    std::unique_lock<std::mutex> lock{victim.m_, std::try_to_lock};
+    if (lock.owns_lock() && !victim.tasks_.empty()) {
+      task = victim.tasks_.popBack();
+      pending_.fetch_sub(1, std::memory_order_relaxed);
+      return true;
+    }
   }
+  return false;
 }
 
-ThreadPool::~ThreadPool() {}
+bool ThreadPool::idle() const {
+  if (ring_ != nullptr) {
+    return ring_->size() == 0;
+  }
+  return pending_.load(std::memory_order_relaxed) == 0;
+}
 
-void ThreadPool::addTask(std::function<void(void)> &&task) {
+void ThreadPool::park() {
+  /* Either wake() sees the sleeper, or we see its task */
   std::unique_lock<std::mutex> lock{m_};
-  tasks_.push_back(std::move(task));
+  sleepers_.fetch_add(1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (!stop_ && idle()) {
+    work_to_do_.wait(lock);
+  }
+  sleepers_.fetch_sub(1, std::memory_order_relaxed);
+}
+
+void ThreadPool::wake() {
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (sleepers_.load(std::memory_order_relaxed) > 0) {
+    /* The worker is either waiting or has not checked the queue yet */
+    { std::unique_lock<std::mutex> lock{m_}; }
+    work_to_do_.notify_one();
+  }
+}
+
+void ThreadPool::addTask(Task &&task) {
+  if (ring_ != nullptr) {
+    while (!ring_->push(task)) {
+      if (stop_) {
+        return;
+      }
+      std::this_thread::yield();
+    }
+    wake();
+    return;
+  }
+  if (queues_ != nullptr) {
+    size_t index = current_pool == this
+                       ? current_worker
+                       : next_queue_.fetch_add(1, std::memory_order_relaxed) %
+                             num_queues_;
+    {
+      WorkerQueue &queue = queues_[index];
+      std::unique_lock<std::mutex> lock{queue.m_};
+      queue.tasks_.push(std::move(task));
+      pending_.fetch_add(1, std::memory_order_relaxed);
+    }
+    wake();
+    return;
+  }
+  std::unique_lock<std::mutex> lock{m_};
+  tasks_.push(std::move(task));
   lock.unlock();
   work_to_do_.notify_one();
 }
 
 void ThreadPool::stop() {
   stop_ = true;
+  /* Not notifying a worker between its check of stop_ and its wait */
+  { std::unique_lock<std::mutex> lock{m_}; }
   work_to_do_.notify_all();
   for (auto &thread : threads_) {
-    thread.join();
+    if (thread.joinable()) {
+      thread.join();
+    }
   }
 }
 
 size_t ThreadPool::size() {
+  if (ring_ != nullptr) {
+    return ring_->size();
+  }
+  if (queues_ != nullptr) {
+    return pending_.load(std::memory_order_relaxed);
+  }
   std::unique_lock<std::mutex> lock{m_};
   return tasks_.size();
 }
@@ -27,14 +27,320 @@
 
 #include <atomic>
 #include <condition_variable>
-#include <deque>
+#include <cstddef>
 #include <functional>
+#include <memory>
 #include <mutex>
+#include <new>
 #include <thread>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
 class ThreadPool;
 
+/**
+ * Move-only task of a ThreadPool.
+ * Like std::function<void(void)>, it holds any callable, but the callable
+ * only has to be movable, and if it is at most capacity bytes (a Query) and
+ * can be moved without exceptions, it is stored inline, so queueing a task
+ * does not allocate. Larger callables are stored on the heap.
+ */
+class Task {
+public:
+  static const size_t capacity = 192; /**< Size of the inline storage. */
+
+  /**
+   * Tells whether a callable type is stored inline.
+   */
+  template <typename F> struct fits {
+    static const bool value =
+        sizeof(F) <= capacity && alignof(F) <= alignof(std::max_align_t) &&
+        std::is_nothrow_move_constructible<F>::value; /**< The result. */
+  };
+
+private:
+  /**
+   * Operations of the stored callable type.
+   */
+  struct Ops {
+    void (*invoke_)(void *);          /**< Calls the callable. */
+    void (*move_)(void *, void *);    /**< Moves the callable from the second
+                                         storage to the first. */
+    void (*destroy_)(void *);         /**< Destroys the callable. */
+  };
+
+  /**
+   * Operations of a callable stored inline.
+   */
+  template <typename F> struct InlineOps {
+    static void invoke(void *p) { (*static_cast<F *>(p))(); }
+    static void move(void *dst, void *src) {
+      new (dst) F(std::move(*static_cast<F *>(src)));
+      static_cast<F *>(src)->~F();
+    }
+    static void destroy(void *p) { static_cast<F *>(p)->~F(); }
+    static const Ops ops; /**< The operations. */
+  };
+
+  /**
+   * Operations of a callable stored on the heap.
+   */
+  template <typename F> struct HeapOps {
+    static void invoke(void *p) { (**static_cast<F **>(p))(); }
+    static void move(void *dst, void *src) {
+      new (dst) F *(*static_cast<F **>(src));
+    }
+    static void destroy(void *p) { delete *static_cast<F **>(p); }
+    static const Ops ops; /**< The operations. */
+  };
+
+  typename std::aligned_storage<capacity, alignof(std::max_align_t)>::type
+      storage_;     /**< The callable, or a pointer to it. */
+  const Ops *ops_; /**< Operations of the callable (nullptr if empty). */
+
+  /**
+   * Stores a callable inline.
+   */
+  template <typename F, typename G> void init(G &&f, std::true_type) {
+    new (&storage_) F(std::forward<G>(f));
+    ops_ = &InlineOps<F>::ops;
+  }
+
+  /**
+   * Stores a callable on the heap.
+   */
+  template <typename F, typename G> void init(G &&f, std::false_type) {
+    new (&storage_) F *(new F(std::forward<G>(f)));
+    ops_ = &HeapOps<F>::ops;
+  }
+
+public:
+  /**
+   * Constructor of an empty task.
+   */
+  Task() noexcept : ops_{nullptr} {}
+
+  /**
+   * Constructor.
+   * @param f the callable: a function, a functor or a lambda
+   */
+  template <typename F,
+            typename = typename std::enable_if<!std::is_same<
+                typename std::decay<F>::type, Task>::value>::type>
+  Task(F &&f) : ops_{nullptr} {
+    typedef typename std::decay<F>::type Callable;
+    init<Callable>(std::forward<F>(f),
+                   std::integral_constant<bool, fits<Callable>::value>());
+  }
+
+  /**
+   * Move constructor.
+   */
+  Task(Task &&rhs) noexcept : ops_{rhs.ops_} {
+    if (ops_ != nullptr) {
+      ops_->move_(&storage_, &rhs.storage_);
+      rhs.ops_ = nullptr;
+    }
+  }
+
+  /**
+   * Move assignment operator.
+   */
+  Task &operator=(Task &&rhs) noexcept {
+    if (this != &rhs) {
+      *this = nullptr;
+      if (rhs.ops_ != nullptr) {
+        rhs.ops_->move_(&storage_, &rhs.storage_);
+        ops_ = rhs.ops_;
+        rhs.ops_ = nullptr;
+      }
+    }
+    return *this;
+  }
+
+  /**
+   * Destroys the callable, leaving the task empty.
+   */
+  Task &operator=(std::nullptr_t) noexcept {
+    if (ops_ != nullptr) {
+      ops_->destroy_(&storage_);
+      ops_ = nullptr;
+    }
+    return *this;
+  }
+
+  /**
+   * Copy constructor, explicitly deleted.
+   */
+  Task(const Task &) = delete;
+
+  /**
+   * Copy assignment operator, explicitly deleted.
+   */
+  Task &operator=(const Task &) = delete;
+
+  /**
+   * Destructor.
+   */
+  ~Task() { *this = nullptr; }
+
+  /**
+   * Calls the callable.
+   */
+  void operator()() { ops_->invoke_(&storage_); }
+
+  /**
+   * Returns whether the task holds a callable.
+   */
+  explicit operator bool() const { return ops_ != nullptr; }
+};
+
+template <typename F>
+const Task::Ops Task::InlineOps<F>::ops = {&Task::InlineOps<F>::invoke,
+                                           &Task::InlineOps<F>::move,
+                                           &Task::InlineOps<F>::destroy};
+
+template <typename F>
+const Task::Ops Task::HeapOps<F>::ops = {&Task::HeapOps<F>::invoke,
+                                         &Task::HeapOps<F>::move,
+                                         &Task::HeapOps<F>::destroy};
+
+/**
+ * Unbounded FIFO queue of tasks.
+ * A circular buffer which doubles when it is full, so unlike a std::deque it
+ * does not allocate and free blocks as the tasks come and go.
+ */
+class TaskQueue {
+private:
+  std::unique_ptr<Task[]> tasks_; /**< The buffer. */
+  size_t mask_;                   /**< Capacity minus one (capacity is a power
+                                     of two, or zero). */
+  size_t head_;                   /**< Index of the first task. */
+  size_t size_;                   /**< Number of tasks. */
+
+  /**
+   * Doubles the buffer.
+   */
+  void grow();
+
+public:
+  /**
+   * Constructor.
+   */
+  TaskQueue();
+
+  /**
+   * Returns whether the queue is empty.
+   * @return whether the queue is empty
+   */
+  bool empty() const { return size_ == 0; }
+
+  /**
+   * Getter for the number of tasks.
+   * @return the number of tasks
+   */
+  size_t size() const { return size_; }
+
+  /**
+   * Adds a task to the back of the queue.
+   * @param task the task
+   */
+  void push(Task &&task);
+
+  /**
+   * Takes the task from the front of the queue, which must not be empty.
+   * @return the task
+   */
+  Task popFront();
+
+  /**
+   * Takes the task from the back of the queue, which must not be empty.
+   * @return the task
+   */
+  Task popBack();
+};
+
+/**
+ * A cell of TaskRing.
+ */
+struct TaskCell {
+  std::atomic<size_t> sequence_; /**< The turn of the cell (see TaskRing). */
+  Task task_;                    /**< The task in the cell. */
+};
+
+/**
+ * Bounded lock-free multi-producer multi-consumer task queue.
+ * Dmitry Vyukov's ring: every cell has a sequence number telling whose turn
+ * it is. A producer claims the cell at the enqueue position when its
+ * sequence equals the position, and publishes the task by advancing the
+ * sequence by one. A consumer claims the cell at the dequeue position when
+ * its sequence is one ahead, and frees it for the next round by advancing the
+ * sequence by the capacity. Producers and consumers only contend on their
+ * own position.
+ */
+class TaskRing {
+private:
+  std::unique_ptr<TaskCell[]> cells_; /**< The cells. */
+  size_t mask_;                       /**< Capacity minus one. */
+  char pad0_[64];                     /**< Keeps the positions on their own
+                                         cache lines. */
+  std::atomic<size_t> enqueue_pos_;   /**< Next cell to push into. */
+  char pad1_[64];                     /**< Keeps the positions on their own
+                                         cache lines. */
+  std::atomic<size_t> dequeue_pos_;   /**< Next cell to pop from. */
+  char pad2_[64];                     /**< Keeps the positions on their own
+                                         cache lines. */
+
+public:
+  /**
+   * Constructor.
+   * @param capacity the number of cells, rounded up to a power of two
+   */
+  TaskRing(size_t capacity);
+
+  /**
+   * Copy constructor, explicitly deleted.
+   */
+  TaskRing(const TaskRing &) = delete;
+
+  /**
+   * Copy assignment operator, explicitly deleted.
+   */
+  TaskRing &operator=(const TaskRing &) = delete;
+
+  /**
+   * Adds a task to the ring.
+   * @param task the task, moved from only if it is added
+   * @return false if the ring is full
+   */
+  bool push(Task &task);
+
+  /**
+   * Takes a task from the ring.
+   * @param task the function to move the task into
+   * @return false if the ring is empty
+   */
+  bool pop(Task &task);
+
+  /**
+   * Returns the number of tasks in the ring.
+   * Counts the tasks being pushed as well, so it is never below the number
+   * of tasks a pop can find.
+   * @return the number of tasks
+   */
+  size_t size() const;
+};
+
+/**
+ * The own task queue of a worker in a work-stealing ThreadPool.
+ */
+struct WorkerQueue {
+  std::mutex m_;                                /**< Mutex for the queue. */
+  TaskQueue tasks_; /**< The tasks. */
+  char pad_[64]; /**< Keeps the queues on their own cache lines. */
+};
+
 /**
  * A worker thread class for ThreadPool.
  * This functor is used to start the main loop in the threads of the pool.
@@ -42,12 +348,14 @@ class ThreadPool;
 class WorkerThread {
 private:
   ThreadPool &pool_; /**< The parent pool. */
+  size_t index_;     /**< The index of the worker in the pool. */
 public:
   /**
    * Constructor.
    * @param pool the parent ThreadPool
+   * @param index the index of the worker in the pool
    */
-  WorkerThread(ThreadPool &pool);
+  WorkerThread(ThreadPool &pool, size_t index);
 
   /**
    * Function call operator to make this class a functor.
@@ -59,27 +367,100 @@ public:
 /**
  * Main class for thread pool implementation.
  * Starts the configured number of threads, then queues and executes the tasks.
+ * The tasks are queued either in a deque protected by a mutex, or in a
+ * lock-free TaskRing. With the ring, an idle worker spins for a while before
+ * it parks on the condition variable, and the producers only take the mutex
+ * to wake up a parked worker.
+ * The work-stealing scheduler gives every worker its own queue. The tasks
+ * added by a worker go to its own queue, so they stay on its core, the
+ * others are spread over the queues round-robin. A worker runs the tasks of
+ * its own queue in order, and steals from the back of the others' when it is
+ * empty.
  */
 class ThreadPool {
+public:
+  /**
+   * Enum for the task queue engine.
+   */
+  enum queueKind {
+    MUTEX,    /**< unbounded deque protected by a mutex */
+    LOCKFREE, /**< bounded lock-free ring (TaskRing) */
+    STEALING  /**< a deque per worker, with work stealing */
+  };
+
 private:
   /*
    * WorkerThread uses the ThreadPool
    */
   friend class WorkerThread;
   std::vector<std::thread> threads_;            /**< The threads of the pool. */
-  std::deque<std::function<void(void)>> tasks_; /**< The task queue. */
+  TaskQueue tasks_;                   /**< The task queue. */
   std::mutex m_;                       /**< Mutex for the ThreadPool. */
   std::condition_variable work_to_do_; /**< Condition variable to signal
                                           avaliable tasks to sleeping workers.
                                         */
   std::atomic<bool>
       stop_; /**< Atomic variable used to thread-safely stop the pool. */
+  TaskRing *ring_; /**< The lock-free task queue (nullptr if the deque is
+                      used). */
+  WorkerQueue *queues_; /**< The queues of the workers (nullptr if they do not
+                           steal work). */
+  size_t num_queues_;   /**< Number of queues in queues_. */
+  std::atomic<size_t> next_queue_; /**< Next queue of the tasks added from
+                                      outside of the pool. */
+  std::atomic<size_t> pending_; /**< Number of tasks in queues_. */
+  std::atomic<unsigned> sleepers_; /**< Number of workers parked on the
+                                      condition variable (ring and work
+                                      stealing only). */
+  int spin_; /**< Number of polls of an idle worker before it parks (0 on a
+                 single CPU, where spinning only delays the producer). */
+
+  /**
+   * Main loop of a worker with the lock-free task queue.
+   */
+  void runRing();
+
+  /**
+   * Main loop of a worker with work stealing.
+   * @param index the index of the worker
+   */
+  void runStealing(size_t index);
+
+  /**
+   * Takes a task from the queue of a worker, or from its peers.
+   * @param index the index of the worker
+   * @param task the function to move the task into
+   * @return false if every queue is empty
+   */
+  bool take(size_t index, Task &task);
+
+  /**
+   * Returns whether there is no task to run (ring and work stealing only).
+   * May count the tasks being added, never misses an added one.
+   * @return whether the queue is empty
+   */
+  bool idle() const;
+
+  /**
+   * Parks the calling worker until a task is added, unless there is one
+   * already (ring and work stealing only).
+   */
+  void park();
+
+  /**
+   * Wakes up a parked worker after a task is added (ring and work stealing
+   * only).
+   */
+  void wake();
+
 public:
   /**
    * Constructor
    * @param n the number of threads to start (default: 10)
+   * @param queue the task queue engine (default: MUTEX)
+   * @param capacity the capacity of the lock-free task queue (default: 16384)
    */
-  ThreadPool(size_t n = 10);
+  ThreadPool(size_t n = 10, queueKind queue = MUTEX, size_t capacity = 16384);
 
   /**
    * Destructor.
@@ -88,12 +469,14 @@ public:
 
   /**
    * Adds a task to the queue.
-   * Using the std::function template and the move semantics enables
-   * this function to efficiently add a function, functor or lambda expression
-   * to the task queue.
+   * Using the Task type and the move semantics enables this function to
+   * efficiently add a function, functor or lambda expression to the task
+   * queue, without allocating if it fits in a Task.
+   * If the lock-free task queue is full, waits until a worker makes room.
+   * With work stealing, a task added by a worker is queued for itself.
    * @param task the task to add: a function, a functor or a lambda
    */
-  void addTask(std::function<void(void)> &&task);
+  void addTask(Task &&task);
 
   /**
    * Stops the pool.
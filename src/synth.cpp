@@ -0,0 +1,183 @@
+/* mtd64-ng - a lightweight multithreaded C++11 DNS64 server
+ * Based on MTD64 (https://github.com/Yoso89/MTD64)
+ * Copyright (C) 2015  Daniel Bakai <bakaid@kszk.bme.hu>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+#include "synth.h"
+#include <arpa/inet.h>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SYNTH_SSSE3
+#include <tmmintrin.h>
+#endif
+
+namespace {
+/*
+ * Returns the position of byte i of the IPv4 address in the IPv6 address.
+ * The address follows the prefix, skipping bits 64 to 71, except after a
+ * 96 bit prefix, where it is the suffix (RFC 6052 2.2).
+ */
+constexpr size_t position(unsigned length, size_t i) {
+  return length == 96 ? 12 + i
+                      : (length / 8 + i < 8 ? length / 8 + i
+                                            : length / 8 + i + 1);
+}
+
+/*
+ * Synthesizes an address, the stores go to constant positions.
+ */
+template <unsigned Length>
+void synthesizeOne(const uint8_t *prefix, const uint8_t *v4, uint8_t *v6) {
+  memcpy(v6, prefix, 16);
+  v6[position(Length, 0)] = v4[0];
+  v6[position(Length, 1)] = v4[1];
+  v6[position(Length, 2)] = v4[2];
+  v6[position(Length, 3)] = v4[3];
+}
+
+/*
+ * Synthesizes a batch of addresses one by one.
+ */
+template <unsigned Length>
+void synthesizeBatch(const uint8_t *prefix, const uint8_t *v4, uint8_t *v6,
+                     size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    synthesizeOne<Length>(prefix, v4 + 4 * i, v6 + 16 * i);
+  }
+}
+
+#ifdef SYNTH_SSSE3
+/*
+ * Returns the byte of the source register shuffled into byte of the IPv6
+ * address of the address-th IPv4 address, or -128 for a zero byte.
+ */
+constexpr char shuffle(unsigned length, size_t byte, size_t address,
+                       size_t i = 0) {
+  return i == 4 ? -128
+                : (position(length, i) == byte
+                       ? static_cast<char>(4 * address + i)
+                       : shuffle(length, byte, address, i + 1));
+}
+
+/*
+ * Returns the shuffle mask moving the address-th IPv4 address of a register
+ * into its place in the IPv6 address. The mask is a constant.
+ */
+template <unsigned Length, size_t Address>
+__attribute__((target("ssse3"))) inline __m128i mask() {
+  return _mm_setr_epi8(
+      shuffle(Length, 0, Address), shuffle(Length, 1, Address),
+      shuffle(Length, 2, Address), shuffle(Length, 3, Address),
+      shuffle(Length, 4, Address), shuffle(Length, 5, Address),
+      shuffle(Length, 6, Address), shuffle(Length, 7, Address),
+      shuffle(Length, 8, Address), shuffle(Length, 9, Address),
+      shuffle(Length, 10, Address), shuffle(Length, 11, Address),
+      shuffle(Length, 12, Address), shuffle(Length, 13, Address),
+      shuffle(Length, 14, Address), shuffle(Length, 15, Address));
+}
+
+/*
+ * Synthesizes a batch of addresses with SSSE3. Four IPv4 addresses are
+ * loaded at once and shuffled into the prefix one by one.
+ */
+template <unsigned Length>
+__attribute__((target("ssse3"))) void
+synthesizeBatchSsse3(const uint8_t *prefix, const uint8_t *v4, uint8_t *v6,
+                     size_t count) {
+  const __m128i base =
+      _mm_loadu_si128(reinterpret_cast<const __m128i *>(prefix));
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m128i addresses =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(v4 + 4 * i));
+    __m128i *out = reinterpret_cast<__m128i *>(v6 + 16 * i);
+    _mm_storeu_si128(
+        out, _mm_or_si128(base, _mm_shuffle_epi8(addresses,
+                                                 mask<Length, 0>())));
+    _mm_storeu_si128(
+        out + 1, _mm_or_si128(base, _mm_shuffle_epi8(addresses,
+                                                     mask<Length, 1>())));
+    _mm_storeu_si128(
+        out + 2, _mm_or_si128(base, _mm_shuffle_epi8(addresses,
+                                                     mask<Length, 2>())));
+    _mm_storeu_si128(
+        out + 3, _mm_or_si128(base, _mm_shuffle_epi8(addresses,
+                                                     mask<Length, 3>())));
+  }
+  for (; i < count; i++) {
+    int32_t address;
+    memcpy(&address, v4 + 4 * i, sizeof(address));
+    _mm_storeu_si128(
+        reinterpret_cast<__m128i *>(v6 + 16 * i),
+        _mm_or_si128(base, _mm_shuffle_epi8(_mm_cvtsi32_si128(address),
+                                            mask<Length, 0>())));
+  }
+}
+#endif
+} // namespace
+
+template <unsigned Length> void PrefixSynthesizer::kernels() {
+  single_ = &synthesizeOne<Length>;
+  batch_ = &synthesizeBatch<Length>;
+#ifdef SYNTH_SSSE3
+  if (simd_) {
+    batch_ = &synthesizeBatchSsse3<Length>;
+  }
+#endif
+}
+
+PrefixSynthesizer::PrefixSynthesizer(bool simd) : simd_{false} {
+#ifdef SYNTH_SSSE3
+  simd_ = simd && __builtin_cpu_supports("ssse3");
+#endif
+  struct in6_addr prefix;
+  inet_pton(AF_INET6, "64:ff9b::", &prefix);
+  this->prefix(prefix, 96);
+}
+
+bool PrefixSynthesizer::prefix(const struct in6_addr &prefix,
+                               unsigned length) {
+  switch (length) {
+  case 32:
+    kernels<32>();
+    break;
+  case 40:
+    kernels<40>();
+    break;
+  case 48:
+    kernels<48>();
+    break;
+  case 56:
+    kernels<56>();
+    break;
+  case 64:
+    kernels<64>();
+    break;
+  case 96:
+    kernels<96>();
+    break;
+  default:
+    return false;
+  }
+  memset(prefix_, 0x00, sizeof(prefix_));
+  memcpy(prefix_, prefix.s6_addr, length / 8);
+  return true;
+}
+
+bool PrefixSynthesizer::simd() const { return simd_; }
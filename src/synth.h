@@ -0,0 +1,97 @@
+/* mtd64-ng - a lightweight multithreaded C++11 DNS64 server
+ * Based on MTD64 (https://github.com/Yoso89/MTD64)
+ * Copyright (C) 2015  Daniel Bakai <bakaid@kszk.bme.hu>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+/** @file
+ *  @brief Header for the PrefixSynthesizer.
+ */
+
+#ifndef SYNTH_H_INCLUDED
+#define SYNTH_H_INCLUDED
+
+#include <netinet/in.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Synthesizer of IPv4-embedded IPv6 addresses (RFC 6052 2.2).
+ * Every supported prefix length has its own kernel, a template in which the
+ * positions of the IPv4 bytes are constants, so there is no branch on the
+ * prefix length when an address is synthesized. The kernel is chosen once,
+ * when the prefix is set.
+ * Batches of addresses are synthesized with SSSE3 byte shuffles if the CPU
+ * supports them, four addresses per load.
+ */
+class PrefixSynthesizer {
+private:
+  uint8_t prefix_[16]; /**< The prefix, zeroed after its length. */
+  bool simd_;          /**< Whether the batches use SSSE3. */
+  void (*single_)(const uint8_t *, const uint8_t *,
+                  uint8_t *); /**< Kernel of a single address. */
+  void (*batch_)(const uint8_t *, const uint8_t *, uint8_t *,
+                 size_t); /**< Kernel of a batch of addresses. */
+
+  /**
+   * Selects the kernels of a prefix length.
+   */
+  template <unsigned Length> void kernels();
+
+public:
+  /**
+   * Constructor.
+   * Sets the well-known prefix 64:ff9b::/96 (RFC 6052 2.1).
+   * @param simd whether to use SSSE3 for the batches if the CPU supports it
+   */
+  PrefixSynthesizer(bool simd = true);
+
+  /**
+   * Sets the prefix and selects its kernels.
+   * @param prefix the prefix
+   * @param length the length of the prefix in bits
+   * @return false if the length is not 32, 40, 48, 56, 64 or 96
+   */
+  bool prefix(const struct in6_addr &prefix, unsigned length);
+
+  /**
+   * Returns whether the batches use SSSE3.
+   * @return true if the SIMD kernels are used
+   */
+  bool simd() const;
+
+  /**
+   * Synthesizes an IPv6 address.
+   * @param v4 the IPv4 address in network byte order (4 bytes)
+   * @param v6 the buffer of the IPv6 address (16 bytes)
+   */
+  void operator()(const uint8_t *v4, uint8_t *v6) const {
+    single_(prefix_, v4, v6);
+  }
+
+  /**
+   * Synthesizes a batch of IPv6 addresses.
+   * @param v4 the IPv4 addresses in network byte order (4 bytes each)
+   * @param v6 the buffer of the IPv6 addresses (16 bytes each)
+   * @param count the number of addresses
+   */
+  void operator()(const uint8_t *v4, uint8_t *v6, size_t count) const {
+    batch_(prefix_, v4, v6, count);
+  }
+};
+
+#endif
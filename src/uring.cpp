@@ -0,0 +1,350 @@
+/* mtd64-ng - a lightweight multithreaded C++11 DNS64 server
+ * Based on MTD64 (https://github.com/Yoso89/MTD64)
+ * Copyright (C) 2015  Daniel Bakai <bakaid@kszk.bme.hu>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+#include "uring.h"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <poll.h>
+#include <sstream>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace {
+/*
+ * user_data values of the requests of a URingReceiver.
+ */
+enum : uint64_t { RECVMSG = 0, SHUTDOWN = 1 };
+} // namespace
+
+URingException::URingException(std::string what) : what_{what} {}
+
+const char *URingException::what() const noexcept { return what_.c_str(); }
+
+IOUring::IOUring(unsigned entries)
+    : fd_{-1}, sq_ptr_{MAP_FAILED}, sq_size_{0}, cq_ptr_{MAP_FAILED},
+      cq_size_{0}, sqes_{nullptr}, sqes_size_{0}, sqe_tail_{0},
+      to_submit_{0} {
+  struct io_uring_params p;
+  memset(&p, 0x00, sizeof(p));
+  if ((fd_ = syscall(__NR_io_uring_setup, entries, &p)) == -1) {
+    std::stringstream ss;
+    ss << "Unable to create io_uring: " << strerror(errno);
+    throw URingException{ss.str()};
+  }
+  sq_size_ = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  cq_size_ = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  /* Since 5.4 both rings are in one mapping */
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    sq_size_ = cq_size_ = std::max(sq_size_, cq_size_);
+  }
+  sq_ptr_ = mmap(nullptr, sq_size_, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+  if (sq_ptr_ == MAP_FAILED) {
+    cleanup();
+    throw URingException{"Unable to map the io_uring submission queue"};
+  }
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    cq_ptr_ = sq_ptr_;
+  } else {
+    cq_ptr_ = mmap(nullptr, cq_size_, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_CQ_RING);
+    if (cq_ptr_ == MAP_FAILED) {
+      cleanup();
+      throw URingException{"Unable to map the io_uring completion queue"};
+    }
+  }
+  sqes_size_ = p.sq_entries * sizeof(struct io_uring_sqe);
+  void *sqes = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED) {
+    cleanup();
+    throw URingException{"Unable to map the io_uring submission entries"};
+  }
+  sqes_ = static_cast<struct io_uring_sqe *>(sqes);
+
+  uint8_t *sq = static_cast<uint8_t *>(sq_ptr_);
+  sq_head_ = reinterpret_cast<unsigned *>(sq + p.sq_off.head);
+  sq_tail_ = reinterpret_cast<unsigned *>(sq + p.sq_off.tail);
+  sq_mask_ = *reinterpret_cast<unsigned *>(sq + p.sq_off.ring_mask);
+  sq_entries_ = p.sq_entries;
+  sq_array_ = reinterpret_cast<unsigned *>(sq + p.sq_off.array);
+  sqe_tail_ = *sq_tail_;
+
+  uint8_t *cq = static_cast<uint8_t *>(cq_ptr_);
+  cq_head_ = reinterpret_cast<unsigned *>(cq + p.cq_off.head);
+  cq_tail_ = reinterpret_cast<unsigned *>(cq + p.cq_off.tail);
+  cq_mask_ = *reinterpret_cast<unsigned *>(cq + p.cq_off.ring_mask);
+  cqes_ = reinterpret_cast<struct io_uring_cqe *>(cq + p.cq_off.cqes);
+}
+
+IOUring::~IOUring() { cleanup(); }
+
+void IOUring::cleanup() {
+  if (sqes_ != nullptr) {
+    munmap(sqes_, sqes_size_);
+  }
+  if (cq_ptr_ != MAP_FAILED && cq_ptr_ != sq_ptr_) {
+    munmap(cq_ptr_, cq_size_);
+  }
+  if (sq_ptr_ != MAP_FAILED) {
+    munmap(sq_ptr_, sq_size_);
+  }
+  if (fd_ != -1) {
+    close(fd_);
+  }
+}
+
+int IOUring::fd() const { return fd_; }
+
+struct io_uring_sqe *IOUring::getSqe() {
+  unsigned head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+  if (sqe_tail_ - head >= sq_entries_) {
+    return nullptr;
+  }
+  unsigned index = sqe_tail_ & sq_mask_;
+  struct io_uring_sqe *sqe = &sqes_[index];
+  memset(sqe, 0x00, sizeof(*sqe));
+  sq_array_[index] = index;
+  sqe_tail_++;
+  to_submit_++;
+  return sqe;
+}
+
+int IOUring::submit(unsigned wait_nr) {
+  if (to_submit_ == 0 && wait_nr == 0) {
+    return 0;
+  }
+  __atomic_store_n(sq_tail_, sqe_tail_, __ATOMIC_RELEASE);
+  int res = syscall(__NR_io_uring_enter, fd_, to_submit_, wait_nr,
+                    wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+  if (res >= 0) {
+    to_submit_ -= res;
+  }
+  return res;
+}
+
+struct io_uring_cqe *IOUring::peek() {
+  unsigned head = *cq_head_;
+  if (head == __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) {
+    return nullptr;
+  }
+  return &cqes_[head & cq_mask_];
+}
+
+void IOUring::seen() {
+  __atomic_store_n(cq_head_, *cq_head_ + 1, __ATOMIC_RELEASE);
+}
+
+URingReceiver::URingReceiver(int sockfd, size_t batch_size, size_t maxlen,
+                             unsigned nbufs)
+    : sockfd_{sockfd}, batch_size_{batch_size > 0 ? batch_size : 1},
+      maxlen_{maxlen}, ring_{8}, armed_{false}, nbufs_{1}, buffers_{nullptr},
+      br_{nullptr}, br_size_{0}, br_tail_{0}, free_{0} {
+  /* The ring size must be a power of 2, and its tail is 16 bits wide */
+  while (nbufs_ < nbufs && nbufs_ < 32768) {
+    nbufs_ <<= 1;
+  }
+  /* Every buffer starts with the recvmsg header and the sender address */
+  buf_size_ = sizeof(struct io_uring_recvmsg_out) +
+              sizeof(struct sockaddr_in6) + maxlen_;
+
+  memset(&msg_, 0x00, sizeof(msg_));
+  msg_.msg_namelen = sizeof(struct sockaddr_in6);
+
+  br_size_ = nbufs_ * sizeof(struct io_uring_buf);
+  void *br = mmap(nullptr, br_size_, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (br == MAP_FAILED) {
+    throw URingException{"Unable to allocate the buffer ring"};
+  }
+  br_ = static_cast<struct io_uring_buf_ring *>(br);
+  memset(br_, 0x00, br_size_);
+
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0x00, sizeof(reg));
+  reg.ring_addr = reinterpret_cast<uintptr_t>(br_);
+  reg.ring_entries = nbufs_;
+  reg.bgid = 0;
+  if (syscall(__NR_io_uring_register, ring_.fd(), IORING_REGISTER_PBUF_RING,
+              &reg, 1) == -1) {
+    std::stringstream ss;
+    ss << "Unable to register the buffer ring: " << strerror(errno);
+    munmap(br_, br_size_);
+    throw URingException{ss.str()};
+  }
+
+  buffers_ = new uint8_t[nbufs_ * buf_size_];
+  for (unsigned i = 0; i < nbufs_; i++) {
+    provide(i);
+  }
+  packets_.reserve(batch_size_);
+
+  /*
+   * The multishot recvmsg does not complete when the socket is shut down,
+   * so the receive loop is woken up by a separate poll for that.
+   */
+  struct io_uring_sqe *sqe = ring_.getSqe();
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = sockfd_;
+  sqe->poll32_events = POLLRDHUP;
+  sqe->user_data = SHUTDOWN;
+
+  /* Kernels before 6.0 reject the multishot recvmsg right away */
+  arm();
+  struct io_uring_cqe *cqe;
+  if (ring_.submit(0) == -1 ||
+      ((cqe = ring_.peek()) != nullptr && cqe->res == -EINVAL)) {
+    delete[] buffers_;
+    munmap(br_, br_size_);
+    throw URingException{"Multishot recvmsg is not supported by the kernel"};
+  }
+}
+
+URingReceiver::~URingReceiver() {
+  /* No more buffers can be picked once the ring is unregistered */
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0x00, sizeof(reg));
+  reg.bgid = 0;
+  syscall(__NR_io_uring_register, ring_.fd(), IORING_UNREGISTER_PBUF_RING,
+          &reg, 1);
+  delete[] buffers_;
+  munmap(br_, br_size_);
+}
+
+void URingReceiver::provide(uint16_t bid) {
+  /* Not br_->bufs: in C++ the flexible array of the header is misplaced */
+  struct io_uring_buf *buf =
+      reinterpret_cast<struct io_uring_buf *>(br_) + (br_tail_ & (nbufs_ - 1));
+  buf->addr = reinterpret_cast<uintptr_t>(buffers_ + bid * buf_size_);
+  buf->len = buf_size_;
+  buf->bid = bid;
+  br_tail_++;
+  free_++;
+  __atomic_store_n(&br_->tail, br_tail_, __ATOMIC_RELEASE);
+}
+
+void URingReceiver::arm() {
+  struct io_uring_sqe *sqe = ring_.getSqe();
+  sqe->opcode = IORING_OP_RECVMSG;
+  sqe->fd = sockfd_;
+  sqe->addr = reinterpret_cast<uintptr_t>(&msg_);
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = 0;
+  sqe->user_data = RECVMSG;
+  armed_ = true;
+}
+
+int URingReceiver::receive() {
+  std::unique_lock<std::mutex> lock{br_m_};
+  for (auto &packet : packets_) {
+    if (!packet.taken_) {
+      provide(packet.bid_);
+    }
+  }
+  packets_.clear();
+  if (!armed_) {
+    /* The multishot recvmsg stops when it runs out of buffers */
+    if (free_ == 0 &&
+        !br_cv_.wait_for(lock, std::chrono::milliseconds{100},
+                         [this] { return free_ > 0; })) {
+      return 0;
+    }
+    arm();
+  }
+  lock.unlock();
+
+  if (ring_.submit(ring_.peek() == nullptr ? 1 : 0) == -1) {
+    return -1;
+  }
+  struct io_uring_cqe *cqe;
+  while (packets_.size() < batch_size_ && (cqe = ring_.peek()) != nullptr) {
+    int res = cqe->res;
+    unsigned flags = cqe->flags;
+    uint64_t user_data = cqe->user_data;
+    ring_.seen();
+    if (user_data == SHUTDOWN) {
+      continue;
+    }
+    if (!(flags & IORING_CQE_F_MORE)) {
+      armed_ = false;
+    }
+    if (!(flags & IORING_CQE_F_BUFFER)) {
+      if (res < 0 && res != -ENOBUFS && packets_.empty()) {
+        errno = -res;
+        return -1;
+      }
+      continue;
+    }
+    uint16_t bid = flags >> IORING_CQE_BUFFER_SHIFT;
+    lock.lock();
+    free_--;
+    if (res < 0) {
+      provide(bid);
+      lock.unlock();
+      continue;
+    }
+    lock.unlock();
+
+    uint8_t *buffer = buffers_ + bid * buf_size_;
+    struct io_uring_recvmsg_out *out =
+        reinterpret_cast<struct io_uring_recvmsg_out *>(buffer);
+    Packet packet;
+    packet.bid_ = bid;
+    packet.data_ = buffer + sizeof(*out) + msg_.msg_namelen;
+    packet.len_ = std::min(static_cast<size_t>(out->payloadlen), maxlen_);
+    packet.truncated_ = out->flags & MSG_TRUNC;
+    memcpy(&packet.sender_, buffer + sizeof(*out), sizeof(packet.sender_));
+    packet.sender_len_ = std::min(out->namelen, msg_.msg_namelen);
+    packet.taken_ = false;
+    packets_.push_back(packet);
+  }
+  return packets_.size();
+}
+
+uint8_t *URingReceiver::take(int i) {
+  packets_[i].taken_ = true;
+  return packets_[i].data_;
+}
+
+void URingReceiver::release(uint8_t *buffer) {
+  if (buffer == nullptr) {
+    return;
+  }
+  std::unique_lock<std::mutex> lock{br_m_};
+  provide((buffer - buffers_) / buf_size_);
+  lock.unlock();
+  br_cv_.notify_one();
+}
+
+size_t URingReceiver::length(int i) const { return packets_[i].len_; }
+
+bool URingReceiver::truncated(int i) const { return packets_[i].truncated_; }
+
+const struct sockaddr_in6 &URingReceiver::sender(int i) const {
+  return packets_[i].sender_;
+}
+
+socklen_t URingReceiver::senderLength(int i) const {
+  return packets_[i].sender_len_;
+}
@@ -0,0 +1,250 @@
+/* mtd64-ng - a lightweight multithreaded C++11 DNS64 server
+ * Based on MTD64 (https://github.com/Yoso89/MTD64)
+ * Copyright (C) 2015  Daniel Bakai <bakaid@kszk.bme.hu>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+/** @file
+ *  @brief Header for the IOUring, URingReceiver and related classes.
+ */
+
+#ifndef URING_H_INCLUDED
+#define URING_H_INCLUDED
+
+#include "batchio.h"
+#include <condition_variable>
+#include <exception>
+#include <linux/io_uring.h>
+#include <mutex>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <string>
+#include <sys/socket.h>
+#include <vector>
+
+/**
+ * An std::exception class for the io_uring classes.
+ */
+class URingException : public std::exception {
+private:
+  std::string what_; /**< Exception string */
+public:
+  /**
+   * A constructor.
+   * @param what the excpetion string
+   */
+  URingException(std::string what);
+
+  /**
+   * A getter for the exception string.
+   * @return the exception string
+   */
+  const char *what() const noexcept override;
+};
+
+/**
+ * Minimal wrapper around an io_uring instance, using the raw system calls.
+ * An IOUring must be used by one thread at a time.
+ */
+class IOUring {
+private:
+  int fd_;              /**< The io_uring file descriptor. */
+  void *sq_ptr_;        /**< Mapping of the submission queue ring. */
+  size_t sq_size_;      /**< Size of the submission queue mapping. */
+  void *cq_ptr_;        /**< Mapping of the completion queue ring. */
+  size_t cq_size_;      /**< Size of the completion queue mapping. */
+  struct io_uring_sqe *sqes_; /**< Mapping of the submission queue entries. */
+  size_t sqes_size_;    /**< Size of the submission queue entries mapping. */
+
+  unsigned *sq_head_;   /**< Submission queue head (written by the kernel). */
+  unsigned *sq_tail_;   /**< Submission queue tail. */
+  unsigned sq_mask_;    /**< Submission queue index mask. */
+  unsigned sq_entries_; /**< Number of submission queue entries. */
+  unsigned *sq_array_;  /**< Submission queue index array. */
+  unsigned sqe_tail_;   /**< Tail including the not yet submitted entries. */
+  unsigned to_submit_;  /**< Number of entries not yet submitted. */
+
+  unsigned *cq_head_;   /**< Completion queue head. */
+  unsigned *cq_tail_;   /**< Completion queue tail (written by the kernel). */
+  unsigned cq_mask_;    /**< Completion queue index mask. */
+  struct io_uring_cqe *cqes_; /**< The completion queue entries. */
+
+  /**
+   * Unmaps the rings and closes the file descriptor.
+   */
+  void cleanup();
+
+public:
+  /**
+   * Constructor.
+   * @param entries the number of submission queue entries
+   */
+  IOUring(unsigned entries);
+
+  /**
+   * Destructor.
+   */
+  ~IOUring();
+
+  /**
+   * Copy constructor, explicitly deleted.
+   */
+  IOUring(const IOUring &) = delete;
+
+  /**
+   * Copy assignment operator, explicitly deleted.
+   */
+  IOUring &operator=(const IOUring &) = delete;
+
+  /**
+   * Getter for the io_uring file descriptor.
+   * @return the file descriptor
+   */
+  int fd() const;
+
+  /**
+   * Returns a cleared submission queue entry.
+   * @return the entry, or nullptr if the submission queue is full
+   */
+  struct io_uring_sqe *getSqe();
+
+  /**
+   * Submits the prepared entries and waits for completions.
+   * @param wait_nr the number of completions to wait for
+   * @return the number of submitted entries (-1 on failure, errno is set)
+   */
+  int submit(unsigned wait_nr);
+
+  /**
+   * Returns the oldest completion queue entry without consuming it.
+   * @return the entry, or nullptr if the completion queue is empty
+   */
+  struct io_uring_cqe *peek();
+
+  /**
+   * Consumes the entry returned by peek().
+   */
+  void seen();
+};
+
+/**
+ * Receiver using io_uring multishot recvmsg with a provided buffer ring.
+ * The kernel picks a buffer from the ring for every datagram, so the
+ * receive buffers are allocated once. A buffer taken out of the batch
+ * goes back to the ring when it is released.
+ */
+class URingReceiver : public Receiver {
+private:
+  /**
+   * A received packet of the current batch.
+   */
+  struct Packet {
+    uint16_t bid_;               /**< Index of the buffer. */
+    uint8_t *data_;              /**< The payload. */
+    size_t len_;                 /**< The length of the payload. */
+    bool truncated_;             /**< Whether the payload was truncated. */
+    struct sockaddr_in6 sender_; /**< The address of the sender. */
+    socklen_t sender_len_;       /**< The length of the address. */
+    bool taken_;                 /**< Whether the buffer was taken. */
+  };
+
+  int sockfd_;          /**< The socket to receive on. */
+  size_t batch_size_;   /**< Maximum number of packets per batch. */
+  size_t maxlen_;       /**< Maximum length of a packet. */
+  IOUring ring_;        /**< The io_uring instance. */
+  struct msghdr msg_;   /**< Template of the multishot recvmsg. */
+  bool armed_;          /**< Whether the multishot recvmsg is active. */
+
+  unsigned nbufs_;      /**< Number of buffers (a power of 2). */
+  size_t buf_size_;     /**< Size of a buffer. */
+  uint8_t *buffers_;    /**< Storage of the buffers. */
+  struct io_uring_buf_ring *br_; /**< The provided buffer ring. */
+  size_t br_size_;      /**< Size of the buffer ring mapping. */
+  uint16_t br_tail_;    /**< Tail of the buffer ring. */
+  std::mutex br_m_;     /**< Mutex for the buffer ring tail. */
+  std::condition_variable
+      br_cv_;           /**< Signals released buffers when all were in use. */
+  unsigned free_;       /**< Number of buffers owned by the kernel. */
+
+  std::vector<Packet> packets_; /**< The current batch. */
+
+  /**
+   * Gives a buffer to the kernel. The caller must hold br_m_.
+   * @param bid the index of the buffer
+   */
+  void provide(uint16_t bid);
+
+  /**
+   * Submits the multishot recvmsg.
+   */
+  void arm();
+
+public:
+  /**
+   * Constructor.
+   * @param sockfd the socket to receive on
+   * @param batch_size the maximum number of packets per batch
+   * @param maxlen the maximum length of a packet
+   * @param nbufs the number of buffers (rounded up to a power of 2)
+   */
+  URingReceiver(int sockfd, size_t batch_size, size_t maxlen, unsigned nbufs);
+
+  /**
+   * Destructor.
+   */
+  ~URingReceiver();
+
+  /**
+   * Copy constructor, explicitly deleted.
+   */
+  URingReceiver(const URingReceiver &) = delete;
+
+  /**
+   * Copy assignment operator, explicitly deleted.
+   */
+  URingReceiver &operator=(const URingReceiver &) = delete;
+
+  /**
+   * Waits for at least one completion and collects at most batch_size
+   * packets. The buffers of the previous batch which were not taken are
+   * given back to the kernel.
+   * @return the number of received packets (-1 on failure, errno is set)
+   */
+  int receive() override;
+
+  /**
+   * Takes over a received packet.
+   * The buffer is owned by the ring, it must be given back with release().
+   * @param i the index of the packet
+   * @return the packet
+   */
+  uint8_t *take(int i) override;
+
+  /**
+   * Gives back a buffer returned by take() to the kernel.
+   * Can be called from any thread.
+   * @param buffer the packet
+   */
+  void release(uint8_t *buffer) override;
+
+  size_t length(int i) const override;
+  bool truncated(int i) const override;
+  const struct sockaddr_in6 &sender(int i) const override;
+  socklen_t senderLength(int i) const override;
+};
+
+#endif